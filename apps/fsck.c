@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <fs.h>
+
+int main(int argc, char *argv[])
+{
+	struct fs_fsck_report rep;
+	struct timespec start, end;
+	int nthreads = 0;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskimage> [<threads>]\n", argv[0]);
+		exit(2);
+	}
+	if (argc > 2)
+		nthreads = atoi(argv[2]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = fs_fsck(argv[1], nthreads, &rep);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (ret < 0) {
+		fprintf(stderr, "%s: cannot check '%s'\n", argv[0], argv[1]);
+		exit(2);
+	}
+
+	printf("FS Check:\n");
+	printf("files=%u\n", rep.files);
+	printf("free_blocks=%u\n", rep.free_blocks);
+	printf("bad_superblock=%u\n", rep.bad_superblock);
+	printf("bad_entries=%u\n", rep.bad_entries);
+	printf("bad_chains=%u\n", rep.bad_chains);
+	printf("size_mismatches=%u\n", rep.size_mismatches);
+	printf("cycles=%u\n", rep.cycles);
+	printf("cross_links=%u\n", rep.cross_links);
+	printf("leaked_blocks=%u\n", rep.leaked_blocks);
+	printf("bad_fat_entries=%u\n", rep.bad_fat_entries);
+	printf("bad_refs=%u\n", rep.bad_refs);
+	printf("time_us=%ld\n", (end.tv_sec - start.tv_sec) * 1000000 +
+	       (end.tv_nsec - start.tv_nsec) / 1000);
+
+	return ret ? 1 : 0;
+}
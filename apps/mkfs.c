@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b <block size>] [-s <size>[K|M|G]] [-p] "
+		"[-c] [-i] [-d] [-e] <diskimage> [<data block count>]\n", prog);
+	fprintf(stderr, "  -b  block size, a power of two from 1024 to 65536 "
+		"(default 4096)\n");
+	fprintf(stderr, "  -s  image size, when no data block count is given\n");
+	fprintf(stderr, "  -p  allocate the image on the host instead of "
+		"leaving it sparse\n");
+	fprintf(stderr, "  -c  reserve a checksum area\n");
+	fprintf(stderr, "  -i  reserve an inline area for small files\n");
+	fprintf(stderr, "  -d  reserve a deduplication reference table\n");
+	fprintf(stderr, "  -e  record the blocks of files as extents\n");
+	exit(2);
+}
+
+static int parse_size(const char *str, uint64_t *size)
+{
+	char *end;
+
+	*size = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'G': case 'g':
+		*size <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		*size <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		*size <<= 10;
+		end++;
+		break;
+	}
+	return end == str || *end != '\0' ? -1 : 0;
+}
+
+/* Number of blocks of the file system fs_format() would make, metadata
+   included, which must fit in 16-bit block indices */
+static uint64_t total_blocks(const struct fs_format_opts *opts)
+{
+	uint64_t bsize = opts->block_size ? opts->block_size : 4096;
+	uint64_t data = opts->data_blocks;
+
+	if (!data)
+		return opts->size / bsize;
+	/* superblock, FAT, root directory of 32-byte entries, data blocks */
+	return 1 + (data * sizeof(uint16_t) + bsize - 1) / bsize +
+		(FS_FILE_MAX_COUNT * 32 + bsize - 1) / bsize + data;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_format_opts opts = { 0 };
+	struct timespec start, end;
+	char *endp;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:s:pcide")) != -1) {
+		switch (opt) {
+		case 'b':
+			opts.block_size = strtoul(optarg, &endp, 0);
+			if (endp == optarg || *endp != '\0' ||
+			    opts.block_size < 1024 || opts.block_size > 65536 ||
+			    (opts.block_size & (opts.block_size - 1))) {
+				fprintf(stderr, "%s: invalid block size '%s' (a "
+					"power of two from 1024 to 65536)\n",
+					argv[0], optarg);
+				exit(2);
+			}
+			break;
+		case 's':
+			if (parse_size(optarg, &opts.size))
+				usage(argv[0]);
+			break;
+		case 'p':
+			opts.flags |= FS_FORMAT_PREALLOC;
+			break;
+		case 'c':
+			opts.flags |= FS_FORMAT_CSUM;
+			break;
+		case 'i':
+			opts.flags |= FS_FORMAT_INLINE;
+			break;
+		case 'd':
+			opts.flags |= FS_FORMAT_DEDUP;
+			break;
+		case 'e':
+			opts.flags |= FS_FORMAT_EXTENT;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || optind + 2 < argc)
+		usage(argv[0]);
+	if (optind + 1 < argc)
+		opts.data_blocks = strtoul(argv[optind + 1], NULL, 0);
+	if (!opts.data_blocks && !opts.size)
+		usage(argv[0]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (fs_format(argv[optind], &opts)) {
+		if (total_blocks(&opts) > UINT16_MAX)
+			fprintf(stderr, "%s: cannot format '%s': %llu blocks, "
+				"but a file system has at most 65535 blocks\n",
+				argv[0], argv[optind],
+				(unsigned long long)total_blocks(&opts));
+		else
+			fprintf(stderr, "%s: cannot format '%s'\n", argv[0],
+				argv[optind]);
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("Created virtual disk '%s'\n", argv[optind]);
+	if (fs_mount(argv[optind]) || fs_info() || fs_umount()) {
+		fprintf(stderr, "%s: cannot mount '%s'\n", argv[0], argv[optind]);
+		exit(1);
+	}
+	printf("time_us=%ld\n", (end.tv_sec - start.tv_sec) * 1000000 +
+	       (end.tv_nsec - start.tv_nsec) / 1000);
+
+	return 0;
+}
@@ -1,12 +1,19 @@
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -34,10 +41,153 @@ struct thread_arg {
 	char **argv;
 };
 
+/*
+ * Replay a binary recording (see struct fs_record) on @diskname, either as
+ * fast as possible or, if @timed, issuing each call at its recorded time.
+ * Written data is a fixed pattern; calls whose result differs from the
+ * recorded one are counted as divergent.
+ */
+static void replay_recording(char *diskname, FILE *trace, int timed)
+{
+	struct fs_record rec;
+	char name[FS_PATH_MAX];
+	int *fdmap = NULL;
+	size_t nfds = 0;
+	char *buf = NULL;
+	size_t buf_size = 0;
+	char mounted = 0;
+	struct timespec start, now;
+	unsigned long ops = 0, diverged = 0;
+	size_t bytes_read = 0, bytes_written = 0;
+	double elapsed;
+
+	fs_latency_reset();
+	fs_latency_enable(1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+		int fd = -1, ret = -1;
+
+		memset(name, 0, sizeof(name));
+		if (rec.name_len >= FS_PATH_MAX ||
+		    fread(name, 1, rec.name_len, trace) != rec.name_len)
+			die("Corrupted recording");
+
+		/* Map recorded file descriptors to the ones we got */
+		if (rec.fd >= 0 && (size_t)rec.fd < nfds)
+			fd = fdmap[rec.fd];
+
+		if (rec.size > buf_size) {
+			buf = realloc(buf, rec.size);
+			if (!buf)
+				die_perror("realloc");
+			memset(buf + buf_size, 'r', rec.size - buf_size);
+			buf_size = rec.size;
+		}
+
+		if (timed) {
+			struct timespec at = start;
+
+			at.tv_sec += rec.ts_ns / 1000000000;
+			at.tv_nsec += rec.ts_ns % 1000000000;
+			if (at.tv_nsec >= 1000000000) {
+				at.tv_sec++;
+				at.tv_nsec -= 1000000000;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at,
+					NULL);
+		}
+
+		switch (rec.op) {
+		case FS_OP_MOUNT:
+			ret = fs_mount(diskname);
+			mounted = !ret;
+			break;
+		case FS_OP_UMOUNT:
+			ret = fs_umount();
+			mounted = mounted && ret;
+			break;
+		case FS_OP_CREATE:
+			ret = fs_create(name);
+			break;
+		case FS_OP_DELETE:
+			ret = fs_delete(name);
+			break;
+		case FS_OP_MKDIR:
+			ret = fs_mkdir(name);
+			break;
+		case FS_OP_OPEN:
+			ret = fs_open(name);
+			if (rec.ret >= 0) {
+				if ((size_t)rec.ret >= nfds) {
+					size_t n = rec.ret + 1;
+
+					fdmap = realloc(fdmap, n * sizeof(int));
+					if (!fdmap)
+						die_perror("realloc");
+					while (nfds < n)
+						fdmap[nfds++] = -1;
+				}
+				fdmap[rec.ret] = ret;
+				/* Results are compared as recorded fds */
+				if (ret >= 0)
+					ret = rec.ret;
+			}
+			break;
+		case FS_OP_CLOSE:
+			ret = fs_close(fd);
+			break;
+		case FS_OP_STAT:
+			ret = fs_stat(fd);
+			break;
+		case FS_OP_LSEEK:
+			ret = fs_lseek(fd, rec.offset);
+			break;
+		case FS_OP_READ:
+			ret = fs_read(fd, buf, rec.size);
+			if (ret > 0)
+				bytes_read += ret;
+			break;
+		case FS_OP_WRITE:
+			ret = fs_write(fd, buf, rec.size);
+			if (ret > 0)
+				bytes_written += ret;
+			break;
+		default:
+			die("Unknown operation %u in recording", rec.op);
+		}
+
+		ops++;
+		if (ret != rec.ret)
+			diverged++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fs_latency_enable(0);
+
+	if (mounted && fs_umount())
+		die("Cannot unmount diskname");
+
+	elapsed = (now.tv_sec - start.tv_sec) +
+		(now.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Replayed %lu operations in %.3f s (%.0f ops/s)\n", ops,
+	       elapsed, ops / elapsed);
+	printf("Read %zu bytes (%.1f MB/s), wrote %zu bytes (%.1f MB/s)\n",
+	       bytes_read, bytes_read / elapsed / 1e6,
+	       bytes_written, bytes_written / elapsed / 1e6);
+	printf("%lu operations returned a different result than recorded\n",
+	       diverged);
+	fs_latency_dump();
+
+	free(buf);
+	free(fdmap);
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	struct stat st;
+	uint64_t magic;
 	char *diskname, *script;
 	FILE *fd_script;
 	char *command, *data_source, *data_description, *data, *fs_filename;
@@ -50,7 +200,7 @@ void thread_fs_script(void *arg)
 	int command_index = 1;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+		die("Usage: <diskname> <script or recording filename> [-t]");
 
 	diskname = t_arg->argv[0];
 	script = t_arg->argv[1];
@@ -60,6 +210,18 @@ void thread_fs_script(void *arg)
 	if (!fd_script)
 		die_perror("fopen");
 
+	/* Binary recordings are replayed rather than parsed line by line */
+	if (fread(&magic, sizeof(magic), 1, fd_script) == 1 &&
+	    magic == FS_RECORD_MAGIC) {
+		replay_recording(diskname, fd_script,
+				 t_arg->argc > 2 && !strcmp(t_arg->argv[2], "-t"));
+		fclose(fd_script);
+		return;
+	}
+	if (magic == FS_RECORD_MAGIC_V1)
+		die("Recording made by an older test_fs.x, record it again");
+	rewind(fd_script);
+
 	int fs_fd = -1;
 
 	/* Loop through the script and execute the specified commands */
@@ -122,6 +284,16 @@ void thread_fs_script(void *arg)
 
 			printf("DELETE successful.\n");
 
+		} else if (strcmp(command, "MKDIR") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_mkdir(fs_filename)) {
+				fs_umount();
+				die("Cannot create directory");
+			}
+
+			printf("MKDIR successful.\n");
+
 		} else if (strcmp(command, "OPEN") == 0) {
 			fs_filename = command_args[1];
 
@@ -316,63 +488,6 @@ void thread_fs_stat(void *arg)
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
 }
 
-void thread_fs_cat(void *arg)
-{
-	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fs_fd;
-	int stat, read;
-
-	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
-
-	diskname = t_arg->argv[0];
-	filename = t_arg->argv[1];
-
-	if (fs_mount(diskname))
-		die("Cannot mount diskname");
-
-	fs_fd = fs_open(filename);
-	if (fs_fd < 0) {
-		fs_umount();
-		die("Cannot open file");
-	}
-
-	stat = fs_stat(fs_fd);
-	if (stat < 0) {
-		fs_umount();
-		die("Cannot stat file");
-	}
-	if (!stat) {
-		/* Nothing to read, file is empty */
-		printf("Empty file\n");
-		return;
-	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
-
-	read = fs_read(fs_fd, buf, stat);
-
-	if (fs_close(fs_fd)) {
-		fs_umount();
-		die("Cannot close file");
-	}
-
-	if (fs_umount())
-		die("cannot unmount diskname");
-
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
-}
-
 void thread_fs_rm(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -407,7 +522,7 @@ void thread_fs_add(void *arg)
 	int written;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+		die("Usage: <diskname> <host filename> [-z]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
@@ -438,6 +553,13 @@ void thread_fs_add(void *arg)
 		die("Cannot create file");
 	}
 
+	/* Optionally store it compressed */
+	if (t_arg->argc > 2 && !strcmp(t_arg->argv[2], "-z") &&
+	    fs_compress(filename)) {
+		fs_umount();
+		die("Cannot compress file");
+	}
+
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
 		fs_umount();
@@ -461,20 +583,511 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+/* Size of the chunks moved between the host and the file system */
+#define CHUNK_SIZE (256 * 1024)
+/* Number of chunks in flight between host reads and image writes */
+#define BULK_CHUNK_COUNT 4
+/* Exports use a buffer pair: one being filled while the other is drained */
+#define EXPORT_CHUNK_COUNT 2
+
+struct chunk {
+	int file;	/* index of the file the data belongs to */
+	size_t len;
+	int last;	/* last chunk of the file */
+	char *data;
+};
+
+/*
+ * Bounded ring of chunks between a producer and a consumer thread, so that
+ * reading the next chunk overlaps with writing out the previous one. A slot
+ * belongs to the producer from chunk_get_free() until chunk_publish(), and to
+ * the consumer from chunk_get_filled() until chunk_release().
+ */
+struct chunk_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t filled, emptied;
+	struct chunk *chunks;
+	unsigned int size, head, count;
+};
+
+static void chunk_queue_init(struct chunk_queue *q, unsigned int size)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->filled, NULL);
+	pthread_cond_init(&q->emptied, NULL);
+	q->size = size;
+	q->head = q->count = 0;
+	q->chunks = calloc(size, sizeof(*q->chunks));
+	if (!q->chunks)
+		die_perror("calloc");
+	for (unsigned int i = 0; i < size; i++) {
+		q->chunks[i].data = malloc(CHUNK_SIZE);
+		if (!q->chunks[i].data)
+			die_perror("malloc");
+	}
+}
+
+static void chunk_queue_free(struct chunk_queue *q)
+{
+	for (unsigned int i = 0; i < q->size; i++)
+		free(q->chunks[i].data);
+	free(q->chunks);
+}
+
+static struct chunk *chunk_get_free(struct chunk_queue *q)
+{
+	struct chunk *chunk;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->size)
+		pthread_cond_wait(&q->emptied, &q->lock);
+	chunk = &q->chunks[(q->head + q->count) % q->size];
+	pthread_mutex_unlock(&q->lock);
+
+	return chunk;
+}
+
+static void chunk_publish(struct chunk_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->count++;
+	pthread_cond_signal(&q->filled);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static struct chunk *chunk_get_filled(struct chunk_queue *q)
+{
+	struct chunk *chunk;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0)
+		pthread_cond_wait(&q->filled, &q->lock);
+	chunk = &q->chunks[q->head];
+	pthread_mutex_unlock(&q->lock);
+
+	return chunk;
+}
+
+static void chunk_release(struct chunk_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+	pthread_cond_signal(&q->emptied);
+	pthread_mutex_unlock(&q->lock);
+}
+
+struct bulk_file {
+	char *path;
+	const char *name;
+	size_t size;
+};
+
+struct bulk_add {
+	struct chunk_queue q;
+	struct bulk_file *files;
+	int nfiles;
+};
+
+static void bulk_list_add(struct bulk_file **files, int *nfiles, char *path)
+{
+	struct stat st;
+	const char *name;
+
+	if (stat(path, &st))
+		die_perror("stat");
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(path);
+		struct dirent *ent;
+
+		if (!dir)
+			die_perror("opendir");
+		while ((ent = readdir(dir)) != NULL) {
+			char *sub;
+
+			if (ent->d_name[0] == '.')
+				continue;
+			sub = malloc(strlen(path) + strlen(ent->d_name) + 2);
+			if (!sub)
+				die_perror("malloc");
+			sprintf(sub, "%s/%s", path, ent->d_name);
+			bulk_list_add(files, nfiles, sub);
+		}
+		closedir(dir);
+		return;
+	}
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", path);
+
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	if (strlen(name) >= FS_FILENAME_LEN)
+		die("File name too long: %s\n", name);
+
+	*files = realloc(*files, (*nfiles + 1) * sizeof(**files));
+	if (!*files)
+		die_perror("realloc");
+	(*files)[*nfiles].path = path;
+	(*files)[*nfiles].name = name;
+	(*files)[*nfiles].size = st.st_size;
+	(*nfiles)++;
+}
+
+static void *bulk_reader(void *arg)
+{
+	struct bulk_add *bulk = arg;
+
+	for (int i = 0; i < bulk->nfiles; i++) {
+		int fd = open(bulk->files[i].path, O_RDONLY);
+		int last = 0;
+
+		if (fd < 0)
+			die_perror("open");
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		while (!last) {
+			struct chunk *chunk = chunk_get_free(&bulk->q);
+			ssize_t len = read(fd, chunk->data, CHUNK_SIZE);
+
+			if (len < 0)
+				die_perror("read");
+			chunk->file = i;
+			chunk->len = len;
+			chunk->last = last = (len < CHUNK_SIZE);
+			chunk_publish(&bulk->q);
+		}
+		close(fd);
+	}
+
+	return NULL;
+}
+
+void thread_fs_bulkadd(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct bulk_add bulk = { .files = NULL, .nfiles = 0 };
+	pthread_t reader;
+	char *diskname;
+	int fs_fd = -1, cur = -1;
+	size_t written = 0, total = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host file or directory>...");
+
+	diskname = t_arg->argv[0];
+	for (int i = 1; i < t_arg->argc; i++)
+		bulk_list_add(&bulk.files, &bulk.nfiles, t_arg->argv[i]);
+
+	chunk_queue_init(&bulk.q, BULK_CHUNK_COUNT);
+
+	/* Every file goes in under a single mount: metadata is flushed once */
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (pthread_create(&reader, NULL, bulk_reader, &bulk))
+		die("Cannot start reader thread");
+
+	while (cur < bulk.nfiles - 1 || fs_fd >= 0) {
+		struct chunk *chunk = chunk_get_filled(&bulk.q);
+		struct bulk_file *file = &bulk.files[chunk->file];
+		int ret;
+
+		if (chunk->file != cur) {
+			cur = chunk->file;
+			if (fs_create(file->name)) {
+				fs_umount();
+				die("Cannot create file '%s'", file->name);
+			}
+			fs_fd = fs_open(file->name);
+			if (fs_fd < 0) {
+				fs_umount();
+				die("Cannot open file");
+			}
+			/* Allocate the whole chain up front from the known size */
+			fs_reserve(fs_fd, file->size);
+			written = 0;
+		}
+
+		ret = fs_write(fs_fd, chunk->data, chunk->len);
+		if (ret > 0)
+			written += ret;
+
+		if (chunk->last) {
+			if (fs_close(fs_fd)) {
+				fs_umount();
+				die("Cannot close file");
+			}
+			fs_fd = -1;
+			total += written;
+			printf("Wrote file '%s' (%zu/%zu bytes)\n",
+			       file->name, written, file->size);
+		}
+
+		chunk_release(&bulk.q);
+	}
+
+	pthread_join(reader, NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote %d files (%zu bytes)\n", bulk.nfiles, total);
+
+	chunk_queue_free(&bulk.q);
+	free(bulk.files);
+}
+
+struct export {
+	struct chunk_queue q;
+	/* Names of the exported files, indexed by chunk file */
+	char (*names)[FS_FILENAME_LEN];
+	/* Host directory receiving the files, if exporting several */
+	const char *dir;
+	/* Host file receiving the file, or NULL for standard output */
+	const char *path;
+};
+
+static int export_open(struct export *exp, int file)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (exp->dir) {
+		snprintf(path, sizeof(path), "%s/%s", exp->dir,
+			 exp->names[file]);
+	} else if (exp->path) {
+		snprintf(path, sizeof(path), "%s", exp->path);
+	} else {
+		return STDOUT_FILENO;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror("open");
+	return fd;
+}
+
+static void *export_writer(void *arg)
+{
+	struct export *exp = arg;
+	int out = -1;
+
+	for (;;) {
+		struct chunk *chunk = chunk_get_filled(&exp->q);
+		size_t done = 0;
+
+		/* A chunk without a file marks the end of the export */
+		if (chunk->file < 0) {
+			chunk_release(&exp->q);
+			break;
+		}
+
+		if (out < 0)
+			out = export_open(exp, chunk->file);
+
+		while (done < chunk->len) {
+			ssize_t ret = write(out, chunk->data + done,
+					    chunk->len - done);
+			if (ret < 0)
+				die_perror("write");
+			done += ret;
+		}
+
+		if (chunk->last) {
+			if (out != STDOUT_FILENO)
+				close(out);
+			out = -1;
+		}
+		chunk_release(&exp->q);
+	}
+
+	return NULL;
+}
+
+/* Read file @name chunk by chunk into the export queue */
+static size_t export_file(struct export *exp, int file, const char *name)
+{
+	size_t total = 0;
+	int fs_fd, last = 0;
+
+	fs_fd = fs_open(name);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file '%s'", name);
+	}
+
+	while (!last) {
+		struct chunk *chunk = chunk_get_free(&exp->q);
+		int read = fs_read(fs_fd, chunk->data, CHUNK_SIZE);
+
+		if (read < 0) {
+			fs_umount();
+			die("Cannot read file '%s'", name);
+		}
+		chunk->file = file;
+		chunk->len = read;
+		chunk->last = last = (read < CHUNK_SIZE);
+		chunk_publish(&exp->q);
+		total += read;
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	return total;
+}
+
+/*
+ * Stream @nfiles files to the host with constant memory: the file system is
+ * read into one buffer of a pair while the other is written out by a helper
+ * thread.
+ */
+static void export_files(struct export *exp, int nfiles)
+{
+	pthread_t writer;
+	struct chunk *end;
+
+	chunk_queue_init(&exp->q, EXPORT_CHUNK_COUNT);
+	if (pthread_create(&writer, NULL, export_writer, exp))
+		die("Cannot start writer thread");
+
+	for (int i = 0; i < nfiles; i++) {
+		size_t len = export_file(exp, i, exp->names[i]);
+
+		if (exp->dir)
+			printf("Exported file '%s' (%zu bytes)\n",
+			       exp->names[i], len);
+	}
+
+	end = chunk_get_free(&exp->q);
+	end->file = -1;
+	chunk_publish(&exp->q);
+
+	pthread_join(writer, NULL);
+	chunk_queue_free(&exp->q);
+}
+
+static void export_one(char *diskname, char *filename, const char *path)
+{
+	char name[FS_FILENAME_LEN];
+	struct export exp = { .names = &name, .dir = NULL, .path = path };
+	int fs_fd, stat;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	stat = fs_stat(fs_fd);
+	fs_close(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+
+	if (!path) {
+		if (!stat) {
+			/* Nothing to read, file is empty */
+			fs_umount();
+			printf("Empty file\n");
+			return;
+		}
+		printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+		printf("Content of the file:\n");
+		fflush(stdout);
+	}
+
+	snprintf(name, sizeof(name), "%s", filename);
+	export_files(&exp, 1);
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	if (path)
+		printf("Exported file '%s' to '%s' (%d bytes)\n", filename,
+		       path, stat);
+}
+
+void thread_fs_cat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	export_one(t_arg->argv[0], t_arg->argv[1], NULL);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <host filename>");
+
+	export_one(t_arg->argv[0], t_arg->argv[1], t_arg->argv[2]);
+}
+
+void thread_fs_exportall(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct export exp = { .names = NULL, .path = NULL };
+	char name[FS_FILENAME_LEN];
+	int pos = 0, nfiles = 0;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <host directory>");
+
+	exp.dir = t_arg->argv[1];
+	if (mkdir(exp.dir, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	while (fs_readdir(&pos, name) == 0) {
+		exp.names = realloc(exp.names, (nfiles + 1) * sizeof(*exp.names));
+		if (!exp.names)
+			die_perror("realloc");
+		memcpy(exp.names[nfiles++], name, FS_FILENAME_LEN);
+	}
+
+	export_files(&exp, nfiles);
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Exported %d files\n", nfiles);
+	free(exp.names);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("Usage: <diskname> [dir]");
 
 	diskname = t_arg->argv[0];
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (t_arg->argc > 1) {
+		if (fs_lsdir(t_arg->argv[1])) {
+			fs_umount();
+			die("Cannot list directory");
+		}
+	} else {
+		fs_ls();
+	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
@@ -486,10 +1099,14 @@ void thread_fs_info(void *arg)
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("Usage: <diskname> [-s]");
 
 	diskname = t_arg->argv[0];
 
+	/* Optionally append the I/O counters (covering the mount itself) */
+	if (t_arg->argc > 1 && !strcmp(t_arg->argv[1], "-s"))
+		fs_stats_show(1);
+
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
@@ -499,6 +1116,318 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_latency(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
+
+	/* Run the script with histograms on, then report its tail latency */
+	fs_latency_reset();
+	fs_latency_enable(1);
+	thread_fs_script(arg);
+	fs_latency_enable(0);
+
+	fs_latency_dump();
+}
+
+void thread_fs_trace(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <script filename> <trace filename>");
+
+	/* Run the script, then save what the tracepoints recorded */
+	thread_fs_script(arg);
+
+	if (fs_trace_dump(t_arg->argv[2]))
+		die("Cannot dump trace");
+}
+
+void thread_fs_csum(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_csum_enable())
+		die("Cannot enable checksums");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Enabled checksums\n");
+}
+
+void thread_fs_inline(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_inline_enable())
+		die("Cannot enable inline files");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Enabled inline files\n");
+}
+
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_dedup_enable())
+		die("Cannot enable deduplication");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Enabled deduplication\n");
+}
+
+void thread_fs_extent(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_extent_enable())
+		die("Cannot enable extents");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Enabled extents\n");
+}
+
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *path;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <path>");
+
+	diskname = t_arg->argv[0];
+	path = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(path)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory %s\n", path);
+}
+
+void thread_fs_scrub(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int corrupted;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	corrupted = fs_scrub();
+	if (corrupted < 0)
+		die("Cannot scrub diskname");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Scrubbed: %d corrupted blocks\n", corrupted);
+	if (corrupted)
+		exit(1);
+}
+
+void thread_fs_snap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot(name)) {
+		fs_umount();
+		die("Cannot take snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Took snapshot %s\n", name);
+}
+
+void thread_fs_snaprm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(name)) {
+		fs_umount();
+		die("Cannot delete snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Deleted snapshot %s\n", name);
+}
+
+void thread_fs_snapls(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_snapshot_ls();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Reads a file with up to <depth> asynchronous requests of one chunk each in
+   flight, and checks the result against a synchronous read */
+#define AREAD_CHUNK 4096
+
+void thread_fs_aread(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_completion comps[64];
+	struct pollfd pfd = { .events = POLLIN };
+	unsigned int depth = 16;
+	size_t size, chunks, next = 0, done = 0;
+	char *async_buf, *sync_buf;
+	int fd, n, i;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename> [<depth>]");
+	if (t_arg->argc > 2)
+		depth = atoi(t_arg->argv[2]);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	fd = fs_open(t_arg->argv[1]);
+	if (fd < 0)
+		die("Cannot open file");
+	size = fs_stat(fd);
+	chunks = (size + AREAD_CHUNK - 1) / AREAD_CHUNK;
+	async_buf = malloc(size + 1);
+	sync_buf = malloc(size + 1);
+	if (!async_buf || !sync_buf)
+		die_perror("malloc");
+
+	pfd.fd = fs_async_start(depth);
+	if (pfd.fd < 0)
+		die("Cannot start the asynchronous engine");
+
+	while (done < chunks) {
+		/* Keep the queue full, then sleep until something completes */
+		while (next < chunks &&
+		       fs_read_async(fd, async_buf + next * AREAD_CHUNK,
+				     AREAD_CHUNK, next * AREAD_CHUNK, next) == 0)
+			next++;
+		if (poll(&pfd, 1, -1) < 0)
+			die_perror("poll");
+
+		n = fs_async_reap(comps, ARRAY_SIZE(comps));
+		for (i = 0; i < n; i++) {
+			size_t want = size - comps[i].user_data * AREAD_CHUNK;
+
+			if (want > AREAD_CHUNK)
+				want = AREAD_CHUNK;
+			if (comps[i].result != (int)want)
+				die("chunk %" PRIu64 ": read %d bytes instead of %zu",
+				    comps[i].user_data, comps[i].result, want);
+		}
+		done += n;
+	}
+	fs_async_stop();
+
+	fs_lseek(fd, 0);
+	if (fs_read(fd, sync_buf, size) != (int)size ||
+	    memcmp(async_buf, sync_buf, size))
+		die("asynchronous and synchronous reads differ");
+
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Read file '%s' asynchronously (%zu bytes, depth %u)\n",
+	       t_arg->argv[1], size, depth);
+	free(async_buf);
+	free(sync_buf);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -514,10 +1443,26 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "bulkadd",	thread_fs_bulkadd },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
+	{ "export",	thread_fs_export },
+	{ "exportall",	thread_fs_exportall },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "replay",	thread_fs_script },
+	{ "latency",	thread_fs_latency },
+	{ "trace",	thread_fs_trace },
+	{ "csum",	thread_fs_csum },
+	{ "inline",	thread_fs_inline },
+	{ "dedup",	thread_fs_dedup },
+	{ "extent",	thread_fs_extent },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "scrub",	thread_fs_scrub },
+	{ "aread",	thread_fs_aread },
+	{ "snap",	thread_fs_snap },
+	{ "snaprm",	thread_fs_snaprm },
+	{ "snapls",	thread_fs_snapls }
 };
 
 void usage(char *program)
@@ -546,6 +1491,10 @@ int main(int argc, char **argv)
 	argc--;
 	argv++;
 
+	/* Bypass the host page cache when asked to */
+	if (getenv("FS_DIRECT"))
+		fs_direct_enable(1);
+
 	cmd = argv[0];
 	arg.argc = --argc;
 	arg.argv = &argv[1];
@@ -0,0 +1,97 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fs.h>
+
+/*
+ * Convert a libfs trace dump (see fs_trace_dump()) into the Chrome trace
+ * event JSON format, which can be loaded in chrome://tracing or Perfetto.
+ */
+
+static void print_args(const struct fs_trace_record *rec, FILE *out)
+{
+	switch (rec->event) {
+	case FS_TRACE_BLOCK_READ:
+	case FS_TRACE_BLOCK_WRITE:
+		fprintf(out, "{\"block\":%" PRIu64 "}", rec->arg0);
+		break;
+	case FS_TRACE_ALLOC:
+		fprintf(out, "{\"block\":%" PRIu64 ",\"scanned\":%" PRIu64 "}",
+			rec->arg0, rec->arg1);
+		break;
+	case FS_TRACE_FAT_SET:
+		fprintf(out, "{\"entry\":%" PRIu64 ",\"value\":%" PRIu64 "}",
+			rec->arg0, rec->arg1);
+		break;
+	default:
+		fprintf(out, "{\"fd\":%" PRId64 ",\"arg\":%" PRIu64 "}",
+			(int64_t)rec->arg0, rec->arg1);
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_trace_header hdr;
+	struct fs_trace_record rec;
+	FILE *in, *out = stdout;
+	uint64_t i, base = UINT64_MAX;
+	long start;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <trace dump> [<json file>]\n",
+			argv[0]);
+		exit(1);
+	}
+
+	in = fopen(argv[1], "r");
+	if (!in) {
+		perror("fopen");
+		exit(1);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    hdr.magic != FS_TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a libfs trace dump\n", argv[1]);
+		exit(1);
+	}
+
+	if (argc > 2) {
+		out = fopen(argv[2], "w");
+		if (!out) {
+			perror("fopen");
+			exit(1);
+		}
+	}
+
+	/* Timestamps are shown relative to the earliest record */
+	start = ftell(in);
+	for (i = 0; i < hdr.count && fread(&rec, sizeof(rec), 1, in) == 1; i++)
+		if (rec.ts_ns < base)
+			base = rec.ts_ns;
+	fseek(in, start, SEEK_SET);
+
+	fprintf(out, "{\"traceEvents\":[\n");
+	for (i = 0; i < hdr.count && fread(&rec, sizeof(rec), 1, in) == 1; i++) {
+		fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+			"\"pid\":1,\"tid\":%" PRIu32 ",",
+			i ? ",\n" : "", fs_trace_event_name(rec.event),
+			rec.phase, (rec.ts_ns - base) / 1000.0, rec.tid);
+		if (rec.phase == 'i')
+			fprintf(out, "\"s\":\"t\",");
+		if (rec.phase != 'E') {
+			fprintf(out, "\"args\":");
+			print_args(&rec, out);
+		} else {
+			fprintf(out, "\"args\":{}");
+		}
+		fprintf(out, "}");
+	}
+	fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE /* for PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "fs.h"
+
+/*
+ * Asynchronous engine.
+ *
+ * Requests are queued in a submission ring and performed in order by a
+ * worker thread, which appends their results to a completion ring and bumps
+ * an eventfd. Both rings have room for the requests in flight: a request
+ * counts from its submission until its completion is reaped, so neither can
+ * overflow.
+ */
+
+int aio_running;
+pthread_mutex_t aio_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+struct aio_request {
+	int write;
+	int fd;
+	void *buf;
+	size_t count;
+	size_t offset;
+	uint64_t user_data;
+};
+
+static struct {
+	/* Rings, indexed modulo @depth */
+	struct aio_request *sq;
+	struct fs_completion *cq;
+	unsigned int depth;
+	uint64_t sq_head, sq_tail;
+	uint64_t cq_head, cq_tail;
+	/* Requests submitted and not yet reaped */
+	unsigned int inflight;
+	int stopping;
+	int efd;
+	pthread_t worker;
+	/* Protects the rings, separate from aio_lock so that submitting and
+	   reaping never wait for the request being performed */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} aio = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void aio_signal(void)
+{
+	uint64_t one = 1;
+
+	/* The counter cannot overflow with one bump per request */
+	if (write(aio.efd, &one, sizeof(one)) < 0)
+		return;
+}
+
+static void *aio_worker(void *arg)
+{
+	struct aio_request req;
+	int result;
+
+	(void)arg;
+	pthread_mutex_lock(&aio.lock);
+	for (;;) {
+		while (aio.sq_head == aio.sq_tail && !aio.stopping)
+			pthread_cond_wait(&aio.cond, &aio.lock);
+		if (aio.sq_head == aio.sq_tail)
+			break;
+		req = aio.sq[aio.sq_head++ % aio.depth];
+		pthread_mutex_unlock(&aio.lock);
+
+		/* Seek and transfer as a single call */
+		pthread_mutex_lock(&aio_lock);
+		if (fs_lseek(req.fd, req.offset))
+			result = -1;
+		else if (req.write)
+			result = fs_write(req.fd, req.buf, req.count);
+		else
+			result = fs_read(req.fd, req.buf, req.count);
+		pthread_mutex_unlock(&aio_lock);
+
+		pthread_mutex_lock(&aio.lock);
+		aio.cq[aio.cq_tail % aio.depth].user_data = req.user_data;
+		aio.cq[aio.cq_tail % aio.depth].result = result;
+		aio.cq_tail++;
+		aio_signal();
+	}
+	pthread_mutex_unlock(&aio.lock);
+
+	return NULL;
+}
+
+int fs_async_start(unsigned int depth)
+{
+	if (aio_running || !depth)
+		return -1;
+
+	aio.sq = calloc(depth, sizeof(*aio.sq));
+	aio.cq = calloc(depth, sizeof(*aio.cq));
+	aio.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (!aio.sq || !aio.cq || aio.efd < 0)
+		goto fail;
+
+	aio.depth = depth;
+	aio.sq_head = aio.sq_tail = 0;
+	aio.cq_head = aio.cq_tail = 0;
+	aio.inflight = 0;
+	aio.stopping = 0;
+	if (pthread_create(&aio.worker, NULL, aio_worker, NULL))
+		goto fail;
+
+	aio_running = 1;
+	return aio.efd;
+
+fail:
+	if (aio.efd >= 0)
+		close(aio.efd);
+	free(aio.sq);
+	free(aio.cq);
+	aio.sq = NULL;
+	aio.cq = NULL;
+	return -1;
+}
+
+int fs_async_stop(void)
+{
+	if (!aio_running)
+		return -1;
+
+	pthread_mutex_lock(&aio.lock);
+	aio.stopping = 1;
+	pthread_cond_signal(&aio.cond);
+	pthread_mutex_unlock(&aio.lock);
+	pthread_join(aio.worker, NULL);
+
+	aio_running = 0;
+	close(aio.efd);
+	free(aio.sq);
+	free(aio.cq);
+	aio.sq = NULL;
+	aio.cq = NULL;
+	return 0;
+}
+
+static int aio_submit(int write, int fd, void *buf, size_t count,
+		      size_t offset, uint64_t user_data)
+{
+	struct aio_request *req;
+
+	if (!aio_running || !buf)
+		return -1;
+
+	pthread_mutex_lock(&aio.lock);
+	if (aio.inflight == aio.depth) {
+		pthread_mutex_unlock(&aio.lock);
+		return -1;
+	}
+	req = &aio.sq[aio.sq_tail++ % aio.depth];
+	req->write = write;
+	req->fd = fd;
+	req->buf = buf;
+	req->count = count;
+	req->offset = offset;
+	req->user_data = user_data;
+	aio.inflight++;
+	pthread_cond_signal(&aio.cond);
+	pthread_mutex_unlock(&aio.lock);
+
+	return 0;
+}
+
+int fs_read_async(int fd, void *buf, size_t count, size_t offset,
+		  uint64_t user_data)
+{
+	return aio_submit(0, fd, buf, count, offset, user_data);
+}
+
+int fs_write_async(int fd, void *buf, size_t count, size_t offset,
+		   uint64_t user_data)
+{
+	return aio_submit(1, fd, buf, count, offset, user_data);
+}
+
+int fs_async_reap(struct fs_completion *comps, int max)
+{
+	uint64_t count;
+	int n = 0;
+
+	if (!aio_running || !comps)
+		return -1;
+
+	pthread_mutex_lock(&aio.lock);
+	/* Clear the eventfd first: a completion added from now on bumps it
+	   again, so none can be left behind unsignaled */
+	if (read(aio.efd, &count, sizeof(count)) < 0)
+		count = 0; /* EAGAIN: nothing was signaled */
+	while (n < max && aio.cq_head != aio.cq_tail)
+		comps[n++] = aio.cq[aio.cq_head++ % aio.depth];
+	aio.inflight -= n;
+	if (aio.cq_head != aio.cq_tail)
+		aio_signal();
+	pthread_mutex_unlock(&aio.lock);
+
+	return n;
+}
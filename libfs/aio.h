@@ -0,0 +1,34 @@
+#ifndef _AIO_H
+#define _AIO_H
+
+#include <pthread.h>
+
+/* Non-zero while the asynchronous engine is running */
+extern int aio_running;
+
+/* Non-zero from the start of the background reclaimer of fs_delete() until
+   fs_umount() stops it */
+extern int reclaim_running;
+
+/* Serializes libfs calls between the engine's worker and other threads */
+extern pthread_mutex_t aio_lock;
+
+static inline void aio_scope_end(int *locked)
+{
+	if (*locked)
+		pthread_mutex_unlock(&aio_lock);
+}
+
+/*
+ * Make the rest of the enclosing function exclusive with the requests run by
+ * the asynchronous engine and with the background reclaimer. The lock is
+ * recursive, as libfs calls may call one another; when neither is running the
+ * cost is two loads and branches on entry and one on exit.
+ */
+#define AIO_SCOPE()							\
+	int __aio_scope __attribute__((cleanup(aio_scope_end))) =	\
+		aio_running ||						\
+		__atomic_load_n(&reclaim_running, __ATOMIC_ACQUIRE) ?	\
+		(pthread_mutex_lock(&aio_lock), 1) : 0
+
+#endif /* _AIO_H */
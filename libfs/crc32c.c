@@ -0,0 +1,188 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+/* CRC32C polynomial, bit-reflected */
+#define POLY 0x82f63b78
+
+static uint32_t table[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	crc = ~crc;
+	while (len && ((uintptr_t)p & 7)) {
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = table[7][v & 0xff] ^
+			table[6][(v >> 8) & 0xff] ^
+			table[5][(v >> 16) & 0xff] ^
+			table[4][(v >> 24) & 0xff] ^
+			table[3][(v >> 32) & 0xff] ^
+			table[2][(v >> 40) & 0xff] ^
+			table[1][(v >> 48) & 0xff] ^
+			table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_serial(uint32_t crc, const unsigned char *p,
+				 size_t len)
+{
+	uint64_t c = crc;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+
+	return c;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	return ~crc32c_hw_serial(~crc, buf, len);
+}
+
+/* a * b modulo POLY, both bit-reflected */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1u << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^n modulo POLY, bit-reflected */
+static uint32_t xpow(uint64_t n)
+{
+	uint32_t r = 1u << 31, x2k = 1u << 30; /* x^0 and x^1 */
+
+	while (n) {
+		if (n & 1)
+			r = multmodp(x2k, r);
+		x2k = multmodp(x2k, x2k);
+		n >>= 1;
+	}
+	return r;
+}
+
+/*
+ * Length of each of the three streams, and the constants that shift a
+ * stream's checksum past one and two streams: multiplying by x^(8n - 33)
+ * with PCLMULQDQ and reducing with crc32 gives a shift by n bytes.
+ */
+static __thread struct {
+	size_t stream;
+	uint64_t k1, k2;
+} shift;
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw_3way(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t stream = (len / 24) * 8;
+	uint64_t c0 = ~crc, c1 = 0, c2 = 0;
+	__m128i r;
+
+	if (stream < 256)
+		return crc32c_hw(crc, buf, len);
+
+	if (shift.stream != stream) {
+		shift.k1 = xpow(8 * stream - 33);
+		shift.k2 = xpow(16 * stream - 33);
+		shift.stream = stream;
+	}
+
+	for (size_t i = 0; i < stream; i += 8) {
+		uint64_t v0, v1, v2;
+
+		memcpy(&v0, p + i, 8);
+		memcpy(&v1, p + stream + i, 8);
+		memcpy(&v2, p + 2 * stream + i, 8);
+		c0 = _mm_crc32_u64(c0, v0);
+		c1 = _mm_crc32_u64(c1, v1);
+		c2 = _mm_crc32_u64(c2, v2);
+	}
+
+	/* crc(s0 s1 s2) = shift(c0, 2 streams) ^ shift(c1, 1 stream) ^ c2 */
+	r = _mm_xor_si128(
+		_mm_clmulepi64_si128(_mm_cvtsi64_si128(c0),
+				     _mm_cvtsi64_si128(shift.k2), 0x00),
+		_mm_clmulepi64_si128(_mm_cvtsi64_si128(c1),
+				     _mm_cvtsi64_si128(shift.k1), 0x00));
+	c2 ^= _mm_crc32_u64(0, _mm_cvtsi128_si64(r));
+
+	return ~crc32c_hw_serial(c2, p + 3 * stream, len - 3 * stream);
+}
+
+#endif /* __x86_64__ */
+
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t) = crc32c_sw;
+
+__attribute__((constructor)) static void crc32c_init(void)
+{
+	for (int n = 0; n < 256; n++) {
+		uint32_t crc = n;
+
+		for (int k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+		table[0][n] = crc;
+	}
+	for (int n = 0; n < 256; n++)
+		for (int k = 1; k < 8; k++)
+			table[k][n] = table[0][table[k - 1][n] & 0xff] ^
+				(table[k - 1][n] >> 8);
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		if (__builtin_cpu_supports("pclmul"))
+			crc32c_impl = crc32c_hw_3way;
+		else
+			crc32c_impl = crc32c_hw;
+	}
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return crc32c_impl(crc, buf, len);
+}
@@ -0,0 +1,21 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC32C (Castagnoli) checksum
+ * @crc: Checksum of the preceding data, or 0 to start a new checksum
+ * @buf: Data
+ * @len: Length of @buf in bytes
+ *
+ * Uses the SSE4.2 crc32 instruction, with three interleaved streams combined
+ * through PCLMULQDQ on long buffers, when the CPU supports them, and a
+ * slice-by-8 table otherwise.
+ *
+ * Return: Checksum of the data covered by @crc followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* _CRC32C_H */
@@ -1,84 +1,563 @@
+#define _GNU_SOURCE /* for fallocate() */
+#include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "latency.h"
+#include "trace.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Arrangement of the member images */
+enum disk_layout {
+	/* A single image */
+	DISK_SINGLE,
+	/* Units of the disk go to each member in turn */
+	DISK_STRIPE,
+	/* Every member holds the whole disk, and reads of each unit go to
+	   one member in turn */
+	DISK_MIRROR,
+};
+
+/* Unit spreading the reads of a mirrored disk: large enough to keep the
+   sequential reads of each member sequential */
+#define MIRROR_UNIT (256 * 1024)
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* File descriptor of each member image */
+	int fds[BLOCK_DISK_MEMBERS_MAX];
+	/* Number of member images, 0 if no disk is open */
+	int members;
+	enum disk_layout layout;
+	/* Stripe unit in bytes */
+	size_t unit;
+	/* Members of a mirrored disk that failed, and are no longer used */
+	int failed[BLOCK_DISK_MEMBERS_MAX];
+	/* Files marking each member of a mirrored disk as failed, which keep it
+	   out of use when the disk is opened again, until it is resynced */
+	char *stale[BLOCK_DISK_MEMBERS_MAX];
 	/* Block count */
 	size_t bcount;
+	/* Block size */
+	size_t bsize;
+	/* Size of the disk, adding up the members of a striped disk */
+	off_t size;
+	/* Opened with O_DIRECT */
+	int direct;
+	/* The host file system cannot punch holes in the members */
+	int no_discard;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk;
+
+/* I/O counters */
+static struct block_stats stats;
+
+/* Parses @diskname into @disk.layout, @disk.unit and the names of the member
+   images, which point into @copy, a copy of @diskname to free afterwards */
+static int disk_parse(const char *diskname, char **copy,
+		      char *names[BLOCK_DISK_MEMBERS_MAX])
+{
+	char *list, *end, *save;
+	int n = 0;
+
+	disk.layout = DISK_SINGLE;
+	disk.unit = 0;
+	if (!(*copy = strdup(diskname)))
+		return -1;
+
+	if (!strncmp(diskname, "mirror:", 7)) {
+		/* mirror:<image>,<image>... */
+		disk.layout = DISK_MIRROR;
+		disk.unit = MIRROR_UNIT;
+		list = *copy + 7;
+	} else if (!strncmp(diskname, "stripe:", 7)) {
+		/* stripe:<unit>[K|M]:<image>,<image>... */
+		disk.layout = DISK_STRIPE;
+		disk.unit = strtoul(*copy + 7, &end, 0);
+		if (*end == 'K' || *end == 'k')
+			disk.unit <<= 10, end++;
+		else if (*end == 'M' || *end == 'm')
+			disk.unit <<= 20, end++;
+		if (*end != ':' || !disk.unit || disk.unit % BLOCK_SIZE) {
+			block_error("invalid stripe unit in '%s'", diskname);
+			return -1;
+		}
+		list = end + 1;
+	} else {
+		names[0] = *copy;
+		return 1;
+	}
+
+	while ((names[n] = strtok_r(list, ",", &save))) {
+		list = NULL;
+		if (++n == BLOCK_DISK_MEMBERS_MAX)
+			break;
+	}
+	if (n < 1 || strtok_r(NULL, ",", &save)) {
+		block_error("invalid member list in '%s'", diskname);
+		return -1;
+	}
+	return n;
+}
+
+/* Returns the size of member @m of a striped disk of @size bytes */
+static off_t stripe_member_size(off_t size, int m)
+{
+	off_t stripes = size / disk.unit, len;
+
+	len = stripes / disk.members * disk.unit;
+	if (m < stripes % disk.members)
+		len += disk.unit;
+	else if (m == stripes % disk.members)
+		len += size % disk.unit;
+	return len;
+}
+
+/* Maps byte @off of the disk to a member, returned, and an offset in it */
+static int disk_map(off_t off, off_t *moff)
+{
+	off_t stripe;
+
+	int member;
+
+	if (disk.layout == DISK_SINGLE) {
+		*moff = off;
+		return 0;
+	}
+
+	stripe = off / disk.unit;
+	if (disk.layout == DISK_MIRROR) {
+		/* the next member in working order */
+		*moff = off;
+		member = stripe % disk.members;
+		while (disk.failed[member])
+			member = (member + 1) % disk.members;
+		return member;
+	}
+
+	*moff = stripe / disk.members * disk.unit + off % disk.unit;
+	return stripe % disk.members;
+}
+
+/* Takes member @m of a mirrored disk out of use after an I/O error, unless it
+   is the last one working, in which case -1 is returned */
+static int mirror_fail(int m)
+{
+	int n, fd;
+
+	for (n = 0; n < disk.members; n++) {
+		if (n != m && !disk.failed[n]) {
+			block_error("member %d failed, using the others", m);
+			disk.failed[m] = 1;
+			stats.failovers++;
+
+			/* The member misses the writes from now on */
+			fd = open(disk.stale[m], O_WRONLY | O_CREAT, 0644);
+			if (fd < 0)
+				block_error("cannot create '%s': %s",
+					    disk.stale[m], strerror(errno));
+			else
+				close(fd);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Names the files marking the @count members @names of a mirrored disk as
+   failed, "<image>.stale". A new disk has none of them; otherwise the members
+   they mark are taken out of use, unless all of them are */
+static int mirror_stale_init(char *names[], int count, int create)
+{
+	int n, working = 0;
+
+	for (n = 0; n < count; n++) {
+		if (asprintf(&disk.stale[n], "%s.stale", names[n]) < 0) {
+			disk.stale[n] = NULL;
+			block_error("cannot allocate the name of '%s.stale'",
+				    names[n]);
+			return -1;
+		}
+
+		if (create) {
+			if (unlink(disk.stale[n]) && errno != ENOENT) {
+				perror("unlink");
+				return -1;
+			}
+		} else if (!access(disk.stale[n], F_OK)) {
+			block_error("member '%s' is out of date, not using it",
+				    names[n]);
+			disk.failed[n] = 1;
+		} else {
+			working++;
+		}
+	}
+
+	if (!create && !working) {
+		block_error("every member is out of date");
+		return -1;
+	}
+	return 0;
+}
+
+/* Writes the block at byte @off of a mirrored disk to every working member */
+static int mirror_write(const void *buf, off_t off)
+{
+	int n;
+
+	for (n = 0; n < disk.members; n++) {
+		if (disk.failed[n] || pwrite(disk.fds[n], buf, disk.bsize,
+					     off) >= 0)
+			continue;
+		perror("pwrite");
+		if (mirror_fail(n))
+			return -1;
+	}
+	return 0;
+}
+
+static void disk_close_members(void)
+{
+	int n;
+
+	while (disk.members) {
+		if (disk.fds[--disk.members] >= 0)
+			close(disk.fds[disk.members]);
+	}
+	for (n = 0; n < BLOCK_DISK_MEMBERS_MAX; n++) {
+		free(disk.stale[n]);
+		disk.stale[n] = NULL;
+	}
+}
 
 int block_disk_open(const char *diskname)
 {
-	int fd;
+	char *names[BLOCK_DISK_MEMBERS_MAX], *copy = NULL;
 	struct stat st;
+	off_t size = 0;
+	int n, fd, first = -1;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
+	if (disk.members) {
 		block_error("disk already open");
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	if ((n = disk_parse(diskname, &copy, names)) < 0) {
+		free(copy);
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
-		return -1;
+	/* Members that failed before stay out of use until resynced, and are
+	   not even opened */
+	memset(disk.failed, 0, sizeof(disk.failed));
+	if (disk.layout == DISK_MIRROR && mirror_stale_init(names, n, 0))
+		goto fail;
+
+	while (disk.members < n) {
+		if (disk.failed[disk.members]) {
+			disk.fds[disk.members++] = -1;
+			continue;
+		}
+		if ((fd = open(names[disk.members], O_RDWR, 0644)) < 0) {
+			perror("open");
+			goto fail;
+		}
+		disk.fds[disk.members++] = fd;
+
+		if (fstat(fd, &st)) {
+			perror("fstat");
+			goto fail;
+		}
+
+		/* Members of a mirrored disk are identical */
+		if (disk.layout != DISK_MIRROR)
+			size += st.st_size;
+		else if (first < 0) {
+			size = st.st_size;
+			first = disk.members - 1;
+		} else if (st.st_size != size) {
+			block_error("member '%s' differs in size from '%s'",
+				    names[disk.members - 1], names[first]);
+			goto fail;
+		}
+	}
+
+	/* Members of a striped disk hold their share of its units, those
+	   before the last one full */
+	for (n = 0; disk.layout == DISK_STRIPE && n < disk.members; n++) {
+		if (fstat(disk.fds[n], &st) ||
+		    st.st_size != stripe_member_size(size, n)) {
+			block_error("member '%s' does not fit a %zu-byte stripe",
+				    names[n], disk.unit);
+			goto fail;
+		}
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
+	/* The disk image's size should be a multiple of the smallest block
+	   size; it is checked against the actual one by block_disk_set_size() */
+	if (size % BLOCK_SIZE_MIN != 0 || size < BLOCK_SIZE) {
 		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+			    (size_t)size, BLOCK_SIZE_MIN);
+		goto fail;
+	}
+
+	free(copy);
+	disk.direct = 0;
+	disk.no_discard = 0;
+	disk.size = size;
+	disk.bsize = BLOCK_SIZE;
+	disk.bcount = size / BLOCK_SIZE;
+
+	return 0;
+
+fail:
+	free(copy);
+	disk_close_members();
+	return -1;
+}
+
+int block_disk_create(const char *diskname, size_t size, size_t count,
+		      int flags)
+{
+	char *names[BLOCK_DISK_MEMBERS_MAX], *copy = NULL;
+	off_t len = (off_t)size * count, mlen;
+	int n, fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (disk.members) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	if ((n = disk_parse(diskname, &copy, names)) < 0) {
+		free(copy);
+		return -1;
+	}
+
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX ||
+	    (size & (size - 1)) || len < BLOCK_SIZE ||
+	    (disk.unit && disk.unit % size)) {
+		block_error("invalid geometry '%zu' x '%zu'", count, size);
+		free(copy);
+		return -1;
+	}
+
+	while (disk.members < n) {
+		if ((fd = open(names[disk.members],
+			       O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror("open");
+			goto fail;
+		}
+		disk.fds[disk.members++] = fd;
+	}
+
+	for (n = 0; n < disk.members; n++) {
+		mlen = disk.layout == DISK_STRIPE ?
+			stripe_member_size(len, n) : len;
+
+		/* Extending the empty file leaves a hole: nothing is
+		   written, and unwritten blocks read as zeros */
+		if (ftruncate(disk.fds[n], mlen)) {
+			perror("ftruncate");
+			goto fail;
+		}
+
+		/* Reserve the space without zeroing it; posix_fallocate()
+		   would write zeros where the host file system cannot */
+		if ((flags & BLOCK_DISK_PREALLOC) && mlen &&
+		    fallocate(disk.fds[n], 0, 0, mlen)) {
+			block_error("cannot preallocate '%s': %s", names[n],
+				    strerror(errno));
+			goto fail;
+		}
+	}
+
+	memset(disk.failed, 0, sizeof(disk.failed));
+	if (disk.layout == DISK_MIRROR &&
+	    mirror_stale_init(names, disk.members, 1))
+		goto fail;
+
+	free(copy);
+	disk.direct = 0;
+	disk.no_discard = 0;
+	disk.size = len;
+	disk.bsize = size;
+	disk.bcount = count;
+
+	return 0;
+
+fail:
+	free(copy);
+	disk_close_members();
+	return -1;
+}
+
+int block_disk_set_size(size_t size)
+{
+	if (!disk.members) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX ||
+	    (size & (size - 1)) || disk.size % size != 0 ||
+	    (disk.unit && disk.unit % size)) {
+		block_error("invalid block size '%zu' for size '%zu'", size,
+			    (size_t)disk.size);
+		return -1;
+	}
 
+	disk.bsize = size;
+	disk.bcount = disk.size / size;
 	return 0;
 }
 
-int block_disk_close(void)
+/* Sets or clears O_DIRECT on every member, returning -1 if one refuses */
+static int disk_set_flag(int direct)
+{
+	int flags, n;
+
+	for (n = 0; n < disk.members; n++) {
+		if (disk.fds[n] < 0)
+			continue;
+		if ((flags = fcntl(disk.fds[n], F_GETFL)) < 0 ||
+		    fcntl(disk.fds[n], F_SETFL, direct ? flags | O_DIRECT :
+			  flags & ~O_DIRECT) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int block_disk_set_direct(int enable)
 {
-	if (disk.fd == INVALID_FD) {
+	void *probe;
+	off_t moff;
+	int n;
+
+	if (!disk.members) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (!enable) {
+		disk_set_flag(0);
+		disk.direct = 0;
+		return 0;
+	}
+
+	if (disk_set_flag(1) < 0 || !(probe = block_alloc(disk.bsize))) {
+		disk_set_flag(0);
+		return -1;
+	}
+
+	/* Some file systems accept the flag but not the offsets or sizes of
+	   our blocks: read one block past the first one of each member to
+	   find out */
+	for (n = 0; n < disk.members; n++) {
+		if (disk.fds[n] < 0)
+			continue;
+		disk_map(disk.bsize, &moff);
+		if (pread(disk.fds[n], probe, disk.bsize,
+			  disk.bcount > (size_t)disk.members ? moff : 0) < 0) {
+			free(probe);
+			disk_set_flag(0);
+			return -1;
+		}
+	}
+	free(probe);
+
+	disk.direct = 1;
+	return 0;
+}
+
+int block_disk_direct(void)
+{
+	return disk.members && disk.direct;
+}
+
+void *block_alloc(size_t size)
+{
+	size_t len = (size + BLOCK_ALIGN - 1) & ~(size_t)(BLOCK_ALIGN - 1);
+	void *buf = aligned_alloc(BLOCK_ALIGN, len ? len : BLOCK_ALIGN);
+
+	if (buf)
+		memset(buf, 0, len);
+	return buf;
+}
+
+/* Returns @buf, or an aligned copy of its @len bytes if direct I/O cannot use
+   it as is. Direct I/O worked at offset disk.bsize, so the host's alignment
+   is at most the block size */
+static void *bounce_get(void *buf, size_t len, int copy)
+{
+	void *bounce;
+	size_t align = disk.bsize < BLOCK_ALIGN ? disk.bsize : BLOCK_ALIGN;
+
+	if (!disk.direct || !((uintptr_t)buf & (align - 1)))
+		return buf;
+
+	if (!(bounce = block_alloc(len))) {
+		block_error("cannot allocate %zu bytes", len);
+		return NULL;
+	}
+	if (copy)
+		memcpy(bounce, buf, len);
+	stats.bounced++;
+	return bounce;
+}
+
+/* Releases buffer @io from bounce_get(), first copying its @len bytes back to
+   @buf if @copy */
+static void bounce_put(void *io, void *buf, size_t len, int copy)
+{
+	if (io == buf)
+		return;
+	if (copy)
+		memcpy(buf, io, len);
+	free(io);
+}
+
+size_t block_disk_block_size(void)
+{
+	return disk.members ? disk.bsize : BLOCK_SIZE;
+}
+
+int block_disk_close(void)
+{
+	if (!disk.members) {
+		block_error("no disk currently open");
+		return -1;
+	}
 
-	disk.fd = INVALID_FD;
+	disk_close_members();
 
 	return 0;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.members) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -88,57 +567,369 @@ int block_disk_count(void)
 
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	LAT_SCOPE(FS_OP_BLOCK_WRITE);
+	TRACE_SCOPE(FS_TRACE_BLOCK_WRITE, block, 0);
+	void *io;
+	off_t moff;
+	int member;
+
+	if (!disk.members) {
 		block_error("no disk currently open");
+		stats.errors++;
 		return -1;
 	}
 
 	if (block >= disk.bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
 			    block, disk.bcount);
+		stats.errors++;
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (!(io = bounce_get((void *)buf, disk.bsize, 1))) {
+		stats.errors++;
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
+	/* Perform the actual write into the members holding the block */
+	if (disk.layout == DISK_MIRROR) {
+		if (mirror_write(io, block * disk.bsize)) {
+			bounce_put(io, (void *)buf, disk.bsize, 0);
+			stats.errors++;
+			return -1;
+		}
+	} else {
+		member = disk_map(block * disk.bsize, &moff);
+		if (pwrite(disk.fds[member], io, disk.bsize, moff) < 0) {
+			perror("pwrite");
+			bounce_put(io, (void *)buf, disk.bsize, 0);
+			stats.errors++;
+			return -1;
+		}
 	}
 
+	bounce_put(io, (void *)buf, disk.bsize, 0);
+	stats.writes++;
 	return 0;
 }
 
 int block_read(size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	LAT_SCOPE(FS_OP_BLOCK_READ);
+	TRACE_SCOPE(FS_TRACE_BLOCK_READ, block, 0);
+	void *io;
+	off_t moff;
+	int member;
+
+	if (!disk.members) {
 		block_error("no disk currently open");
+		stats.errors++;
 		return -1;
 	}
 
 	if (block >= disk.bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
 			    block, disk.bcount);
+		stats.errors++;
+		return -1;
+	}
+
+	if (!(io = bounce_get(buf, disk.bsize, 0))) {
+		stats.errors++;
+		return -1;
+	}
+
+	/* Perform the actual read from the member holding the block; a
+	   mirrored disk tries its other members if it fails */
+	for (;;) {
+		member = disk_map(block * disk.bsize, &moff);
+		if (pread(disk.fds[member], io, disk.bsize, moff) >= 0)
+			break;
+		perror("pread");
+		if (disk.layout != DISK_MIRROR || mirror_fail(member)) {
+			bounce_put(io, buf, disk.bsize, 0);
+			stats.errors++;
+			return -1;
+		}
+	}
+
+	bounce_put(io, buf, disk.bsize, 1);
+	stats.reads++;
+	return 0;
+}
+
+/* Iovecs gathered per member request of a range */
+#define MEMBER_IOV_MAX 64
+
+/* Request of one member in a range transfer, gathering the units of the range
+   that follow one another in the member */
+struct member_io {
+	struct iovec iov[MEMBER_IOV_MAX];
+	int count;
+	/* Offsets in the member of the request and of the byte following it */
+	off_t moff, next;
+};
+
+/* Performs and empties the request @io of member @m, restarting it after
+   partial transfers */
+static int member_flush(int m, struct member_io *io, int write)
+{
+	struct iovec *iov = io->iov;
+	int count = io->count;
+	off_t off = io->moff;
+	ssize_t ret;
+
+	io->count = 0;
+	while (count) {
+		ret = write ? pwritev(disk.fds[m], iov, count, off) :
+			preadv(disk.fds[m], iov, count, off);
+		if (ret <= 0) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		off += ret;
+		while (count && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/* Transfers @len bytes between @buf and the disk from byte @start, with a
+   single vectored request per member for the units that follow one another
+   in it, so that each member sees sequential I/O; on error, the failing
+   member is stored in @failed */
+static int range_io(char *buf, off_t start, size_t len, int write,
+		    int *failed)
+{
+	struct member_io io[BLOCK_DISK_MEMBERS_MAX];
+	off_t unit = disk.layout != DISK_SINGLE ? (off_t)disk.unit : disk.size;
+	off_t end = start + len, first, last, moff;
+	int m;
+
+	for (m = 0; m < disk.members; m++)
+		io[m].count = 0;
+
+	for (first = start; first < end; first = last) {
+		last = (first / unit + 1) * unit < end ?
+			(first / unit + 1) * unit : end;
+		m = disk_map(first, &moff);
+		if (io[m].count && (io[m].count == MEMBER_IOV_MAX ||
+				    io[m].next != moff) &&
+		    member_flush(m, &io[m], write)) {
+			*failed = m;
+			return -1;
+		}
+		if (!io[m].count)
+			io[m].moff = moff;
+		io[m].iov[io[m].count].iov_base = buf + (first - start);
+		io[m].iov[io[m].count++].iov_len = last - first;
+		io[m].next = moff + (last - first);
+	}
+
+	for (m = 0; m < disk.members; m++) {
+		if (io[m].count && member_flush(m, &io[m], write)) {
+			*failed = m;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Reads @len bytes from byte @start of the disk into @buf; a mirrored disk
+   reads the parts of failed members from the others */
+static int range_read(char *buf, off_t start, size_t len)
+{
+	int member;
+
+	while (range_io(buf, start, len, 0, &member)) {
+		if (disk.layout != DISK_MIRROR || mirror_fail(member))
+			return -1;
+	}
+	return 0;
+}
+
+/* Writes @len bytes of @buf at byte @start of the disk, to every working
+   member of a mirrored disk */
+static int range_write(char *buf, off_t start, size_t len)
+{
+	struct member_io io;
+	int n, member;
+
+	if (disk.layout != DISK_MIRROR)
+		return range_io(buf, start, len, 1, &member);
+
+	for (n = 0; n < disk.members; n++) {
+		if (disk.failed[n])
+			continue;
+		io.iov[0].iov_base = buf;
+		io.iov[0].iov_len = len;
+		io.count = 1;
+		io.moff = start;
+		if (member_flush(n, &io, 1) && mirror_fail(n))
+			return -1;
+	}
+	return 0;
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	LAT_SCOPE(FS_OP_BLOCK_READ);
+	TRACE_SCOPE(FS_TRACE_BLOCK_READ, block, count);
+	size_t len = count * disk.bsize;
+	void *io;
+
+	if (!disk.members) {
+		block_error("no disk currently open");
+		stats.errors++;
+		return -1;
+	}
+
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		stats.errors++;
+		return -1;
+	}
+
+	if (!(io = bounce_get(buf, len, 0))) {
+		stats.errors++;
+		return -1;
+	}
+
+	if (range_read(io, block * disk.bsize, len)) {
+		bounce_put(io, buf, len, 0);
+		stats.errors++;
+		return -1;
+	}
+
+	bounce_put(io, buf, len, 1);
+	stats.reads += count;
+	return 0;
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	LAT_SCOPE(FS_OP_BLOCK_WRITE);
+	TRACE_SCOPE(FS_TRACE_BLOCK_WRITE, block, count);
+	size_t len = count * disk.bsize;
+	void *io;
+
+	if (!disk.members) {
+		block_error("no disk currently open");
+		stats.errors++;
+		return -1;
+	}
+
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		stats.errors++;
+		return -1;
+	}
+
+	if (!(io = bounce_get((void *)buf, len, 1))) {
+		stats.errors++;
+		return -1;
+	}
+
+	if (range_write(io, block * disk.bsize, len)) {
+		bounce_put(io, (void *)buf, len, 0);
+		stats.errors++;
+		return -1;
+	}
+
+	bounce_put(io, (void *)buf, len, 0);
+	stats.writes += count;
+	return 0;
+}
+
+/* Punches a hole of @len bytes at byte @off of member @m */
+static int member_discard(int m, off_t off, off_t len)
+{
+	if (!fallocate(disk.fds[m], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       off, len))
+		return 0;
+
+	if (errno == EOPNOTSUPP)
+		disk.no_discard = 1;
+	else
+		perror("fallocate");
+	return -1;
+}
+
+int block_discard(size_t block, size_t count)
+{
+	off_t start = (off_t)block * disk.bsize;
+	off_t end = start + (off_t)count * disk.bsize;
+	off_t unit = disk.unit, first, last, moff, mend;
+	int m;
+
+	if (!disk.members) {
+		block_error("no disk currently open");
+		stats.errors++;
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		stats.errors++;
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (disk.no_discard)
 		return -1;
+
+	for (m = 0; m < disk.members && count; m++) {
+		if (disk.failed[m])
+			continue;
+
+		if (disk.layout != DISK_STRIPE) {
+			moff = start;
+			mend = end;
+		} else {
+			/* The units of the range on member @m follow each
+			   other in it: only the first and last may be partial */
+			first = start / unit;
+			first += (m - first % disk.members + disk.members) %
+				disk.members;
+			last = (end - 1) / unit;
+			last -= (last % disk.members - m + disk.members) %
+				disk.members;
+			if (first > last)
+				continue;
+			disk_map(first * unit > start ? first * unit : start,
+				 &moff);
+			disk_map((last + 1) * unit < end ?
+				 (last + 1) * unit - 1 : end - 1, &mend);
+			mend++;
+		}
+
+		if (member_discard(m, moff, mend - moff)) {
+			if (!disk.no_discard)
+				stats.errors++;
+			return -1;
+		}
 	}
 
+	stats.discarded += count;
 	return 0;
 }
 
+void block_stats_get(struct block_stats *st)
+{
+	*st = stats;
+}
+
+void block_stats_reset(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
@@ -2,10 +2,24 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint64_t definition */
 
-/** Size of a disk block in bytes */
+/** Size of a disk block in bytes, unless set otherwise for the open disk */
 #define BLOCK_SIZE 4096
 
+/** Range of block sizes supported by block_disk_set_size() */
+#define BLOCK_SIZE_MIN 1024
+#define BLOCK_SIZE_MAX 65536
+
+/** Alignment of the buffers given to block reads and writes for direct I/O */
+#define BLOCK_ALIGN 4096
+
+/** Largest number of member images of a disk */
+#define BLOCK_DISK_MEMBERS_MAX 16
+
+/** block_disk_create() flag: allocate the blocks of the file up front */
+#define BLOCK_DISK_PREALLOC 0x1
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,11 +28,49 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * @diskname may instead describe a disk striped across several image files,
+ * as "stripe:<unit>:<image>,<image>,...": the disk is cut into units of
+ * <unit> bytes (a multiple of %BLOCK_SIZE, with an optional K or M suffix),
+ * which go to each image in turn, and block_read_range() and
+ * block_write_range() issue a single request to each image involved, for the
+ * units that follow one another in it. A disk mirrored on several identical image
+ * files is described as "mirror:<image>,<image>,...": blocks are written to
+ * every image, and reads are spread over them by block address, so that each
+ * image serves the reads of its share of the disk. A read or write error on
+ * an image takes it out of use, reads being served by the other images. It is
+ * then out of date, which file "<image>.stale" records: later opens leave such
+ * an image out too, and fail if all the images are, until it is resynced by
+ * copying another image over it and removing that file. Every name taken by
+ * the block functions can be such a description.
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_create - Create and open a virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @size: Block size in bytes, a power of two between %BLOCK_SIZE_MIN and
+ * %BLOCK_SIZE_MAX
+ * @count: Number of blocks
+ * @flags: %BLOCK_DISK_PREALLOC or 0
+ *
+ * Create virtual disk file @diskname, replacing any existing file, with @count
+ * blocks of @size bytes that all read as zeros, and open it as
+ * block_disk_open() followed by block_disk_set_size() would. The file is
+ * sized without writing anything: it is sparse, and blocks only take space on
+ * the host once written, unless @flags has %BLOCK_DISK_PREALLOC, in which case
+ * they are allocated (still without being written) so that later writes
+ * cannot run out of space.
+ *
+ * Return: -1 if @diskname is invalid, if a virtual disk file is already open,
+ * if @size or @count is invalid, or if the file cannot be created, sized or
+ * preallocated. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t size, size_t count,
+		      int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +78,62 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_set_size - Set the block size of the open disk
+ * @size: Block size in bytes, a power of two between %BLOCK_SIZE_MIN and
+ * %BLOCK_SIZE_MAX
+ *
+ * A disk is opened with blocks of %BLOCK_SIZE bytes, which is enough to read
+ * its first block whatever its actual block size. All the following block
+ * reads and writes, and the block count, use @size.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @size is invalid, or
+ * if the size of the virtual disk file is not a multiple of @size. 0
+ * otherwise.
+ */
+int block_disk_set_size(size_t size);
+
+/**
+ * block_disk_set_direct - Switch the open disk to or from direct I/O
+ * @enable: Non-zero to bypass the host page cache, zero for buffered I/O
+ *
+ * With direct I/O, blocks are moved between the virtual disk file and the
+ * given buffers without being cached by the host. Buffers should then be
+ * aligned on %BLOCK_ALIGN bytes, as those from block_alloc() are: any other
+ * buffer is copied through an aligned one. The block size must be a multiple
+ * of the logical block size of the host device, so direct I/O should be
+ * enabled after block_disk_set_size().
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the host file
+ * system does not support direct I/O for this file and block size, in which
+ * case the disk keeps buffered I/O. 0 otherwise.
+ */
+int block_disk_set_direct(int enable);
+
+/**
+ * block_disk_direct - Tell whether the open disk uses direct I/O
+ *
+ * Return: 1 if block_disk_set_direct() enabled direct I/O on the open disk, 0
+ * otherwise.
+ */
+int block_disk_direct(void);
+
+/**
+ * block_alloc - Allocate a buffer suitable for direct I/O
+ * @size: Size of the buffer in bytes
+ *
+ * Return: A zero-filled buffer aligned on %BLOCK_ALIGN bytes, to be released
+ * with free(), or NULL if it cannot be allocated.
+ */
+void *block_alloc(size_t size);
+
+/**
+ * block_disk_block_size - Get the block size of the open disk
+ *
+ * Return: The block size set by block_disk_set_size(), or %BLOCK_SIZE.
+ */
+size_t block_disk_block_size(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -39,8 +147,8 @@ int block_disk_count(void);
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
- * block @block.
+ * Write the content of buffer @buf (one block) in the virtual disk's block
+ * @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
  * operation fails. 0 otherwise.
@@ -52,13 +160,91 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
- * buffer @buf.
+ * Read the content of virtual disk's block @block (one block) into buffer
+ * @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count blocks) into buffer @buf with a single request.
+ *
+ * Return: -1 if any block is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write
+ *
+ * Write the content of buffer @buf to virtual disk's blocks @block to @block +
+ * @count - 1 (@count blocks) with a single request.
+ *
+ * Return: -1 if any block is out of bounds or inaccessible, or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_discard - Give the space of consecutive blocks back to the host
+ * @block: Index of the first block to discard
+ * @count: Number of blocks to discard
+ *
+ * Punch a hole over virtual disk's blocks @block to @block + @count - 1 in the
+ * images holding them, so that they take no host space and read as zeros
+ * until written again. This also undoes the preallocation of those blocks by
+ * %BLOCK_DISK_PREALLOC.
+ *
+ * Return: -1 if any block is out of bounds, if the host file system cannot
+ * punch holes in the images (every later call then fails at once), or if
+ * punching fails. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * struct block_stats - Block I/O counters
+ * @reads: Number of blocks successfully read
+ * @writes: Number of blocks successfully written
+ * @errors: Number of block read or write requests that failed
+ * @bounced: Number of block read or write requests copied through an aligned
+ * buffer for direct I/O
+ * @failovers: Number of images of a mirrored disk taken out of use after an
+ * error
+ * @discarded: Number of blocks given back to the host by block_discard()
+ *
+ * The counters are kept across block_disk_open() and block_disk_close() and
+ * only cleared by block_stats_reset().
+ */
+struct block_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t errors;
+	uint64_t bounced;
+	uint64_t failovers;
+	uint64_t discarded;
+};
+
+/**
+ * block_stats_get - Get block I/O counters
+ * @stats: Structure to be filled with the current counters
+ */
+void block_stats_get(struct block_stats *stats);
+
+/**
+ * block_stats_reset - Clear block I/O counters
+ */
+void block_stats_reset(void);
+
 #endif /* _DISK_H */
 
@@ -0,0 +1,268 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fatscan.h"
+#include "fs_internal.h"
+
+static size_t count_free_sw(const uint16_t *fat, size_t from, size_t to)
+{
+	size_t n = 0;
+
+	for (; from < to; from++)
+		n += fat[from] == 0;
+	return n;
+}
+
+static size_t find_free_sw(const uint16_t *fat, size_t from, size_t to)
+{
+	while (from < to && fat[from] != 0)
+		from++;
+	return from;
+}
+
+static size_t find_used_sw(const uint16_t *fat, size_t from, size_t to)
+{
+	while (from < to && fat[from] == 0)
+		from++;
+	return from;
+}
+
+static size_t find_invalid_sw(const uint16_t *fat, size_t from, size_t to,
+			      uint16_t limit)
+{
+	while (from < to && (fat[from] < limit || fat[from] == FAT_EOC))
+		from++;
+	return from;
+}
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+/*
+ * Free entries are counted by subtracting the all-ones result of each
+ * comparison from 16-bit lanes, which are summed before they can overflow.
+ */
+#define COUNT_BATCH 4096
+
+__attribute__((target("sse2")))
+static size_t count_free_sse2(const uint16_t *fat, size_t from, size_t to)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t n = 0;
+
+	while (from + 8 <= to) {
+		size_t end = to - from > 8 * COUNT_BATCH ?
+			from + 8 * COUNT_BATCH : to;
+		__m128i acc = zero;
+
+		for (; from + 8 <= end; from += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(fat + from));
+
+			acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(v, zero));
+		}
+		acc = _mm_madd_epi16(acc, _mm_set1_epi16(1));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+		n += (uint32_t)_mm_cvtsi128_si32(acc);
+	}
+	return n + count_free_sw(fat, from, to);
+}
+
+__attribute__((target("sse2")))
+static size_t find_free_sse2(const uint16_t *fat, size_t from, size_t to)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; from + 8 <= to; from += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + from));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+
+		if (mask)
+			return from + __builtin_ctz(mask) / 2;
+	}
+	return find_free_sw(fat, from, to);
+}
+
+__attribute__((target("sse2")))
+static size_t find_used_sse2(const uint16_t *fat, size_t from, size_t to)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; from + 8 <= to; from += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + from));
+		unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero)) &
+			0xffff;
+
+		if (mask)
+			return from + __builtin_ctz(mask) / 2;
+	}
+	return find_used_sw(fat, from, to);
+}
+
+/* An entry is below @limit when subtracting @limit - 1 with unsigned
+   saturation leaves 0 */
+__attribute__((target("sse2")))
+static size_t find_invalid_sse2(const uint16_t *fat, size_t from, size_t to,
+				uint16_t limit)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i below = _mm_set1_epi16(limit - 1);
+	const __m128i eoc = _mm_set1_epi16((short)FAT_EOC);
+
+	for (; from + 8 <= to; from += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + from));
+		__m128i valid = _mm_or_si128(
+			_mm_cmpeq_epi16(_mm_subs_epu16(v, below), zero),
+			_mm_cmpeq_epi16(v, eoc));
+		unsigned int mask = ~_mm_movemask_epi8(valid) & 0xffff;
+
+		if (mask)
+			return from + __builtin_ctz(mask) / 2;
+	}
+	return find_invalid_sw(fat, from, to, limit);
+}
+
+__attribute__((target("avx2")))
+static size_t count_free_avx2(const uint16_t *fat, size_t from, size_t to)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t n = 0;
+
+	while (from + 16 <= to) {
+		size_t end = to - from > 16 * COUNT_BATCH ?
+			from + 16 * COUNT_BATCH : to;
+		__m256i acc = zero;
+		__m128i sum;
+
+		for (; from + 16 <= end; from += 16) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(fat + from));
+
+			acc = _mm256_sub_epi16(acc, _mm256_cmpeq_epi16(v, zero));
+		}
+		acc = _mm256_madd_epi16(acc, _mm256_set1_epi16(1));
+		sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+				    _mm256_extracti128_si256(acc, 1));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+		n += (uint32_t)_mm_cvtsi128_si32(sum);
+	}
+	return n + count_free_sse2(fat, from, to);
+}
+
+__attribute__((target("avx2")))
+static size_t find_free_avx2(const uint16_t *fat, size_t from, size_t to)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	for (; from + 16 <= to; from += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + from));
+		unsigned int mask =
+			_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero));
+
+		if (mask)
+			return from + __builtin_ctz(mask) / 2;
+	}
+	return find_free_sse2(fat, from, to);
+}
+
+__attribute__((target("avx2")))
+static size_t find_used_avx2(const uint16_t *fat, size_t from, size_t to)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	for (; from + 16 <= to; from += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + from));
+		unsigned int mask =
+			~_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero));
+
+		if (mask)
+			return from + __builtin_ctz(mask) / 2;
+	}
+	return find_used_sse2(fat, from, to);
+}
+
+__attribute__((target("avx2")))
+static size_t find_invalid_avx2(const uint16_t *fat, size_t from, size_t to,
+				uint16_t limit)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i below = _mm256_set1_epi16(limit - 1);
+	const __m256i eoc = _mm256_set1_epi16((short)FAT_EOC);
+
+	for (; from + 16 <= to; from += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + from));
+		__m256i valid = _mm256_or_si256(
+			_mm256_cmpeq_epi16(_mm256_subs_epu16(v, below), zero),
+			_mm256_cmpeq_epi16(v, eoc));
+		unsigned int mask = ~_mm256_movemask_epi8(valid);
+
+		if (mask)
+			return from + __builtin_ctz(mask) / 2;
+	}
+	return find_invalid_sse2(fat, from, to, limit);
+}
+
+#endif /* __x86_64__ */
+
+static struct {
+	size_t (*count_free)(const uint16_t *, size_t, size_t);
+	size_t (*find_free)(const uint16_t *, size_t, size_t);
+	size_t (*find_used)(const uint16_t *, size_t, size_t);
+	size_t (*find_invalid)(const uint16_t *, size_t, size_t, uint16_t);
+} scan = {
+	count_free_sw, find_free_sw, find_used_sw, find_invalid_sw
+};
+
+__attribute__((constructor)) static void fatscan_init(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan.count_free = count_free_avx2;
+		scan.find_free = find_free_avx2;
+		scan.find_used = find_used_avx2;
+		scan.find_invalid = find_invalid_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		scan.count_free = count_free_sse2;
+		scan.find_free = find_free_sse2;
+		scan.find_used = find_used_sse2;
+		scan.find_invalid = find_invalid_sse2;
+	}
+#endif
+}
+
+size_t fat_count_free(const uint16_t *fat, size_t from, size_t to)
+{
+	return from < to ? scan.count_free(fat, from, to) : 0;
+}
+
+size_t fat_find_free(const uint16_t *fat, size_t from, size_t to)
+{
+	return from < to ? scan.find_free(fat, from, to) : to;
+}
+
+size_t fat_find_used(const uint16_t *fat, size_t from, size_t to)
+{
+	return from < to ? scan.find_used(fat, from, to) : to;
+}
+
+size_t fat_find_run(const uint16_t *fat, size_t from, size_t to, size_t count)
+{
+	while ((from = fat_find_free(fat, from, to)) < to) {
+		/* only the first @count entries of a free run matter */
+		size_t end = to - from > count ? from + count : to;
+		size_t used = fat_find_used(fat, from, end);
+
+		if (used - from >= count)
+			return from;
+		from = used;
+	}
+	return to;
+}
+
+size_t fat_find_invalid(const uint16_t *fat, size_t from, size_t to,
+			uint16_t limit)
+{
+	return from < to ? scan.find_invalid(fat, from, to, limit) : to;
+}
@@ -0,0 +1,69 @@
+#ifndef _FATSCAN_H
+#define _FATSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scans of FAT entries [@from, @to), using AVX2 or SSE2 when the CPU
+ * supports them and plain loops otherwise. The functions returning an index
+ * return @to when no entry matches.
+ */
+
+/**
+ * fat_count_free - Count the free entries of a FAT range
+ * @fat: FAT entries
+ * @from: First entry of the range
+ * @to: End of the range
+ *
+ * Return: Number of entries of the range that are 0.
+ */
+size_t fat_count_free(const uint16_t *fat, size_t from, size_t to);
+
+/**
+ * fat_find_free - Find the first free entry of a FAT range
+ * @fat: FAT entries
+ * @from: First entry of the range
+ * @to: End of the range
+ *
+ * Return: Index of the first entry of the range that is 0, or @to.
+ */
+size_t fat_find_free(const uint16_t *fat, size_t from, size_t to);
+
+/**
+ * fat_find_used - Find the first allocated entry of a FAT range
+ * @fat: FAT entries
+ * @from: First entry of the range
+ * @to: End of the range
+ *
+ * Return: Index of the first entry of the range that is not 0, or @to.
+ */
+size_t fat_find_used(const uint16_t *fat, size_t from, size_t to);
+
+/**
+ * fat_find_run - Find the first run of free entries of a FAT range
+ * @fat: FAT entries
+ * @from: First entry of the range
+ * @to: End of the range
+ * @count: Length of the run
+ *
+ * Return: Index of the first of @count consecutive entries of the range that
+ * are all 0, or @to.
+ */
+size_t fat_find_run(const uint16_t *fat, size_t from, size_t to, size_t count);
+
+/**
+ * fat_find_invalid - Find the first invalid entry of a FAT range
+ * @fat: FAT entries
+ * @from: First entry of the range
+ * @to: End of the range
+ * @limit: Number of data blocks, at least 1: valid entries are below it or
+ * FAT_EOC
+ *
+ * Return: Index of the first entry of the range that is neither below @limit
+ * nor FAT_EOC, or @to.
+ */
+size_t fat_find_invalid(const uint16_t *fat, size_t from, size_t to,
+			uint16_t limit);
+
+#endif /* _FATSCAN_H */
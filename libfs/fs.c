@@ -1,520 +1,5011 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
 
+#include "aio.h"
+#include "crc32c.h"
 #include "disk.h"
+#include "fatscan.h"
 #include "fs.h"
+#include "fs_internal.h"
+#include "latency.h"
+#include "lz.h"
+#include "trace.h"
 
-#define FAT_EOC 0xFFFF
-#define BLOCK_SIZE 4096
+/* block size of the mounted file system, and the shift and mask turning an
+   offset into a block number and an offset within the block */
+uint32_t block_size = BLOCK_SIZE;
+uint32_t block_shift = 12;
+uint32_t block_mask = BLOCK_SIZE - 1;
 
-struct superblock
-{
-	char signature[8];		  // must be equal to “ECS150FS”
-	uint16_t total_blocks;	  // total amount of blocks of virtual disk
-	uint16_t root_dir;		  // root directory block index
-	uint16_t data_block;	  // data block start index
-	uint16_t num_data_blocks; // amount of data blocks
-	uint8_t num_FAT_blocks;	  // number of blocks for FAT
-	uint8_t padding[4079];		  // unused/padding
-};
+/* block-sized buffer on the stack, aligned for direct I/O */
+#define BLOCK_BUFFER(name) char name[block_size] __attribute__((aligned(BLOCK_ALIGN)))
 
-struct FAT
-{
-	uint16_t *entries;
-	uint16_t num_entries; // equal to the number of data blocks in disk
-};
+/* @size rounded up so that what follows it in an allocation is aligned */
+#define BLOCK_ALIGNED(size) (((size) + BLOCK_ALIGN - 1) & ~(size_t)(BLOCK_ALIGN - 1))
 
-struct file_entry
+/* extent of a file with extents, along with the number of blocks of the file
+   up to its end, which the extents are sorted by */
+struct extent_run
 {
-	char file_name[16];
-	uint32_t file_size;
-	uint16_t first_data_block;
-	uint8_t padding[10];
+	uint32_t end;
+	uint16_t start;
+	uint16_t count;
 };
 
-struct rootdir
+/* in-core state of a file, shared by all its file descriptors */
+struct open_file
 {
-	struct file_entry entries[128];
+	struct file_entry *file;
+	uint32_t refs;			// file descriptors using it
+	bool reserved;			// blocks were reserved past the end of file
+	uint16_t *map;			// first @mapped blocks of the chain of a plain file
+	uint32_t mapped;
+	uint32_t map_size;		// entries allocated for @map
+	struct zfile *zf;		// state of a compressed file
+	struct ifile *xf;		// state of a deduplicated or sparse file
+	struct extent_run *ext;	// extents of a file with extents, NULL if not loaded
+	uint32_t ext_count;
+	uint32_t ext_size;		// entries allocated for @ext
+	uint16_t ext_block;		// data block holding the extents, FAT_EOC if none
+	bool ext_dirty;			// extents changed since they were loaded
+	struct open_file *next;	// next one in the same bucket
 };
 
+/* open files, hashed by file entry */
+struct open_file **open_buckets = NULL;
+uint32_t open_mask;
+uint32_t open_count;
+
 struct file_descriptor
 {
 	uint32_t offset;
-	int open;
-	struct file_entry *file;
+	int next_free;			// next free descriptor while free, -1 if none
+	struct open_file *of;	// NULL while free
 };
 
-struct file_descriptor fd_table[128];
+/* descriptor table, grown as needed, with a list of the free descriptors */
+struct file_descriptor *fd_table = NULL;
+uint32_t fd_count = 0;
+int fd_free = -1;
 
-struct superblock sb;
+struct superblock sb __attribute__((aligned(BLOCK_ALIGN)));
 struct FAT fat;
-struct rootdir root;
+struct rootdir root __attribute__((aligned(BLOCK_ALIGN)));
 struct file_entry fEntry;
 int mounted = 0;
+int sb_dirty = 0; // superblock must be written back at unmount
+int direct_io = 0; // mount with direct I/O, see fs_direct_enable()
+int read_only = 0; // a snapshot is mounted
 
-/* returns the index of the data block corresponding to the file’s offset */
-int block_index(int fd)
-{
-	/* get current block offset */
-	uint16_t block_index = root.entries[fd].first_data_block;
-	uint16_t block_offset = fd_table[fd].offset / BLOCK_SIZE;
+/* CRC32C of every data block, when the file system has checksums */
+uint32_t *csums = NULL;
 
-	/* follow FAT until block that corresponds to the offset */
-	for (int i = 1; i <= block_offset; i++)
-	{
-		// add error checking if reached EOC prematurely
-		block_index = fat.entries[block_index];
-	}
-	return block_index;
+/* Contents of the inline area, with one bit per slot in use and one flag
+   per block to write back at unmount, when the file system has it */
+char *inline_area = NULL;
+uint64_t *inline_used = NULL;
+bool *inline_dirty = NULL;
+
+/* Reference table of shared data blocks, with one flag per block of the table
+   to write back at unmount, and a hash table of the blocks in use: a bucket
+   gives the first block with a hash, and dedup_next the next one */
+struct dedup_ref *dedup_refs = NULL;
+bool *dedup_dirty = NULL;
+uint16_t *dedup_buckets = NULL;
+uint16_t *dedup_next = NULL;
+uint32_t dedup_mask;
+
+/* Snapshot table, with the number of snapshots using each data block right
+   after the entries in the same allocation, when the file system has it */
+struct snap_entry *snaps = NULL;
+uint8_t *snap_refs = NULL;
+bool snap_dirty = false;
+
+/* Chains of deleted files left to the background reclaimer, which frees
+   RECLAIM_BATCH blocks at a time so that the library lock is released in
+   between; their blocks stay allocated until then */
+#define RECLAIM_BATCH 256
+uint16_t *reclaim_chains = NULL;
+uint32_t reclaim_count = 0;
+uint32_t reclaim_size = 0;
+pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+pthread_t reclaim_thread;
+bool reclaim_stopping = false;
+int reclaim_running = 0;
+
+/* Runs of freed data blocks whose host space is to be given back at unmount,
+   once the metadata written there no longer refers to them; the image then
+   never holds metadata pointing at punched blocks */
+struct extent *discard_runs = NULL;
+uint32_t discard_count = 0;
+uint32_t discard_size = 0;
+bool discard_off = false;
+
+/* Data blocks read in one request by fs_scrub() and fs_csum_enable() */
+#define SCRUB_BATCH 256
+
+/* I/O and metadata counters (block counters are kept by the disk layer) */
+static struct fs_stats stats;
+static int stats_show = 0;
+
+/* returns the number of blocks taken by @len bytes of metadata */
+uint32_t meta_blocks(size_t len)
+{
+	return (len + block_mask) >> block_shift;
 }
 
-/* allocates a new data block and link it at the end of the file’s data block chain */
-uint16_t create_new_block(uint16_t last_block, bool first_block, int fd) 
+/* reads or writes the @len bytes of metadata (superblock or root directory)
+   starting at block @block: they take several blocks if blocks are smaller,
+   and the start of the block otherwise */
+int meta_io(uint16_t block, void *buf, size_t len, bool write)
 {
-	uint16_t new_block;
-	/* first fit strategy */
-	
-	if (first_block) 
+	if (len < block_size)
 	{
-		for (int i = 1; i < sb.num_data_blocks; i++)
+		BLOCK_BUFFER(bounce_buffer);
+		if (write)
 		{
-			if (fat.entries[i] == 0)
-			{
-				/* set new free block to be first data block */
-				root.entries[fd].first_data_block = i;
-
-				// mark as end of newly allocated block
-				fat.entries[i] = FAT_EOC;
-				new_block = i;
-				break;	
-			}
+			memset(bounce_buffer + len, 0, block_size - len);
+			memcpy(bounce_buffer, buf, len);
+			return block_write(block, bounce_buffer);
 		}
-	} else {
-		for (int i = 1; i < sb.num_data_blocks; i++)
+		if (block_read(block, bounce_buffer) == -1)
 		{
-			if (fat.entries[i] == 0)
-			{
-
-				// mark as end of newly allocated block
-				fat.entries[i] = FAT_EOC;
-				fat.entries[last_block] = i;
-				new_block = i;
-				break;	
-			}
+			return -1;
 		}
+		memcpy(buf, bounce_buffer, len);
+		return 0;
 	}
-		
-	/* link new block to end of data block chain */
-	return new_block;
-}
 
-int verify_file_name(const char *filename)
-{
-	if (filename == NULL || strlen(filename) > FS_FILENAME_LEN)
+	for (uint32_t i = 0; i < meta_blocks(len); i++)
 	{
-		return -1;
+		char *part = (char *)buf + i * block_size;
+		if ((write ? block_write(block + i, part) : block_read(block + i, part)) == -1)
+		{
+			return -1;
+		}
 	}
 	return 0;
 }
 
-int fs_mount(const char *diskname)
+/* grows @buf from @old to @size bytes, keeping it aligned for direct I/O */
+void *block_realloc(void *buf, size_t old, size_t size)
 {
-	/* open the virtual disk, using the block API */
-	if (block_disk_open(diskname) == -1)
+	void *grown = block_alloc(size);
+	if (grown != NULL && buf != NULL)
 	{
-		return -1;
+		memcpy(grown, buf, old);
+		free(buf);
 	}
+	return grown;
+}
 
-	/* load the meta-information */
-	if (block_read(0, &sb) == -1)
-	{
-		return -1;
-	}
+/* returns the bucket of the open files for file entry @file */
+struct open_file **open_bucket(struct file_entry *file)
+{
+	return &open_buckets[((uintptr_t)file / sizeof(struct file_entry)) & open_mask];
+}
 
-	/* validate signature of the superblock is ECS150FS */
-	if (strncmp(sb.signature, "ECS150FS", 8) != 0)
+/* doubles the number of buckets of the open files */
+int open_rehash(void)
+{
+	uint32_t size = open_buckets == NULL ? 64 : 2 * (open_mask + 1);
+	struct open_file **old = open_buckets;
+	uint32_t old_size = old == NULL ? 0 : open_mask + 1;
+
+	open_buckets = calloc(size, sizeof(*open_buckets));
+	if (open_buckets == NULL)
 	{
+		open_buckets = old;
 		return -1;
 	}
+	open_mask = size - 1;
 
-	/* initialize FAT */
-	if (block_disk_count() != sb.total_blocks)
+	for (uint32_t i = 0; i < old_size; i++)
 	{
-		return -1;
+		while (old[i] != NULL)
+		{
+			struct open_file *of = old[i];
+			old[i] = of->next;
+			of->next = *open_bucket(of->file);
+			*open_bucket(of->file) = of;
+		}
 	}
-	
-	fat.num_entries = sb.num_FAT_blocks * BLOCK_SIZE / sizeof(uint16_t);
-	fat.entries = malloc(fat.num_entries * sizeof(uint16_t));
-
-	/* load FAT blocks */
-	uint16_t *block = malloc(BLOCK_SIZE); // block index of first FAT block
+	free(old);
+	return 0;
+}
 
-	for (int i = 1; i <= sb.num_FAT_blocks; i++)
+/* returns the in-core state of @file, creating it with no file descriptor
+   if there is none and @create, or NULL */
+struct open_file *of_get(struct file_entry *file, bool create)
+{
+	if (open_buckets != NULL)
 	{
-		// index 0 of fat is EOC
-		if (block_read(i, block) == -1)
+		for (struct open_file *of = *open_bucket(file); of != NULL; of = of->next)
 		{
-			return -1;
+			if (of->file == file)
+			{
+				return of;
+			}
 		}
-		// copy block into fat entries array
-		memcpy(fat.entries + ((i-1) * BLOCK_SIZE / sizeof(uint16_t)), block, BLOCK_SIZE);
 	}
-	fat.entries[0] = FAT_EOC;
-
-	/* load root directory */
-	if (block_read(sb.root_dir, &root) == -1)
+	if (!create)
 	{
-		return -1;
+		return NULL;
 	}
 
-	mounted = 1;
-	return 0;
+	/* keep at most one open file per bucket on average */
+	if ((open_buckets == NULL || open_count > open_mask) && open_rehash() == -1 &&
+		open_buckets == NULL)
+	{
+		return NULL;
+	}
+	struct open_file *of = calloc(1, sizeof(*of));
+	if (of == NULL)
+	{
+		return NULL;
+	}
+	of->file = file;
+	of->next = *open_bucket(file);
+	*open_bucket(file) = of;
+	open_count++;
+	return of;
 }
 
-int fs_umount(void)
+/* frees in-core state @of once no descriptor uses it and it holds nothing
+   left to write back */
+void of_put(struct open_file *of)
 {
-	if (!mounted) {
-		return -1;
+	if (of->refs != 0 || of->zf != NULL || of->xf != NULL || of->ext != NULL)
+	{
+		return;
+	}
+
+	struct open_file **link = open_bucket(of->file);
+	while (*link != of)
+	{
+		link = &(*link)->next;
 	}
+	*link = of->next;
+	open_count--;
+	free(of->map);
+	free(of);
+}
 
-	for (int i = 1; i <= sb.num_FAT_blocks; i++) 
+/* returns a free file descriptor, growing the table if there is none */
+int fd_alloc(void)
+{
+	if (fd_free == -1)
 	{
-		if (block_write(i, fat.entries + (BLOCK_SIZE / sizeof(uint16_t)) * (i-1)) == -1)
+		uint32_t count = fd_count ? 2 * fd_count : FS_OPEN_MAX_COUNT;
+		struct file_descriptor *table = count > INT_MAX ? NULL : realloc(fd_table, count * sizeof(*table));
+		if (table == NULL)
 		{
 			return -1;
 		}
+
+		/* new descriptors are handed out in increasing order */
+		for (uint32_t i = count; i-- > fd_count;)
+		{
+			table[i].of = NULL;
+			table[i].next_free = fd_free;
+			fd_free = i;
+		}
+		fd_table = table;
+		fd_count = count;
 	}
 
-	free(fat.entries);
+	int fd = fd_free;
+	fd_free = fd_table[fd].next_free;
+	return fd;
+}
 
-	if (block_write(sb.root_dir, &root) == -1)
+/* puts file descriptor @fd back on the free list */
+void fd_release(int fd)
+{
+	fd_table[fd].of = NULL;
+	fd_table[fd].offset = 0;
+	fd_table[fd].next_free = fd_free;
+	fd_free = fd;
+}
+
+/* returns whether @fd is an open file descriptor */
+bool fd_valid(int fd)
+{
+	return fd >= 0 && (uint32_t)fd < fd_count && fd_table[fd].of != NULL;
+}
+
+/* returns the extent of @of, a file with extents, holding block @n of the
+   file, or its number of extents past the last one */
+uint32_t extent_search(struct open_file *of, uint32_t n)
+{
+	uint32_t lo = 0, hi = of->ext_count;
+
+	while (lo < hi)
 	{
-		return -1;
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (of->ext[mid].end <= n)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
 	}
+	return lo;
+}
 
-	if (block_disk_close() == -1)
+/* returns the data block of block @n of @of, a file with extents, or FAT_EOC
+   past its last block */
+uint16_t extent_find(struct open_file *of, uint32_t n)
+{
+	uint32_t i = extent_search(of, n);
+	if (i == of->ext_count)
 	{
-		return -1;
+		return FAT_EOC;
 	}
-	mounted = 0;
-
-	return 0;
+	return of->ext[i].start + of->ext[i].count - (of->ext[i].end - n);
 }
 
-int fs_info(void)
+/* returns the last data block of @of, a file with extents, or FAT_EOC if it
+   has none */
+uint16_t extent_last(struct open_file *of)
 {
-	if (!mounted)
+	if (of->ext_count == 0)
 	{
-		return -1;
+		return FAT_EOC;
 	}
+	return of->ext[of->ext_count - 1].start + of->ext[of->ext_count - 1].count - 1;
+}
 
-	uint16_t fat_free = 0, rdir_free = 0;
+/* adds @block, just linked at the end of the chain of @of, to its extents */
+int extent_append(struct open_file *of, uint16_t block)
+{
+	struct extent_run *last = of->ext_count ? &of->ext[of->ext_count - 1] : NULL;
 
+	of->ext_dirty = true;
+	if (last != NULL && last->start + last->count == block && last->count < UINT16_MAX)
+	{
+		last->count++;
+		last->end++;
+		return 0;
+	}
 
-	for (int i = 1; i < sb.num_data_blocks; i++)
+	if (of->ext_count == of->ext_size)
 	{
-		if (fat.entries[i] == 0)
+		struct extent_run *ext = realloc(of->ext, 2 * of->ext_size * sizeof(*ext));
+		if (ext == NULL)
 		{
-			fat_free++;
+			return -1;
 		}
+		of->ext = ext;
+		of->ext_size *= 2;
+		last = of->ext_count ? &of->ext[of->ext_count - 1] : NULL;
 	}
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	of->ext[of->ext_count].end = (last != NULL ? last->end : 0) + 1;
+	of->ext[of->ext_count].start = block;
+	of->ext[of->ext_count].count = 1;
+	of->ext_count++;
+	return 0;
+}
+
+/* cuts the extents of @of after its first @keep blocks */
+void extent_trim(struct open_file *of, uint32_t keep)
+{
+	while (of->ext_count && of->ext[of->ext_count - 1].end - of->ext[of->ext_count - 1].count >= keep)
 	{
-		if (root.entries[i].file_name[0] == '\0')
-		{
-			rdir_free++;
-		}
+		of->ext_count--;
+		of->ext_dirty = true;
+	}
+	if (of->ext_count && of->ext[of->ext_count - 1].end > keep)
+	{
+		of->ext[of->ext_count - 1].count -= of->ext[of->ext_count - 1].end - keep;
+		of->ext[of->ext_count - 1].end = keep;
+		of->ext_dirty = true;
 	}
+}
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%u\n", sb.total_blocks);
-	printf("fat_blk_count=%u\n", sb.num_FAT_blocks);
-	printf("rdir_blk=%u\n", sb.root_dir);
-	printf("data_blk=%u\n", sb.data_block);
-	printf("data_blk_count=%u\n", sb.num_data_blocks);
-	printf("fat_free_ratio=%u/%u\n", fat_free, sb.num_data_blocks);
-	printf("rdir_free_ratio=%u/%u\n", rdir_free, FS_FILE_MAX_COUNT);
+/* returns the disk block of FAT block @i, counting from 1: the FAT comes right
+   before the root directory */
+uint16_t fat_block(int i)
+{
+	return sb.root_dir - sb.num_FAT_blocks + i - 1;
+}
 
-	return 0;
+/* returns the @n-th block of the chain starting at @block */
+uint16_t chain_nth(uint16_t block, uint32_t n)
+{
+	for (uint32_t i = 0; i < n && block != FAT_EOC; i++)
+	{
+		block = fat.entries[block];
+		stats.fat_hops++;
+	}
+	return block;
 }
 
-int fs_create(const char *filename)
+/* returns the index of the data block corresponding to the file’s offset, or
+   FAT_EOC past the end of the chain; the blocks walked are added to the map
+   of the file, so that the FAT is followed once per block */
+int block_index(int fd)
 {
-	if (!mounted || verify_file_name(filename) == -1)
+	struct open_file *of = fd_table[fd].of;
+	uint32_t n = fd_table[fd].offset >> block_shift;
+
+	if (of->ext != NULL)
 	{
-		return -1;
+		return extent_find(of, n);
+	}
+	if (n < of->mapped)
+	{
+		return of->map[n];
 	}
 
-	// Loop through directory and check if file exists or empty entry exists
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	/* follow FAT from the last block mapped until the block of the offset */
+	uint16_t block = of->mapped ? fat.entries[of->map[of->mapped - 1]] : of->file->first_data_block;
+	while (block != FAT_EOC)
 	{
-		if (strcmp(root.entries[i].file_name, filename) == 0)
+		if (of->mapped == of->map_size)
 		{
-			return -1;
+			uint32_t size = of->map_size ? 2 * of->map_size : 64;
+			uint16_t *map = realloc(of->map, size * sizeof(uint16_t));
+			if (map == NULL)
+			{
+				return chain_nth(block, n - of->mapped); // walk without the map
+			}
+			of->map = map;
+			of->map_size = size;
 		}
-		else if (root.entries[i].file_name[0] == '\0')
+		of->map[of->mapped++] = block;
+		if (of->mapped > n)
 		{
-			// Empty entry exists create a new blank file in entry
-			memcpy(root.entries[i].file_name, filename, FS_FILENAME_LEN);
-			root.entries[i].file_size = 0;
-			root.entries[i].first_data_block = FAT_EOC;
-			return 0;
+			return block;
 		}
+		block = fat.entries[block];
+		stats.fat_hops++;
 	}
-
-	return -1;
+	return FAT_EOC;
 }
 
-int fs_delete(const char *filename)
+/* returns the last data block of the chain starting at @block */
+uint16_t chain_last(uint16_t block)
 {
-	if (!mounted || verify_file_name(filename) == -1)
+	while (block != FAT_EOC && fat.entries[block] != FAT_EOC)
 	{
-		return -1;
+		block = fat.entries[block];
+		stats.fat_hops++;
 	}
+	return block;
+}
+
+/* orders queued runs by their first block */
+int discard_cmp(const void *a, const void *b)
+{
+	return ((const struct extent *)a)->start - ((const struct extent *)b)->start;
+}
 
-	// Loop through root directory and look for filename
+/* sorts the queued runs and merges those that overlap or touch */
+void discard_merge(void)
+{
+	uint32_t n = 0;
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	if (discard_count == 0)
 	{
-		if (strcmp(root.entries[i].file_name, filename) == 0)
+		return;
+	}
+
+	qsort(discard_runs, discard_count, sizeof(struct extent), discard_cmp);
+	for (uint32_t i = 0; i < discard_count; i++)
+	{
+		uint32_t end = discard_runs[i].start + discard_runs[i].count;
+		struct extent *last = n ? &discard_runs[n - 1] : NULL;
+		if (last != NULL && discard_runs[i].start <= last->start + last->count)
 		{
-			root.entries[i].file_name[0] = '\0';
-			int cur_block = root.entries[i].first_data_block;
-			while (cur_block != FAT_EOC)
+			if (end > last->start + last->count)
 			{
-				int next_block = fat.entries[cur_block];
-				fat.entries[cur_block] = 0;
-				cur_block = next_block;
-
+				last->count = end - last->start;
 			}
-			memset(&root.entries[i], 0, sizeof(struct file_entry));
-			return 0;
+			continue;
 		}
+		discard_runs[n++] = discard_runs[i];
 	}
-	return -1;
+	discard_count = n;
 }
 
-int fs_ls(void)
+/* gives the host space of the queued runs back, skipping the blocks that were
+   allocated again since, and merging runs only separated by free blocks */
+void discard_flush(void)
 {
-	if (!mounted)
-	{
-		return -1;
-	}
-	printf("FS Ls:\n");
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	discard_merge();
+	for (uint32_t i = 0; i < discard_count && !discard_off;)
 	{
-		if (root.entries[i].file_name[0] != '\0')
+		uint32_t from = discard_runs[i].start;
+		uint32_t to = from + discard_runs[i].count;
+		for (i++; i < discard_count; i++)
 		{
-			/* Format info */
-			printf("file: %s, ", root.entries[i].file_name);
-     			printf("size: %d, ",  root.entries[i].file_size);
-      			printf("data_blk: %d\n", root.entries[i].first_data_block);
+			uint32_t end = discard_runs[i].start + discard_runs[i].count;
+			if (discard_runs[i].start > to &&
+				fat_find_used(fat.entries, to, discard_runs[i].start) < discard_runs[i].start)
+			{
+				break;
+			}
+			to = end > to ? end : to;
 		}
-	}
 
-	return 0;
+		for (uint32_t b = fat_find_free(fat.entries, from, to); b < to;
+			 b = fat_find_free(fat.entries, b, to))
+		{
+			uint32_t used = fat_find_used(fat.entries, b, to);
+			if (block_discard(sb.data_block + b, used - b) == -1)
+			{
+				/* no space is given back for the rest of the mount */
+				discard_off = true;
+				break;
+			}
+			b = used;
+		}
+	}
+	free(discard_runs);
+	discard_runs = NULL;
+	discard_count = 0;
+	discard_size = 0;
 }
 
-int fs_open(const char *filename)
+/* queues freed data block @block for its host space to be given back */
+void discard_queue(uint16_t block)
 {
-	if (!mounted || verify_file_name(filename) == -1)
+	if (discard_off || read_only)
 	{
-		return -1;
+		return;
 	}
 
-	// Loop through directory and check if the file exists
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	struct extent *last = discard_count ? &discard_runs[discard_count - 1] : NULL;
+	if (last != NULL && block == last->start + last->count)
 	{
-		if (strcmp(root.entries[i].file_name, filename) == 0)
+		last->count++;
+	}
+	else
+	{
+		if (discard_count == discard_size)
 		{
-
-			// Find empty fd
-			for (int j = 0; j < FS_OPEN_MAX_COUNT; j++)
+			/* merging makes room, unless most runs lie apart */
+			discard_merge();
+			if (discard_count >= discard_size / 2)
 			{
-				if (fd_table[j].open == 0)
+				/* without memory, the block keeps its host space */
+				uint32_t size = discard_size ? 2 * discard_size : 64;
+				struct extent *runs = realloc(discard_runs, size * sizeof(struct extent));
+				if (runs == NULL)
 				{
-					fd_table[j].offset = 0;
-					fd_table[j].open = 1;
-					fd_table[j].file = &root.entries[i];
-					return 0;
+					return;
 				}
+				discard_runs = runs;
+				discard_size = size;
 			}
-			return -1;
 		}
+		discard_runs[discard_count].start = block;
+		discard_runs[discard_count++].count = 1;
 	}
+}
 
-	return -1; // empty fd not found
+/* frees data block @block, which stays allocated while snapshots use it */
+void free_block(uint16_t block)
+{
+	fat.entries[block] = (snap_refs != NULL && snap_refs[block]) ? FAT_EOC : 0;
+	TRACE(FS_TRACE_FAT_SET, block, fat.entries[block]);
+	if (fat.entries[block] == 0)
+	{
+		discard_queue(block);
+	}
 }
 
-int fs_close(int fd)
+/* frees the chain starting at @block */
+void chain_free(uint16_t block)
 {
-	if (!mounted || fd < 0 || fd > 32 || fd_table[fd].open == 0)
+	while (block != FAT_EOC)
 	{
-		return -1;
+		uint16_t next = fat.entries[block];
+		free_block(block);
+		block = next;
+		stats.fat_hops++;
 	}
+}
 
-	fd_table[fd].open = 0;
-	fd_table[fd].offset = 0;
-	fd_table[fd].file = NULL;
+/* frees up to @max blocks of the chains left to the reclaimer, and returns
+   how many were freed */
+uint32_t reclaim_blocks(uint32_t max)
+{
+	uint32_t freed = 0;
 
-	return 0;
+	while (reclaim_count && freed < max)
+	{
+		uint16_t *head = &reclaim_chains[reclaim_count - 1];
+		while (*head != FAT_EOC && freed < max)
+		{
+			uint16_t next = fat.entries[*head];
+			free_block(*head);
+			*head = next;
+			freed++;
+			stats.fat_hops++;
+		}
+		if (*head == FAT_EOC)
+		{
+			reclaim_count--;
+		}
+	}
+	stats.reclaimed += freed;
+	return freed;
 }
 
-int fs_stat(int fd)
+/* background reclaimer: frees the chains of deleted files a batch at a time,
+   holding the library lock for one batch only */
+void *reclaim_worker(void *arg)
 {
-	if (!mounted || fd < 0 || fd > 32 || fd_table[fd].open == 0)
+	(void)arg;
+	pthread_mutex_lock(&aio_lock);
+	for (;;)
 	{
-		return -1;
+		while (reclaim_count == 0 && !reclaim_stopping)
+		{
+			pthread_cond_wait(&reclaim_cond, &aio_lock);
+		}
+		if (reclaim_stopping)
+		{
+			break;
+		}
+		reclaim_blocks(RECLAIM_BATCH);
+
+		pthread_mutex_unlock(&aio_lock);
+		sched_yield();
+		pthread_mutex_lock(&aio_lock);
 	}
-	return fd_table[fd].file->file_size;
+	pthread_mutex_unlock(&aio_lock);
+	return NULL;
 }
 
-int fs_lseek(int fd, size_t offset)
+/* hands chain @block of a deleted file to the background reclaimer, started
+   on first use, or frees it at once if the reclaimer cannot take it; called
+   last by fs_delete(), as the reclaimer may start freeing at once */
+void reclaim_defer(uint16_t block)
 {
-	// Not mounted or invalid fd
-	if (!mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].open == 0)
+	if (reclaim_count == reclaim_size)
 	{
-		return -1;
+		uint32_t size = reclaim_size ? 2 * reclaim_size : 16;
+		uint16_t *chains = realloc(reclaim_chains, size * sizeof(uint16_t));
+		if (chains == NULL)
+		{
+			chain_free(block);
+			return;
+		}
+		reclaim_chains = chains;
+		reclaim_size = size;
 	}
+	reclaim_chains[reclaim_count++] = block;
 
-	// Offset larger than file size
-	if (offset > root.entries[fd].file_size)
+	if (reclaim_running)
 	{
-		return -1;
+		pthread_cond_signal(&reclaim_cond);
+		return;
 	}
 
-	fd_table[fd].offset = offset;
+	/* from now on, every call takes the library lock */
+	__atomic_store_n(&reclaim_running, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&reclaim_thread, NULL, reclaim_worker, NULL) != 0)
+	{
+		__atomic_store_n(&reclaim_running, 0, __ATOMIC_RELEASE);
+		reclaim_blocks(UINT32_MAX);
+	}
+}
 
-	return 0;
+/* stops the background reclaimer, leaving the chains it did not free yet to
+   the caller, which holds the library lock once: the lock is released while
+   waiting, as the reclaimer needs it to see the request */
+void reclaim_stop(void)
+{
+	if (!reclaim_running)
+	{
+		return;
+	}
+
+	reclaim_stopping = true;
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&aio_lock);
+	pthread_join(reclaim_thread, NULL);
+	pthread_mutex_lock(&aio_lock);
+	reclaim_stopping = false;
+	__atomic_store_n(&reclaim_running, 0, __ATOMIC_RELEASE);
 }
 
-int fs_write(int fd, void *buf, size_t count)
+/* allocates the first free data block as the end of a chain, or returns
+   FAT_EOC if the disk is full */
+uint16_t alloc_block(void)
 {
-	/* Check if file system is mounted */
-	if (!mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].open == 0)
+	/* first fit strategy */
+	stats.alloc_calls++;
+	uint16_t i = fat_find_free(fat.entries, 1, sb.num_data_blocks);
+	if (i == sb.num_data_blocks && reclaim_blocks(UINT32_MAX))
 	{
-		return -1;
+		/* blocks were waiting for the reclaimer */
+		i = fat_find_free(fat.entries, 1, sb.num_data_blocks);
+	}
+	if (i == sb.num_data_blocks)
+	{
+		stats.alloc_scan_steps += sb.num_data_blocks - 1;
+		return FAT_EOC;
 	}
+	stats.alloc_scan_steps += i;
 
-	bool is_first_entry = false;
-	
-	uint16_t block = block_index(fd);
+	// mark as end of newly allocated block
+	fat.entries[i] = FAT_EOC;
+	TRACE(FS_TRACE_ALLOC, i, i);
+	TRACE(FS_TRACE_FAT_SET, i, FAT_EOC);
+	return i;
+}
+
+/* returns the data block right after @last if @of has extents and the block
+   is free, so that its last extent grows instead of starting a new one, or
+   FAT_EOC */
+uint16_t extent_next(struct open_file *of, uint16_t last)
+{
+	if (of->ext == NULL || last == FAT_EOC || last + 1 >= sb.num_data_blocks ||
+		fat.entries[last + 1] != 0)
+	{
+		return FAT_EOC;
+	}
+	return last + 1;
+}
+
+void extent_drop(struct file_entry *file);
+
+/* allocates a new data block and link it at the end of the file’s data block chain */
+uint16_t create_new_block(uint16_t last_block, bool first_block, int fd) 
+{
+	struct open_file *of = fd_table[fd].of;
+	uint16_t new_block = first_block ? FAT_EOC : extent_next(of, last_block);
+
+	if (new_block != FAT_EOC)
+	{
+		stats.alloc_calls++;
+		fat.entries[new_block] = FAT_EOC;
+		TRACE(FS_TRACE_ALLOC, new_block, new_block);
+		TRACE(FS_TRACE_FAT_SET, new_block, FAT_EOC);
+	}
+	else
+	{
+		new_block = alloc_block();
+	}
+
+	if (new_block == FAT_EOC)
+	{
+		return FAT_EOC; // disk is full
+	}
+
+	if (first_block) 
+	{
+		/* set new free block to be first data block */
+		fd_table[fd].of->file->first_data_block = new_block;
+	} else {
+		/* link new block to end of data block chain */
+		fat.entries[last_block] = new_block;
+		TRACE(FS_TRACE_FAT_SET, last_block, new_block);
+	}
+
+	/* without memory for its extents, the file keeps its chain only */
+	if (of->ext != NULL && extent_append(of, new_block) == -1)
+	{
+		extent_drop(of->file);
+	}
+
+	return new_block;
+}
+
+/* frees the blocks of the file's chain that lie past its size */
+void trim_chain(struct file_entry *file)
+{
+	uint32_t keep = (file->file_size + block_mask) >> block_shift;
+	uint16_t block = file->first_data_block;
+	uint16_t last = FAT_EOC;
+
+	struct open_file *of = of_get(file, false);
+	if (of != NULL && of->mapped > keep)
+	{
+		of->mapped = keep;
+	}
+	if (of != NULL && of->ext != NULL)
+	{
+		extent_trim(of, keep);
+	}
+
+	for (uint32_t i = 0; i < keep && block != FAT_EOC; i++)
+	{
+		last = block;
+		block = fat.entries[block];
+		stats.fat_hops++;
+	}
+
+	if (last == FAT_EOC)
+	{
+		file->first_data_block = FAT_EOC;
+	}
+	else
+	{
+		fat.entries[last] = FAT_EOC;
+	}
+
+	chain_free(block);
+}
+
+/* records the checksum of data block @block as it is written */
+void csum_update(uint16_t block, const void *data)
+{
+	if (sb.features & FS_FEAT_CSUM)
+	{
+		csums[block] = crc32c(0, data, block_size);
+	}
+}
+
+/* checks data block @block against its checksum after it is read */
+int csum_verify(uint16_t block, const void *data)
+{
+	if (!(sb.features & FS_FEAT_CSUM))
+	{
+		return 0;
+	}
+
+	stats.csum_verified++;
+	if (crc32c(0, data, block_size) != csums[block])
+	{
+		stats.csum_errors++;
+		fprintf(stderr, "%s: checksum mismatch in data block %u\n", __func__, block);
+		return -1;
+	}
+	return 0;
+}
+
+/* reads data block @block, verifying its checksum */
+int read_data_block(uint16_t block, void *buf)
+{
+	if (block_read(sb.data_block + block, buf) == -1)
+	{
+		return -1;
+	}
+	return csum_verify(block, buf);
+}
+
+/* writes data block @block, updating its checksum */
+int write_data_block(uint16_t block, const void *buf)
+{
+	csum_update(block, buf);
+	return block_write(sb.data_block + block, buf);
+}
+
+/* writes the @count data blocks from @block with a single request, updating
+   their checksums */
+int write_data_range(uint16_t block, uint16_t count, const void *buf)
+{
+	for (uint16_t i = 0; i < count; i++)
+	{
+		csum_update(block + i, (const char *)buf + i * block_size);
+	}
+	return block_write_range(sb.data_block + block, count, buf);
+}
+
+/* returns whether data block @block belongs to the checksum area */
+bool is_csum_block(uint16_t block)
+{
+	return (sb.features & FS_FEAT_CSUM) && block >= sb.csum_block &&
+		block < sb.csum_block + sb.csum_count;
+}
+
+/* loads the extents of @file, a file with extents, from its entry or from
+   the data block holding them */
+struct open_file *extent_load(struct file_entry *file)
+{
+	struct open_file *of = of_get(file, true);
+	if (of == NULL)
+	{
+		return NULL;
+	}
+
+	BLOCK_BUFFER(data);
+	const struct extent *list = file->extents;
+	uint32_t count = file->extent_count;
+	of->ext_block = FAT_EOC;
+	if (count > EXTENT_INLINE)
+	{
+		of->ext_block = file->extents[0].start;
+		if (read_data_block(of->ext_block, data) == -1)
+		{
+			of_put(of);
+			return NULL;
+		}
+		stats.meta_reads++;
+		list = (const struct extent *)data;
+	}
+
+	of->ext_size = count > EXTENT_INLINE ? count : EXTENT_INLINE;
+	of->ext = malloc(of->ext_size * sizeof(*of->ext));
+	if (of->ext == NULL)
+	{
+		of_put(of);
+		return NULL;
+	}
+	uint32_t end = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		end += list[i].count;
+		of->ext[i].end = end;
+		of->ext[i].start = list[i].start;
+		of->ext[i].count = list[i].count;
+	}
+	of->ext_count = count;
+	of->ext_dirty = false;
+	return of;
+}
+
+/* turns @file, a file with extents, into a plain file, whose chain is all
+   there is to it */
+void extent_drop(struct file_entry *file)
+{
+	struct open_file *of = of_get(file, false);
+	if (of != NULL && of->ext != NULL)
+	{
+		if (of->ext_block != FAT_EOC)
+		{
+			free_block(of->ext_block);
+		}
+		free(of->ext);
+		of->ext = NULL;
+		of_put(of);
+	}
+	else if (file->extent_count > EXTENT_INLINE)
+	{
+		free_block(file->extents[0].start);
+	}
+
+	file->flags &= ~FS_FILE_EXTENT;
+	file->extent_count = 0;
+	memset(file->extents, 0, sizeof(file->extents));
+}
+
+/* writes back the extents of @of once its file is closed, and frees them; a
+   file with more than EXTENT_MAX extents, or with none left to store them
+   in, keeps its chain only */
+int extent_release(struct open_file *of)
+{
+	struct file_entry *file = of->file;
+	int ret = 0;
+
+	if (of->ext_dirty)
+	{
+		uint32_t count = of->ext_count;
+		if (count > EXTENT_MAX ||
+			(count > EXTENT_INLINE && of->ext_block == FAT_EOC && (of->ext_block = alloc_block()) == FAT_EOC))
+		{
+			extent_drop(file);
+			return 0;
+		}
+		if (count <= EXTENT_INLINE && of->ext_block != FAT_EOC)
+		{
+			free_block(of->ext_block);
+			of->ext_block = FAT_EOC;
+		}
+
+		file->extent_count = count;
+		memset(file->extents, 0, sizeof(file->extents));
+		if (count > EXTENT_INLINE)
+		{
+			BLOCK_BUFFER(data);
+			struct extent *list = (struct extent *)data;
+			memset(data, 0, block_size);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				list[i].start = of->ext[i].start;
+				list[i].count = of->ext[i].count;
+			}
+			ret = write_data_block(of->ext_block, data);
+			stats.meta_writes++;
+			file->extents[0].start = of->ext_block;
+		}
+		else
+		{
+			for (uint32_t i = 0; i < count; i++)
+			{
+				file->extents[i].start = of->ext[i].start;
+				file->extents[i].count = of->ext[i].count;
+			}
+		}
+	}
+
+	free(of->ext);
+	of->ext = NULL;
+	of_put(of);
+	return ret;
+}
+
+/* reads @count bytes into @buf from the offset of @fd, a file with extents
+   (@count does not go past the end of the file); the whole blocks of an
+   extent are read in a single request */
+int extent_read(int fd, char *buf, size_t count)
+{
+	struct open_file *of = fd_table[fd].of;
+	BLOCK_BUFFER(bounce_buffer);
+	uint32_t bytes_read = 0;
+
+	while (bytes_read < count)
+	{
+		uint32_t n = fd_table[fd].offset >> block_shift;
+		uint32_t block_offset = fd_table[fd].offset & block_mask;
+		uint32_t i = extent_search(of, n);
+		if (i == of->ext_count)
+		{
+			break; // less than @count bytes until the end of the file
+		}
+		uint16_t block = of->ext[i].start + of->ext[i].count - (of->ext[i].end - n);
+		uint32_t len = count - bytes_read;
+
+		if (block_offset == 0 && len >= block_size)
+		{
+			/* whole blocks up to the end of the extent: read them straight
+			   into @buf */
+			uint32_t blocks = len >> block_shift;
+			if (blocks > of->ext[i].end - n)
+			{
+				blocks = of->ext[i].end - n;
+			}
+			if (block_read_range(sb.data_block + block, blocks, buf + bytes_read) == -1)
+			{
+				return -1;
+			}
+			for (uint32_t j = 0; j < blocks; j++)
+			{
+				if (csum_verify(block + j, buf + bytes_read + j * block_size) == -1)
+				{
+					return -1;
+				}
+			}
+			stats.extent_reads++;
+			len = blocks << block_shift;
+		}
+		else
+		{
+			if (len > block_size - block_offset)
+			{
+				len = block_size - block_offset;
+			}
+			if (read_data_block(block, bounce_buffer) == -1)
+			{
+				return -1;
+			}
+			memcpy(buf + bytes_read, bounce_buffer + block_offset, len);
+			stats.bounce_bytes += len;
+		}
+
+		bytes_read += len;
+		fd_table[fd].offset += len;
+	}
+
+	stats.bytes_read += bytes_read;
+	return bytes_read;
+}
+
+/* index entries held by one block */
+#define ZCHUNKS_PER_BLOCK (block_size / sizeof(struct zchunk))
+
+/* in-memory state of a compressed file, while it is open */
+struct zfile
+{
+	struct zchunk *index;	// index[0] is the header, chunk i is index[i + 1]
+	uint16_t index_blocks;	// blocks at the start of the chain holding the index
+	uint16_t last;			// last block of the chain
+	uint16_t *live;			// bytes of chunks stored in each data block
+	bool index_dirty;
+	char *tail;				// contents of the block being filled
+	bool tail_dirty;
+	int32_t cached;			// chunk held uncompressed in @chunk, -1 if none
+	bool chunk_dirty;
+	char *chunk;
+};
+
+struct zfile *zfile_of(struct file_entry *file)
+{
+	struct open_file *of = of_get(file, false);
+	return of == NULL ? NULL : of->zf;
+}
+
+/* frees data block @block, found in a chain after block @from, and returns
+   the block that preceded it */
+uint16_t chain_unlink(uint16_t from, uint16_t block)
+{
+	uint16_t prev = from;
+
+	while (fat.entries[prev] != block)
+	{
+		prev = fat.entries[prev];
+		stats.fat_hops++;
+	}
+	fat.entries[prev] = fat.entries[block];
+	fat.entries[block] = 0;
+	TRACE(FS_TRACE_FAT_SET, prev, fat.entries[prev]);
+	TRACE(FS_TRACE_FAT_SET, block, 0);
+	return prev;
+}
+
+/* grows the index of @file so that it can describe chunks 0 to @count - 1 */
+int zfile_grow_index(struct zfile *zf, struct file_entry *file, uint32_t count)
+{
+	uint32_t need = (count + 1 + ZCHUNKS_PER_BLOCK - 1) / ZCHUNKS_PER_BLOCK;
+
+	while (zf->index_blocks < need)
+	{
+		struct zchunk *index = block_realloc(zf->index, zf->index_blocks * block_size,
+													 (zf->index_blocks + 1) * block_size);
+		if (index == NULL)
+		{
+			return -1;
+		}
+		zf->index = index;
+
+		uint16_t block = alloc_block();
+		if (block == FAT_EOC)
+		{
+			return -1; // disk is full
+		}
+
+		/* index blocks stay at the start of the chain, before the data */
+		if (zf->index_blocks == 0)
+		{
+			fat.entries[block] = file->first_data_block;
+			file->first_data_block = block;
+		}
+		else
+		{
+			uint16_t prev = chain_nth(file->first_data_block, zf->index_blocks - 1);
+			fat.entries[block] = fat.entries[prev];
+			fat.entries[prev] = block;
+			TRACE(FS_TRACE_FAT_SET, prev, block);
+		}
+		if (fat.entries[block] == FAT_EOC)
+		{
+			zf->last = block;
+		}
+
+		memset((char *)zf->index + zf->index_blocks * block_size, 0, block_size);
+		zf->index_blocks++;
+		zf->index_dirty = true;
+	}
+	return 0;
+}
+
+/* loads the index of compressed file @file */
+struct zfile *zfile_load(struct file_entry *file)
+{
+	struct zfile *zf = block_alloc(BLOCK_ALIGNED(sizeof(*zf)) + 2 * block_size);
+	if (zf == NULL)
+	{
+		return NULL;
+	}
+	zf->tail = (char *)zf + BLOCK_ALIGNED(sizeof(*zf));
+	zf->chunk = zf->tail + block_size;
+	zf->cached = -1;
+	zf->last = chain_last(file->first_data_block);
+	zf->live = calloc(sb.num_data_blocks, sizeof(uint16_t));
+	if (zf->live == NULL)
+	{
+		free(zf);
+		return NULL;
+	}
+
+	uint32_t chunks = (file->file_size + block_mask) >> block_shift;
+	if (file->first_data_block != FAT_EOC)
+	{
+		zf->index_blocks = (chunks + 1 + ZCHUNKS_PER_BLOCK - 1) / ZCHUNKS_PER_BLOCK;
+		zf->index = block_alloc(zf->index_blocks * block_size);
+		if (zf->index == NULL)
+		{
+			free(zf->live);
+			free(zf);
+			return NULL;
+		}
+
+		uint16_t block = file->first_data_block;
+		for (int i = 0; i < zf->index_blocks; i++)
+		{
+			if (block == FAT_EOC ||
+				read_data_block(block, (char *)zf->index + i * block_size) == -1)
+			{
+				free(zf->index);
+				free(zf->live);
+				free(zf);
+				return NULL;
+			}
+			block = fat.entries[block];
+			stats.fat_hops++;
+			stats.meta_reads++;
+		}
+
+		if (zf->index[0].block != 0 && read_data_block(zf->index[0].block, zf->tail) == -1)
+		{
+			free(zf->index);
+			free(zf->live);
+			free(zf);
+			return NULL;
+		}
+
+		for (uint32_t i = 1; i <= chunks; i++)
+		{
+			if (zf->index[i].block < sb.num_data_blocks)
+			{
+				zf->live[zf->index[i].block] += zf->index[i].length;
+			}
+		}
+	}
+
+	struct open_file *of = of_get(file, true);
+	if (of == NULL)
+	{
+		free(zf->index);
+		free(zf->live);
+		free(zf);
+		return NULL;
+	}
+	of->zf = zf;
+	return zf;
+}
+
+/* appends a new data block to the chain of compressed file @file */
+uint16_t zfile_new_block(struct zfile *zf)
+{
+	uint16_t block = alloc_block();
+	if (block != FAT_EOC)
+	{
+		fat.entries[zf->last] = block;
+		TRACE(FS_TRACE_FAT_SET, zf->last, block);
+		zf->last = block;
+	}
+	return block;
+}
+
+/* frees data block @block, which no longer holds any chunk, from the chain
+   of compressed file @file */
+void zfile_drop_block(struct zfile *zf, struct file_entry *file, uint16_t block)
+{
+	uint16_t prev = chain_unlink(chain_nth(file->first_data_block, zf->index_blocks - 1), block);
+
+	if (zf->last == block)
+	{
+		zf->last = prev;
+	}
+}
+
+/* compresses the cached chunk and stores it in the file */
+int zchunk_store(struct zfile *zf, struct file_entry *file)
+{
+	BLOCK_BUFFER(packed);
+	uint32_t idx = zf->cached;
+
+	if (zfile_grow_index(zf, file, idx + 1) == -1)
+	{
+		return -1;
+	}
+
+	struct zchunk *header = &zf->index[0];
+	struct zchunk *entry = &zf->index[idx + 1];
+	struct zchunk old = *entry;
+	uint16_t len = 0;
+	const char *data = packed;
+
+	/* chunks of zeros take no space */
+	if (zf->chunk[0] != 0 || memcmp(zf->chunk, zf->chunk + 1, block_size - 1) != 0)
+	{
+		len = lz_compress(zf->chunk, block_size, packed, block_size - 1);
+		if (len == 0)
+		{
+			/* incompressible: keep the chunk as is, in a block of its own */
+			len = block_size;
+			data = zf->chunk;
+		}
+	}
+	stats.compress_in += block_size;
+	stats.compress_out += len;
+
+	if (len == 0)
+	{
+		entry->block = 0;
+		entry->offset = 0;
+	}
+	else if (old.block != 0 && len <= old.length)
+	{
+		/* fits where the previous version of the chunk was */
+		if (old.block == header->block)
+		{
+			memcpy(zf->tail + old.offset, data, len);
+			zf->tail_dirty = true;
+			if (old.offset + old.length == header->offset)
+			{
+				header->offset = old.offset + len;
+			}
+		}
+		else if (len == block_size)
+		{
+			if (write_data_block(old.block, data) == -1)
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			BLOCK_BUFFER(bounce_buffer);
+			if (read_data_block(old.block, bounce_buffer) == -1)
+			{
+				return -1;
+			}
+			stats.rmw_reads++;
+			memcpy(bounce_buffer + old.offset, data, len);
+			if (write_data_block(old.block, bounce_buffer) == -1)
+			{
+				return -1;
+			}
+		}
+	}
+	else if (len == block_size)
+	{
+		uint16_t block = zfile_new_block(zf);
+		if (block == FAT_EOC)
+		{
+			return -1;
+		}
+		if (write_data_block(block, data) == -1)
+		{
+			zfile_drop_block(zf, file, block);
+			return -1;
+		}
+		entry->block = block;
+		entry->offset = 0;
+	}
+	else
+	{
+		/* pack after the chunks already in the tail block, in place of the
+		   previous version if it was the last one packed there */
+		if (old.block != 0 && old.block == header->block && old.offset + old.length == header->offset)
+		{
+			header->offset = old.offset;
+		}
+		if (header->block == 0 || header->offset + len > block_size)
+		{
+			if (zf->tail_dirty)
+			{
+				if (write_data_block(header->block, zf->tail) == -1)
+				{
+					return -1;
+				}
+				zf->tail_dirty = false;
+			}
+			uint16_t block = zfile_new_block(zf);
+			if (block == FAT_EOC)
+			{
+				return -1;
+			}
+			if (header->block != 0 && zf->live[header->block] == 0)
+			{
+				zfile_drop_block(zf, file, header->block);
+			}
+			memset(zf->tail, 0, block_size);
+			header->block = block;
+			header->offset = 0;
+		}
+		memcpy(zf->tail + header->offset, data, len);
+		entry->block = header->block;
+		entry->offset = header->offset;
+		header->offset += len;
+		zf->tail_dirty = true;
+	}
+	entry->length = len;
+
+	/* give back the block of the previous version once nothing is left in it */
+	if (old.block != 0)
+	{
+		zf->live[old.block] -= old.length;
+	}
+	if (entry->block != 0)
+	{
+		zf->live[entry->block] += len;
+	}
+	if (old.block != 0 && zf->live[old.block] == 0 && old.block != header->block)
+	{
+		zfile_drop_block(zf, file, old.block);
+	}
+
+	zf->index_dirty = true;
+	zf->chunk_dirty = false;
+	return 0;
+}
+
+/* makes chunk @idx the cached chunk, without reading it if @whole, since it
+   is about to be entirely overwritten */
+int zchunk_cache(struct zfile *zf, struct file_entry *file, uint32_t idx, bool whole)
+{
+	if (zf->cached == (int32_t)idx)
+	{
+		return 0;
+	}
+	if (zf->chunk_dirty && zchunk_store(zf, file) == -1)
+	{
+		return -1;
+	}
+	zf->cached = -1;
+
+	struct zchunk *entry = NULL;
+	if (idx + 1 < zf->index_blocks * ZCHUNKS_PER_BLOCK)
+	{
+		entry = &zf->index[idx + 1];
+	}
+
+	if (whole || entry == NULL || entry->block == 0)
+	{
+		memset(zf->chunk, 0, block_size);
+	}
+	else if (entry->length == block_size)
+	{
+		if (read_data_block(entry->block, zf->chunk) == -1)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		BLOCK_BUFFER(bounce_buffer);
+		const char *src = zf->tail;
+		if (entry->block != zf->index[0].block)
+		{
+			if (read_data_block(entry->block, bounce_buffer) == -1)
+			{
+				return -1;
+			}
+			src = bounce_buffer;
+		}
+		if (entry->offset + entry->length > block_size ||
+			lz_decompress(src + entry->offset, entry->length, zf->chunk, block_size) != (int)block_size)
+		{
+			fprintf(stderr, "%s: corrupted chunk %u in data block %u\n", __func__, idx, entry->block);
+			return -1;
+		}
+	}
+
+	zf->cached = idx;
+	return 0;
+}
+
+/* writes back what is only in memory, and forgets compressed file @file */
+int zfile_release(struct file_entry *file)
+{
+	struct zfile *zf = zfile_of(file);
+	int ret = 0;
+
+	if (zf->chunk_dirty && zchunk_store(zf, file) == -1)
+	{
+		ret = -1;
+	}
+	if (zf->tail_dirty && write_data_block(zf->index[0].block, zf->tail) == -1)
+	{
+		ret = -1;
+	}
+	if (zf->index_dirty)
+	{
+		uint16_t block = file->first_data_block;
+		for (int i = 0; i < zf->index_blocks; i++)
+		{
+			if (write_data_block(block, (char *)zf->index + i * block_size) == -1)
+			{
+				ret = -1;
+			}
+			block = fat.entries[block];
+			stats.fat_hops++;
+			stats.meta_writes++;
+		}
+	}
+
+	free(zf->index);
+	free(zf->live);
+	free(zf);
+	struct open_file *of = of_get(file, false);
+	of->zf = NULL;
+	of_put(of);
+	return ret;
+}
+
+/* writes @count bytes of @buf at the offset of @fd, a compressed file */
+int zfile_write(int fd, const char *buf, size_t count)
+{
+	struct file_entry *file = fd_table[fd].of->file;
+	struct zfile *zf = zfile_of(file);
+	uint32_t bytes_written = 0;
+
+	while (bytes_written < count)
+	{
+		uint32_t idx = fd_table[fd].offset >> block_shift;
+		uint32_t chunk_offset = fd_table[fd].offset & block_mask;
+		uint32_t len = count - bytes_written;
+		if (len > block_size - chunk_offset)
+		{
+			len = block_size - chunk_offset;
+		}
+
+		if (zchunk_cache(zf, file, idx, len == block_size) == -1)
+		{
+			break;
+		}
+		memcpy(zf->chunk + chunk_offset, buf + bytes_written, len);
+		zf->chunk_dirty = true;
+
+		/* store chunks as soon as they are complete, and the last one of the
+		   write before its bytes are reported written, so that running out
+		   of space is reported by the write that needed it */
+		if ((chunk_offset + len == block_size || bytes_written + len == count) &&
+			zchunk_store(zf, file) == -1)
+		{
+			zf->cached = -1;
+			zf->chunk_dirty = false;
+			break;
+		}
+
+		bytes_written += len;
+		fd_table[fd].offset += len;
+		if (fd_table[fd].offset > file->file_size)
+		{
+			file->file_size = fd_table[fd].offset;
+		}
+	}
+
+	stats.bytes_written += bytes_written;
+	return bytes_written;
+}
+
+/* reads @count bytes into @buf from the offset of @fd, a compressed file
+   (@count does not go past the end of the file) */
+int zfile_read(int fd, char *buf, size_t count)
+{
+	struct file_entry *file = fd_table[fd].of->file;
+	struct zfile *zf = zfile_of(file);
+	uint32_t bytes_read = 0;
+
+	while (bytes_read < count)
+	{
+		uint32_t idx = fd_table[fd].offset >> block_shift;
+		uint32_t chunk_offset = fd_table[fd].offset & block_mask;
+		uint32_t len = count - bytes_read;
+		if (len > block_size - chunk_offset)
+		{
+			len = block_size - chunk_offset;
+		}
+
+		if (zchunk_cache(zf, file, idx, false) == -1)
+		{
+			return bytes_read ? (int)bytes_read : -1;
+		}
+		memcpy(buf + bytes_read, zf->chunk + chunk_offset, len);
+
+		bytes_read += len;
+		fd_table[fd].offset += len;
+	}
+
+	stats.bytes_read += bytes_read;
+	return bytes_read;
+}
+
+/* slots taken by an inline file of @size bytes */
+uint32_t inline_slots(uint32_t size)
+{
+	return (size + INLINE_SLOT - 1) / INLINE_SLOT;
+}
+
+/* marks slots @first to @first + @count - 1 as used or free */
+void inline_mark(uint32_t first, uint32_t count, bool used)
+{
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		if (used)
+		{
+			inline_used[i / 64] |= 1ull << (i % 64);
+		}
+		else
+		{
+			inline_used[i / 64] &= ~(1ull << (i % 64));
+		}
+	}
+}
+
+/* takes the first run of @count free slots, or returns -1 if there is none */
+int inline_alloc(uint32_t count)
+{
+	uint32_t total = sb.inline_count * block_size / INLINE_SLOT;
+	uint32_t run = 0;
+
+	for (uint32_t i = 0; i < total; i++)
+	{
+		run = (inline_used[i / 64] & (1ull << (i % 64))) ? 0 : run + 1;
+		if (run == count)
+		{
+			inline_mark(i + 1 - count, count, true);
+			return i + 1 - count;
+		}
+	}
+	return -1;
+}
+
+/* copies @len bytes of @data, which may be in the area, or zeros if @data is
+   NULL, at byte @offset of the inline area */
+void inline_copy(uint32_t offset, const void *data, uint32_t len)
+{
+	if (data == NULL)
+	{
+		memset(inline_area + offset, 0, len);
+	}
+	else
+	{
+		memmove(inline_area + offset, data, len);
+	}
+	for (uint32_t b = offset / block_size; b <= (offset + len - 1) / block_size; b++)
+	{
+		inline_dirty[b] = true;
+	}
+}
+
+/* writes @count bytes of @buf at the offset of @fd, an inline file, or
+   returns -1 if the inline area has no room left for it */
+int inline_write(int fd, const char *buf, size_t count)
+{
+	struct file_entry *file = fd_table[fd].of->file;
+	uint32_t size = file->file_size;
+	uint32_t end = fd_table[fd].offset + count;
+	uint32_t have = inline_slots(file->file_size);
+	uint32_t need = inline_slots(end);
+
+	if (need > have)
+	{
+		/* move to a run of slots large enough, which may start where
+		   the file already is */
+		if (have)
+		{
+			inline_mark(file->first_data_block, have, false);
+		}
+		int first = inline_alloc(need);
+		if (first == -1)
+		{
+			if (have)
+			{
+				inline_mark(file->first_data_block, have, true);
+			}
+			return -1;
+		}
+		if (have && first != file->first_data_block)
+		{
+			inline_copy(first * INLINE_SLOT,
+				inline_area + file->first_data_block * INLINE_SLOT, file->file_size);
+		}
+		file->first_data_block = first;
+	}
+
+	if (fd_table[fd].offset > size)
+	{
+		/* past the end of file: what lies in between reads as zeros */
+		inline_copy(file->first_data_block * INLINE_SLOT + size, NULL, fd_table[fd].offset - size);
+	}
+	if (count)
+	{
+		inline_copy(file->first_data_block * INLINE_SLOT + fd_table[fd].offset, buf, count);
+	}
+	fd_table[fd].offset = end;
+	if (end > file->file_size)
+	{
+		file->file_size = end;
+	}
+
+	stats.bytes_written += count;
+	return count;
+}
+
+int write_blocks(int fd, const void *buf, size_t count);
+
+/* allocates the reference table and hash table of shared data blocks */
+int dedup_alloc(void)
+{
+	uint32_t buckets = 1;
+	while (buckets < sb.num_data_blocks)
+	{
+		buckets <<= 1;
+	}
+	dedup_mask = buckets - 1;
+
+	dedup_refs = block_alloc(sb.dedup_count * block_size);
+	dedup_dirty = calloc(sb.dedup_count, sizeof(bool));
+	dedup_buckets = calloc(buckets, sizeof(uint16_t));
+	dedup_next = calloc(sb.num_data_blocks, sizeof(uint16_t));
+	if (dedup_refs == NULL || dedup_dirty == NULL || dedup_buckets == NULL || dedup_next == NULL)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* frees what the optional features keep in memory while mounted */
+void free_features(void)
+{
+	free(csums);
+	free(inline_area);
+	free(inline_used);
+	free(inline_dirty);
+	free(dedup_refs);
+	free(dedup_dirty);
+	free(dedup_buckets);
+	free(dedup_next);
+	free(snaps);
+	csums = NULL;
+	inline_area = NULL;
+	inline_used = NULL;
+	inline_dirty = NULL;
+	dedup_refs = NULL;
+	dedup_dirty = NULL;
+	dedup_buckets = NULL;
+	dedup_next = NULL;
+	snaps = NULL;
+	snap_refs = NULL;
+}
+
+/* index entries held by one block of a deduplicated or sparse file */
+#define IBLOCKS_PER_BLOCK (block_size / sizeof(uint16_t))
+
+/* in-memory state of a deduplicated or sparse file, while it is open */
+struct ifile
+{
+	uint16_t *index;		// data block of each block of the file, 0 for a hole
+	uint16_t index_blocks;	// blocks at the start of the chain holding the index
+	uint16_t last;			// last block of the chain
+	bool index_dirty;
+	int32_t cached;			// block of the file held in @data, -1 if none
+	bool data_dirty;
+	char data[] __attribute__((aligned(BLOCK_ALIGN))); // one block
+};
+
+struct ifile *ifile_of(struct file_entry *file)
+{
+	struct open_file *of = of_get(file, false);
+	return of == NULL ? NULL : of->xf;
+}
+
+void dedup_set(uint16_t block, uint32_t hash, uint16_t refs)
+{
+	dedup_refs[block].hash = hash;
+	dedup_refs[block].refs = refs;
+	dedup_dirty[block * sizeof(struct dedup_ref) / block_size] = true;
+}
+
+void dedup_insert(uint16_t block)
+{
+	uint32_t bucket = dedup_refs[block].hash & dedup_mask;
+
+	dedup_next[block] = dedup_buckets[bucket];
+	dedup_buckets[bucket] = block;
+}
+
+void dedup_remove(uint16_t block)
+{
+	uint16_t *link = &dedup_buckets[dedup_refs[block].hash & dedup_mask];
+
+	while (*link != block)
+	{
+		link = &dedup_next[*link];
+	}
+	*link = dedup_next[block];
+}
+
+/* returns a data block holding @data, whose hash is @hash, or 0 if none */
+uint16_t dedup_find(const char *data, uint32_t hash)
+{
+	BLOCK_BUFFER(bounce_buffer);
+
+	for (uint16_t b = dedup_buckets[hash & dedup_mask]; b != 0; b = dedup_next[b])
+	{
+		/* same hash: compare the contents to be sure */
+		if (dedup_refs[b].hash == hash && read_data_block(b, bounce_buffer) == 0 &&
+			memcmp(bounce_buffer, data, block_size) == 0)
+		{
+			return b;
+		}
+	}
+	return 0;
+}
+
+/* drops a reference to shared data block @block, freeing it with the last */
+void dedup_put(uint16_t block)
+{
+	if (--dedup_refs[block].refs == 0)
+	{
+		dedup_remove(block);
+		fat.entries[block] = 0;
+		TRACE(FS_TRACE_FAT_SET, block, 0);
+		discard_queue(block);
+	}
+	dedup_dirty[block * sizeof(struct dedup_ref) / block_size] = true;
+}
+
+/* loads the index of deduplicated or sparse file @file */
+struct ifile *ifile_load(struct file_entry *file)
+{
+	struct ifile *xf = block_alloc(sizeof(*xf) + block_size);
+	if (xf == NULL)
+	{
+		return NULL;
+	}
+	xf->cached = -1;
+	xf->last = chain_last(file->first_data_block);
+
+	uint32_t blocks = (file->file_size + block_mask) >> block_shift;
+	xf->index_blocks = (blocks + IBLOCKS_PER_BLOCK - 1) / IBLOCKS_PER_BLOCK;
+	if (xf->index_blocks == 0 && (file->flags & FS_FILE_SPARSE))
+	{
+		xf->index_blocks = 1; // sparse files always have an index block
+	}
+	if (xf->index_blocks)
+	{
+		xf->index = block_alloc(xf->index_blocks * block_size);
+		if (xf->index == NULL)
+		{
+			free(xf);
+			return NULL;
+		}
+	}
+
+	uint16_t block = file->first_data_block;
+	for (int i = 0; i < xf->index_blocks; i++)
+	{
+		if (block == FAT_EOC ||
+			read_data_block(block, (char *)xf->index + i * block_size) == -1)
+		{
+			free(xf->index);
+			free(xf);
+			return NULL;
+		}
+		block = fat.entries[block];
+		stats.fat_hops++;
+		stats.meta_reads++;
+	}
+
+	struct open_file *of = of_get(file, true);
+	if (of == NULL)
+	{
+		free(xf->index);
+		free(xf);
+		return NULL;
+	}
+	of->xf = xf;
+	return xf;
+}
+
+/* grows the index of @file so that it can describe blocks 0 to @count - 1 */
+int ifile_grow_index(struct ifile *xf, struct file_entry *file, uint32_t count)
+{
+	uint32_t need = (count + IBLOCKS_PER_BLOCK - 1) / IBLOCKS_PER_BLOCK;
+
+	while (xf->index_blocks < need)
+	{
+		uint16_t *index = block_realloc(xf->index, xf->index_blocks * block_size,
+											   (xf->index_blocks + 1) * block_size);
+		if (index == NULL)
+		{
+			return -1;
+		}
+		xf->index = index;
+
+		uint16_t block = alloc_block();
+		if (block == FAT_EOC)
+		{
+			return -1; // disk is full
+		}
+
+		/* index blocks stay at the start of the chain, before the data */
+		if (xf->index_blocks == 0)
+		{
+			fat.entries[block] = file->first_data_block;
+			file->first_data_block = block;
+		}
+		else
+		{
+			uint16_t prev = chain_nth(file->first_data_block, xf->index_blocks - 1);
+			fat.entries[block] = fat.entries[prev];
+			fat.entries[prev] = block;
+			TRACE(FS_TRACE_FAT_SET, prev, block);
+		}
+		if (fat.entries[block] == FAT_EOC)
+		{
+			xf->last = block;
+		}
+
+		memset((char *)xf->index + xf->index_blocks * block_size, 0, block_size);
+		xf->index_blocks++;
+		xf->index_dirty = true;
+	}
+	return 0;
+}
+
+/* stores the cached block: in a data block of the file's own for a sparse
+   file, and in a data block shared with identical contents otherwise */
+int iblock_store(struct ifile *xf, struct file_entry *file)
+{
+	uint32_t idx = xf->cached;
+
+	if (ifile_grow_index(xf, file, idx + 1) == -1)
+	{
+		return -1;
+	}
+
+	uint16_t old = xf->index[idx];
+	uint16_t block = 0;
+
+	/* blocks of zeros take no space */
+	bool zeros = xf->data[0] == 0 && memcmp(xf->data, xf->data + 1, block_size - 1) == 0;
+
+	if (file->flags & FS_FILE_SPARSE)
+	{
+		if (zeros && old != 0)
+		{
+			uint16_t prev = chain_unlink(chain_nth(file->first_data_block, xf->index_blocks - 1), old);
+			if (xf->last == old)
+			{
+				xf->last = prev;
+			}
+		}
+		else if (old != 0)
+		{
+			if (write_data_block(old, xf->data) == -1)
+			{
+				return -1;
+			}
+			block = old;
+		}
+		else if (!zeros)
+		{
+			block = alloc_block();
+			if (block == FAT_EOC)
+			{
+				return -1;
+			}
+			if (write_data_block(block, xf->data) == -1)
+			{
+				free_block(block);
+				return -1;
+			}
+			fat.entries[xf->last] = block;
+			TRACE(FS_TRACE_FAT_SET, xf->last, block);
+			xf->last = block;
+		}
+
+		xf->index[idx] = block;
+		xf->index_dirty = true;
+		xf->data_dirty = false;
+		return 0;
+	}
+
+	if (!zeros)
+	{
+		uint32_t hash = crc32c(0, xf->data, block_size);
+
+		block = dedup_find(xf->data, hash);
+		if (block == old && block != 0)
+		{
+			xf->data_dirty = false;
+			return 0; // unchanged
+		}
+
+		if (block != 0)
+		{
+			dedup_set(block, hash, dedup_refs[block].refs + 1);
+			stats.dedup_hits++;
+		}
+		else if (old != 0 && dedup_refs[old].refs == 1)
+		{
+			/* only user of the old contents: overwrite them */
+			if (write_data_block(old, xf->data) == -1)
+			{
+				return -1;
+			}
+			dedup_remove(old);
+			dedup_set(old, hash, 1);
+			dedup_insert(old);
+			block = old;
+		}
+		else
+		{
+			/* copy on write if the old contents are shared */
+			block = alloc_block();
+			if (block == FAT_EOC)
+			{
+				return -1;
+			}
+			if (write_data_block(block, xf->data) == -1)
+			{
+				free_block(block);
+				return -1;
+			}
+			dedup_set(block, hash, 1);
+			dedup_insert(block);
+			if (old != 0)
+			{
+				stats.dedup_cow++;
+			}
+		}
+	}
+
+	if (old != 0 && old != block)
+	{
+		dedup_put(old);
+	}
+	xf->index[idx] = block;
+	xf->index_dirty = true;
+	xf->data_dirty = false;
+	return 0;
+}
+
+/* makes block @idx of the file the cached block, without reading it if
+   @whole, since it is about to be entirely overwritten */
+int iblock_cache(struct ifile *xf, struct file_entry *file, uint32_t idx, bool whole)
+{
+	if (xf->cached == (int32_t)idx)
+	{
+		return 0;
+	}
+	if (xf->data_dirty && iblock_store(xf, file) == -1)
+	{
+		return -1;
+	}
+	xf->cached = -1;
+
+	uint16_t block = 0;
+	if (idx < xf->index_blocks * IBLOCKS_PER_BLOCK)
+	{
+		block = xf->index[idx];
+	}
+
+	if (whole || block == 0)
+	{
+		memset(xf->data, 0, block_size);
+	}
+	else if (read_data_block(block, xf->data) == -1)
+	{
+		return -1;
+	}
+
+	xf->cached = idx;
+	return 0;
+}
+
+/* writes back what is only in memory, and forgets indexed file @file */
+int ifile_release(struct file_entry *file)
+{
+	struct ifile *xf = ifile_of(file);
+	int ret = 0;
+
+	if (xf->data_dirty && iblock_store(xf, file) == -1)
+	{
+		ret = -1;
+	}
+	if (xf->index_dirty)
+	{
+		uint16_t block = file->first_data_block;
+		for (int i = 0; i < xf->index_blocks; i++)
+		{
+			if (write_data_block(block, (char *)xf->index + i * block_size) == -1)
+			{
+				ret = -1;
+			}
+			block = fat.entries[block];
+			stats.fat_hops++;
+			stats.meta_writes++;
+		}
+	}
+
+	free(xf->index);
+	free(xf);
+	struct open_file *of = of_get(file, false);
+	of->xf = NULL;
+	of_put(of);
+	return ret;
+}
+
+/* turns plain file @file into a sparse file, by putting an index of the
+   blocks of its chain in front of them */
+struct ifile *ifile_convert(struct file_entry *file)
+{
+	struct ifile *xf = block_alloc(sizeof(*xf) + block_size);
+	if (xf == NULL)
+	{
+		return NULL;
+	}
+	xf->cached = -1;
+
+	/* blocks reserved past the end of file would not be in the index, and
+	   the index replaces the extents */
+	trim_chain(file);
+	if (file->flags & FS_FILE_EXTENT)
+	{
+		extent_drop(file);
+	}
+
+	/* the rest of the last block now reads as part of the file */
+	uint32_t tail = file->file_size & block_mask;
+	if (tail)
+	{
+		uint16_t last = chain_last(file->first_data_block);
+		if (read_data_block(last, xf->data) == -1)
+		{
+			free(xf);
+			return NULL;
+		}
+		memset(xf->data + tail, 0, block_size - tail);
+		if (write_data_block(last, xf->data) == -1)
+		{
+			free(xf);
+			return NULL;
+		}
+	}
+
+	uint32_t blocks = (file->file_size + block_mask) >> block_shift;
+	if (ifile_grow_index(xf, file, blocks ? blocks : 1) == -1)
+	{
+		/* disk is full: take the index blocks back */
+		for (int i = 0; i < xf->index_blocks; i++)
+		{
+			uint16_t block = file->first_data_block;
+			file->first_data_block = fat.entries[block];
+			fat.entries[block] = 0;
+			TRACE(FS_TRACE_FAT_SET, block, 0);
+		}
+		free(xf->index);
+		free(xf);
+		return NULL;
+	}
+
+	uint16_t block = chain_nth(file->first_data_block, xf->index_blocks);
+	for (uint32_t i = 0; i < blocks; i++)
+	{
+		xf->index[i] = block;
+		block = fat.entries[block];
+		stats.fat_hops++;
+	}
+	xf->last = chain_last(file->first_data_block);
+
+	/* the state of an open file, whose reserved blocks were trimmed above */
+	struct open_file *of = of_get(file, true);
+	if (of == NULL)
+	{
+		free(xf->index);
+		free(xf);
+		return NULL;
+	}
+	of->reserved = false;
+	of->mapped = 0;
+	of->xf = xf;
+
+	file->flags |= FS_FILE_SPARSE;
+	if (!(sb.features & FS_FEAT_SPARSE))
+	{
+		sb.features |= FS_FEAT_SPARSE;
+		sb_dirty = 1;
+	}
+	return xf;
+}
+
+/* drops the references of deduplicated file @file to data blocks, and
+   forgets it; the chain holding its index is left to the caller */
+int ifile_drop(struct file_entry *file)
+{
+	struct ifile *xf = ifile_of(file);
+	if (xf == NULL && (xf = ifile_load(file)) == NULL)
+	{
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < xf->index_blocks * IBLOCKS_PER_BLOCK; i++)
+	{
+		if (xf->index[i] != 0)
+		{
+			dedup_put(xf->index[i]);
+		}
+	}
+
+	free(xf->index);
+	free(xf);
+	struct open_file *of = of_get(file, false);
+	of->xf = NULL;
+	of_put(of);
+	return 0;
+}
+
+/* writes @count bytes of @buf at the offset of @fd, a deduplicated or sparse file */
+int ifile_write(int fd, const char *buf, size_t count)
+{
+	struct file_entry *file = fd_table[fd].of->file;
+	struct ifile *xf = ifile_of(file);
+	uint32_t bytes_written = 0;
+
+	while (bytes_written < count)
+	{
+		uint32_t idx = fd_table[fd].offset >> block_shift;
+		uint32_t block_offset = fd_table[fd].offset & block_mask;
+		uint32_t len = count - bytes_written;
+		if (len > block_size - block_offset)
+		{
+			len = block_size - block_offset;
+		}
+
+		if (iblock_cache(xf, file, idx, len == block_size) == -1)
+		{
+			break;
+		}
+		memcpy(xf->data + block_offset, buf + bytes_written, len);
+		xf->data_dirty = true;
+
+		/* store the block before its bytes are reported written, so that
+		   running out of space is reported by the write that needed it */
+		if (iblock_store(xf, file) == -1)
+		{
+			xf->cached = -1;
+			xf->data_dirty = false;
+			break;
+		}
+
+		bytes_written += len;
+		fd_table[fd].offset += len;
+		if (fd_table[fd].offset > file->file_size)
+		{
+			file->file_size = fd_table[fd].offset;
+		}
+	}
+
+	stats.bytes_written += bytes_written;
+	return bytes_written;
+}
+
+/* reads @count bytes into @buf from the offset of @fd, a deduplicated or sparse file
+   (@count does not go past the end of the file) */
+int ifile_read(int fd, char *buf, size_t count)
+{
+	struct file_entry *file = fd_table[fd].of->file;
+	struct ifile *xf = ifile_of(file);
+	uint32_t bytes_read = 0;
+
+	while (bytes_read < count)
+	{
+		uint32_t idx = fd_table[fd].offset >> block_shift;
+		uint32_t block_offset = fd_table[fd].offset & block_mask;
+		uint32_t len = count - bytes_read;
+		if (len > block_size - block_offset)
+		{
+			len = block_size - block_offset;
+		}
+
+		if (iblock_cache(xf, file, idx, false) == -1)
+		{
+			return bytes_read ? (int)bytes_read : -1;
+		}
+		memcpy(buf + bytes_read, xf->data + block_offset, len);
+
+		bytes_read += len;
+		fd_table[fd].offset += len;
+	}
+
+	stats.bytes_read += bytes_read;
+	return bytes_read;
+}
+
+/* moves inline file @fd to data blocks, before it outgrows the inline area */
+int inline_spill(int fd)
+{
+	struct file_entry *file = fd_table[fd].of->file;
+	char data[INLINE_MAX];
+	uint32_t size = file->file_size;
+	uint32_t offset = fd_table[fd].offset;
+	uint16_t first = file->first_data_block;
+	bool dedup = sb.features & FS_FEAT_DEDUP;
+	bool failed = false;
+
+	if (size)
+	{
+		memcpy(data, inline_area + first * INLINE_SLOT, size);
+	}
+
+	file->flags &= ~FS_FILE_INLINE;
+	file->first_data_block = FAT_EOC;
+	file->file_size = 0;
+	fd_table[fd].offset = 0;
+	if (dedup)
+	{
+		file->flags |= FS_FILE_DEDUP;
+		failed = ifile_load(file) == NULL;
+	}
+	else if (sb.features & FS_FEAT_EXTENT)
+	{
+		file->flags |= FS_FILE_EXTENT;
+		file->extent_count = 0;
+		failed = extent_load(file) == NULL;
+	}
+
+	if (failed ||
+		(size && (dedup ? ifile_write(fd, data, size) : write_blocks(fd, data, size)) != (int)size))
+	{
+		/* disk is full: stay inline */
+		if (dedup && ifile_of(file) != NULL)
+		{
+			ifile_drop(file);
+		}
+		file->file_size = 0;
+		trim_chain(file);
+		if (file->flags & FS_FILE_EXTENT)
+		{
+			extent_drop(file);
+		}
+		file->flags &= ~FS_FILE_DEDUP;
+		file->flags |= FS_FILE_INLINE;
+		file->first_data_block = first;
+		file->file_size = size;
+		fd_table[fd].offset = offset;
+		return -1;
+	}
+
+	if (size)
+	{
+		inline_mark(first, inline_slots(size), false);
+	}
+	fd_table[fd].offset = offset;
+	stats.bytes_written -= size;
+	return 0;
+}
+
+/* directory loaded in memory, kept until unmount */
+struct dir
+{
+	struct file_entry *entry;	// entry of the directory in its parent
+	struct dir *next;			// next directory in the same bucket of dirs
+	struct dir_header header;
+	bool header_dirty;
+	uint16_t *blocks;			// data block of each block of the chain
+	struct dir_hash **index;	// blocks of the index, loaded on demand
+	bool *index_dirty;
+	struct file_entry **entries;// blocks of entries, loaded on demand
+};
+
+/* directories loaded, by address of their entry */
+#define DIR_BUCKETS 64
+struct dir *dirs[DIR_BUCKETS];
+
+/* directories found by path, so that a path is only walked once */
+#define PATH_CACHE_SIZE 256
+struct path_cache_entry
+{
+	struct dir *dir;
+	uint32_t hash;
+	char path[FS_PATH_MAX];
+};
+struct path_cache_entry path_cache[PATH_CACHE_SIZE];
+
+/* FNV-1a of the @len bytes of @name */
+uint32_t name_hash(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+struct dir **dir_bucket(struct file_entry *entry)
+{
+	return &dirs[((uintptr_t)entry / sizeof(struct file_entry)) % DIR_BUCKETS];
+}
+
+/* forgets directory @d, without writing it back */
+void dir_free(struct dir *d)
+{
+	struct dir **link = dir_bucket(d->entry);
+
+	while (*link != d)
+	{
+		link = &(*link)->next;
+	}
+	*link = d->next;
+
+	for (uint32_t i = 0; i < d->header.index_blocks; i++)
+	{
+		free(d->index[i]);
+	}
+	for (uint32_t i = 0; i < d->header.entry_blocks; i++)
+	{
+		free(d->entries[i]);
+	}
+	free(d->blocks);
+	free(d->index);
+	free(d->index_dirty);
+	free(d->entries);
+	free(d);
+
+	/* paths may lead to it */
+	memset(path_cache, 0, sizeof(path_cache));
+}
+
+/* sizes the arrays of @d for its header */
+int dir_resize(struct dir *d)
+{
+	uint32_t index_blocks = d->header.index_blocks;
+	uint32_t entry_blocks = d->header.entry_blocks;
+
+	uint16_t *blocks = realloc(d->blocks, (1 + index_blocks + entry_blocks) * sizeof(uint16_t));
+	if (blocks != NULL)
+	{
+		d->blocks = blocks;
+	}
+	struct dir_hash **index = realloc(d->index, index_blocks * sizeof(*index));
+	if (index != NULL)
+	{
+		d->index = index;
+	}
+	bool *index_dirty = realloc(d->index_dirty, index_blocks * sizeof(bool));
+	if (index_dirty != NULL)
+	{
+		d->index_dirty = index_dirty;
+	}
+	struct file_entry **entries = realloc(d->entries, (entry_blocks ? entry_blocks : 1) * sizeof(*entries));
+	if (entries != NULL)
+	{
+		d->entries = entries;
+	}
+	return blocks && index && index_dirty && entries ? 0 : -1;
+}
+
+/* returns directory @entry, loading its header and the block numbers of its
+   chain if needed */
+struct dir *dir_get(struct file_entry *entry)
+{
+	struct dir **bucket = dir_bucket(entry);
+
+	for (struct dir *d = *bucket; d != NULL; d = d->next)
+	{
+		if (d->entry == entry)
+		{
+			return d;
+		}
+	}
+
+	struct dir *d = calloc(1, sizeof(*d));
+	if (d == NULL)
+	{
+		return NULL;
+	}
+	d->entry = entry;
+	d->next = *bucket;
+	*bucket = d;
+
+	uint32_t len = entry->file_size >> block_shift;
+	BLOCK_BUFFER(bounce_buffer);
+	if (entry->first_data_block == FAT_EOC ||
+		read_data_block(entry->first_data_block, bounce_buffer) == -1 ||
+		!memcpy(&d->header, bounce_buffer, sizeof(d->header)) ||
+		d->header.magic != DIR_MAGIC || d->header.index_blocks == 0 ||
+		1 + d->header.index_blocks + d->header.entry_blocks != len ||
+		dir_resize(d) == -1)
+	{
+		d->header.index_blocks = 0;
+		d->header.entry_blocks = 0;
+		dir_free(d);
+		return NULL;
+	}
+	stats.meta_reads++;
+
+	/* the chain is walked in memory only */
+	uint16_t block = entry->first_data_block;
+	for (uint32_t i = 0; i < len; i++)
+	{
+		d->blocks[i] = block;
+		block = fat.entries[block];
+		stats.fat_hops++;
+	}
+	memset(d->index, 0, d->header.index_blocks * sizeof(*d->index));
+	memset(d->index_dirty, 0, d->header.index_blocks * sizeof(bool));
+	memset(d->entries, 0, d->header.entry_blocks * sizeof(*d->entries));
+	return d;
+}
+
+/* returns position @pos of the index of @d */
+struct dir_hash *dir_hash_at(struct dir *d, uint32_t pos)
+{
+	uint32_t i = pos / DIR_HASHES_PER_BLOCK(block_size);
+
+	if (d->index[i] == NULL)
+	{
+		struct dir_hash *block = block_alloc(block_size);
+		if (block == NULL || read_data_block(d->blocks[1 + i], block) == -1)
+		{
+			free(block);
+			return NULL;
+		}
+		stats.meta_reads++;
+		d->index[i] = block;
+	}
+	return &d->index[i][pos % DIR_HASHES_PER_BLOCK(block_size)];
+}
+
+/* returns entry @slot of @d */
+struct file_entry *dir_entry_at(struct dir *d, uint32_t slot)
+{
+	uint32_t i = slot / DIR_ENTRIES_PER_BLOCK(block_size);
+
+	if (d->entries[i] == NULL)
+	{
+		struct file_entry *block = block_alloc(block_size);
+		if (block == NULL || read_data_block(d->blocks[1 + d->header.index_blocks + i], block) == -1)
+		{
+			free(block);
+			return NULL;
+		}
+		stats.meta_reads++;
+		d->entries[i] = block;
+	}
+	return &d->entries[i][slot % DIR_ENTRIES_PER_BLOCK(block_size)];
+}
+
+/* finds the entry named @name in @d, and sets @pos to its position in the
+   index, or to the empty position where it would go */
+struct file_entry *dir_lookup(struct dir *d, const char *name, uint32_t *pos)
+{
+	uint32_t hash = name_hash(name, strlen(name));
+	uint32_t mask = d->header.index_blocks * DIR_HASHES_PER_BLOCK(block_size) - 1;
+
+	stats.dir_lookups++;
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+	{
+		struct dir_hash *h = dir_hash_at(d, i);
+		if (h == NULL)
+		{
+			return NULL;
+		}
+		*pos = i;
+		if (h->slot == 0)
+		{
+			return NULL;
+		}
+		stats.dir_probes++;
+		if (h->hash == hash)
+		{
+			struct file_entry *entry = dir_entry_at(d, h->slot - 1);
+			if (entry != NULL && strcmp(entry->file_name, name) == 0)
+			{
+				return entry;
+			}
+		}
+	}
+}
+
+/* doubles the index of @d, which is then rebuilt */
+int dir_grow_index(struct dir *d)
+{
+	uint32_t old_blocks = d->header.index_blocks;
+	uint32_t old_size = old_blocks * DIR_HASHES_PER_BLOCK(block_size);
+	struct dir_hash *old = malloc(old_blocks * block_size);
+
+	if (old == NULL)
+	{
+		return -1;
+	}
+	for (uint32_t i = 0; i < old_blocks; i++)
+	{
+		if (dir_hash_at(d, i * DIR_HASHES_PER_BLOCK(block_size)) == NULL)
+		{
+			free(old);
+			return -1;
+		}
+		memcpy(old + i * DIR_HASHES_PER_BLOCK(block_size), d->index[i], block_size);
+	}
+
+	/* allocate the new index blocks before changing anything */
+	uint16_t *added = malloc(old_blocks * sizeof(uint16_t));
+	struct dir_hash **memory = calloc(old_blocks, sizeof(*memory));
+	uint32_t n = 0;
+	if (added != NULL && memory != NULL)
+	{
+		for (; n < old_blocks; n++)
+		{
+			memory[n] = block_alloc(block_size);
+			if (memory[n] == NULL || (added[n] = alloc_block()) == FAT_EOC)
+			{
+				break;
+			}
+		}
+	}
+	d->header.index_blocks *= 2;
+	if (n < old_blocks || dir_resize(d) == -1)
+	{
+		d->header.index_blocks = old_blocks;
+		for (uint32_t i = 0; i < n; i++)
+		{
+			fat.entries[added[i]] = 0;
+			free(memory[i]);
+		}
+		if (memory != NULL && n < old_blocks)
+		{
+			free(memory[n]);
+		}
+		free(added);
+		free(memory);
+		free(old);
+		return -1;
+	}
+
+	/* link them after the old ones: entry blocks move down the chain */
+	uint16_t prev = d->blocks[old_blocks];
+	for (uint32_t i = 0; i < n; i++)
+	{
+		fat.entries[added[i]] = fat.entries[prev];
+		fat.entries[prev] = added[i];
+		TRACE(FS_TRACE_FAT_SET, prev, added[i]);
+		prev = added[i];
+	}
+	memmove(d->blocks + 1 + 2 * old_blocks, d->blocks + 1 + old_blocks,
+			d->header.entry_blocks * sizeof(uint16_t));
+	memcpy(d->blocks + 1 + old_blocks, added, old_blocks * sizeof(uint16_t));
+	memcpy(d->index + old_blocks, memory, old_blocks * sizeof(*memory));
+	d->entry->file_size += old_blocks * block_size;
+	d->header_dirty = true;
+	free(added);
+	free(memory);
+
+	uint32_t mask = 2 * old_size - 1;
+	for (uint32_t i = 0; i < d->header.index_blocks; i++)
+	{
+		memset(d->index[i], 0, block_size);
+		d->index_dirty[i] = true;
+	}
+	for (uint32_t i = 0; i < old_size; i++)
+	{
+		if (old[i].slot == 0)
+		{
+			continue;
+		}
+		uint32_t pos = old[i].hash & mask;
+		while (d->index[pos / DIR_HASHES_PER_BLOCK(block_size)][pos % DIR_HASHES_PER_BLOCK(block_size)].slot != 0)
+		{
+			pos = (pos + 1) & mask;
+		}
+		d->index[pos / DIR_HASHES_PER_BLOCK(block_size)][pos % DIR_HASHES_PER_BLOCK(block_size)] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/* returns a free entry slot of @d, adding a block of entries if needed */
+int64_t dir_new_slot(struct dir *d)
+{
+	if (d->header.free_slot == 0)
+	{
+		uint32_t i = d->header.entry_blocks;
+		struct file_entry *entries = block_alloc(block_size);
+		uint16_t block = entries ? alloc_block() : FAT_EOC;
+		if (block == FAT_EOC)
+		{
+			free(entries);
+			return -1;
+		}
+		d->header.entry_blocks++;
+		if (dir_resize(d) == -1)
+		{
+			d->header.entry_blocks--;
+			fat.entries[block] = 0;
+			free(entries);
+			return -1;
+		}
+
+		uint16_t last = d->blocks[d->header.index_blocks + i];
+		fat.entries[last] = block;
+		TRACE(FS_TRACE_FAT_SET, last, block);
+		d->blocks[1 + d->header.index_blocks + i] = block;
+		d->entries[i] = entries;
+		d->entry->file_size += block_size;
+
+		/* chain the new entries into the free list */
+		for (uint32_t j = 0; j < DIR_ENTRIES_PER_BLOCK(block_size) - 1; j++)
+		{
+			entries[j].file_size = i * DIR_ENTRIES_PER_BLOCK(block_size) + j + 2;
+		}
+		d->header.free_slot = i * DIR_ENTRIES_PER_BLOCK(block_size) + 1;
+		d->header_dirty = true;
+	}
+
+	uint32_t slot = d->header.free_slot - 1;
+	struct file_entry *entry = dir_entry_at(d, slot);
+	if (entry == NULL)
+	{
+		return -1;
+	}
+	d->header.free_slot = entry->file_size;
+	d->header_dirty = true;
+	return slot;
+}
+
+/* adds an entry named @name to @d, or returns NULL if there is no room */
+struct file_entry *dir_add(struct dir *d, const char *name)
+{
+	uint32_t pos;
+
+	if (2 * (d->header.count + 1) > d->header.index_blocks * DIR_HASHES_PER_BLOCK(block_size) &&
+		dir_grow_index(d) == -1)
+	{
+		return NULL;
+	}
+	if (dir_lookup(d, name, &pos) != NULL)
+	{
+		return NULL;
+	}
+	int64_t slot = dir_new_slot(d);
+	if (slot == -1)
+	{
+		return NULL;
+	}
+
+	struct dir_hash *h = dir_hash_at(d, pos);
+	h->hash = name_hash(name, strlen(name));
+	h->slot = slot + 1;
+	d->index_dirty[pos / DIR_HASHES_PER_BLOCK(block_size)] = true;
+	d->header.count++;
+
+	struct file_entry *entry = dir_entry_at(d, slot);
+	memset(entry, 0, sizeof(*entry));
+	strcpy(entry->file_name, name);
+	entry->first_data_block = FAT_EOC;
+	return entry;
+}
+
+/* removes the entry at position @pos of the index of @d */
+void dir_remove(struct dir *d, uint32_t pos)
+{
+	uint32_t mask = d->header.index_blocks * DIR_HASHES_PER_BLOCK(block_size) - 1;
+	struct dir_hash *h = dir_hash_at(d, pos);
+	struct file_entry *entry = dir_entry_at(d, h->slot - 1);
+
+	memset(entry, 0, sizeof(*entry));
+	entry->file_size = d->header.free_slot;
+	d->header.free_slot = h->slot;
+	d->header.count--;
+	d->header_dirty = true;
+
+	/* move back the entries that probed past the one removed */
+	uint32_t hole = pos;
+	for (uint32_t i = (pos + 1) & mask;; i = (i + 1) & mask)
+	{
+		struct dir_hash *next = dir_hash_at(d, i);
+		if (next == NULL || next->slot == 0)
+		{
+			break;
+		}
+		uint32_t home = next->hash & mask;
+		if ((i > hole && (home <= hole || home > i)) || (i < hole && home <= hole && home > i))
+		{
+			*dir_hash_at(d, hole) = *next;
+			d->index_dirty[hole / DIR_HASHES_PER_BLOCK(block_size)] = true;
+			hole = i;
+		}
+	}
+	h = dir_hash_at(d, hole);
+	h->hash = 0;
+	h->slot = 0;
+	d->index_dirty[hole / DIR_HASHES_PER_BLOCK(block_size)] = true;
+}
+
+/* makes @entry an empty directory */
+int dir_create(struct file_entry *entry)
+{
+	uint16_t header = alloc_block();
+	uint16_t index = header != FAT_EOC ? alloc_block() : FAT_EOC;
+	struct dir *d = calloc(1, sizeof(*d));
+	struct dir_hash *hashes = block_alloc(block_size);
+
+	if (index == FAT_EOC || d == NULL || hashes == NULL)
+	{
+		if (header != FAT_EOC)
+		{
+			fat.entries[header] = 0;
+		}
+		if (index != FAT_EOC)
+		{
+			fat.entries[index] = 0;
+		}
+		free(d);
+		free(hashes);
+		return -1;
+	}
+	d->header.magic = DIR_MAGIC;
+	d->header.index_blocks = 1;
+	if (dir_resize(d) == -1)
+	{
+		fat.entries[header] = 0;
+		fat.entries[index] = 0;
+		free(d->blocks);
+		free(d->index);
+		free(d->index_dirty);
+		free(d->entries);
+		free(d);
+		free(hashes);
+		return -1;
+	}
+	fat.entries[header] = index;
+	TRACE(FS_TRACE_FAT_SET, header, index);
+
+	d->header_dirty = true;
+	d->blocks[0] = header;
+	d->blocks[1] = index;
+	d->index[0] = hashes;
+	d->index_dirty[0] = true;
+	d->entry = entry;
+	struct dir **bucket = dir_bucket(entry);
+	d->next = *bucket;
+	*bucket = d;
+
+	entry->first_data_block = header;
+	entry->file_size = 2 * block_size;
+	entry->flags = FS_FILE_DIR;
+	return 0;
+}
+
+/* writes back and forgets all the directories loaded */
+int dir_release_all(void)
+{
+	int ret = 0;
+
+	for (int b = 0; b < DIR_BUCKETS; b++)
+	{
+		while (dirs[b] != NULL)
+		{
+			struct dir *d = dirs[b];
+			if (d->header_dirty)
+			{
+				BLOCK_BUFFER(bounce_buffer);
+				memset(bounce_buffer, 0, block_size);
+				memcpy(bounce_buffer, &d->header, sizeof(d->header));
+				if (write_data_block(d->blocks[0], bounce_buffer) == -1)
+				{
+					ret = -1;
+				}
+			}
+			for (uint32_t i = 0; i < d->header.index_blocks; i++)
+			{
+				if (d->index_dirty[i] && write_data_block(d->blocks[1 + i], d->index[i]) == -1)
+				{
+					ret = -1;
+				}
+			}
+			/* entries are updated in place as their files change */
+			for (uint32_t i = 0; i < d->header.entry_blocks; i++)
+			{
+				if (d->entries[i] != NULL &&
+					write_data_block(d->blocks[1 + d->header.index_blocks + i], d->entries[i]) == -1)
+				{
+					ret = -1;
+				}
+			}
+			dir_free(d);
+		}
+	}
+	return ret;
+}
+
+/* finds entry @name of directory @d, or of the root directory if NULL, and
+   sets @pos to its position in the index or in the root directory */
+struct file_entry *dir_find(struct dir *d, const char *name, uint32_t *pos)
+{
+	if (d != NULL)
+	{
+		return dir_lookup(d, name, pos);
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (strncmp(root.entries[i].file_name, name, FS_FILENAME_LEN) == 0)
+		{
+			*pos = i;
+			return &root.entries[i];
+		}
+	}
+	return NULL;
+}
+
+/* sets @parent to the directory holding @path, NULL for the root directory,
+   and @name to the last component of @path */
+int path_parent(const char *path, struct dir **parent, const char **name)
+{
+	if (path == NULL)
+	{
+		return -1;
+	}
+	if (path[0] == '/')
+	{
+		path++;
+	}
+
+	size_t len = strlen(path);
+	const char *last = strrchr(path, '/');
+	*parent = NULL;
+	*name = last ? last + 1 : path;
+	if (len == 0 || len >= FS_PATH_MAX || **name == '\0')
+	{
+		return -1;
+	}
+	if (last == NULL)
+	{
+		return strlen(path) > FS_FILENAME_LEN ? -1 : 0;
+	}
+	if (strlen(*name) >= FS_FILENAME_LEN)
+	{
+		return -1;
+	}
+
+	size_t dir_len = last - path;
+	uint32_t hash = name_hash(path, dir_len);
+	struct path_cache_entry *cached = &path_cache[hash % PATH_CACHE_SIZE];
+	if (cached->dir != NULL && cached->hash == hash &&
+		strncmp(cached->path, path, dir_len) == 0 && cached->path[dir_len] == '\0')
+	{
+		stats.path_hits++;
+		*parent = cached->dir;
+		return 0;
+	}
+	stats.path_misses++;
+
+	/* walk the path from the root directory */
+	struct dir *d = NULL;
+	const char *component = path;
+	while (component <= last)
+	{
+		const char *end = strchr(component, '/');
+		char dir_name[FS_FILENAME_LEN];
+		uint32_t pos;
+
+		if (end == component || end - component >= FS_FILENAME_LEN)
+		{
+			return -1;
+		}
+		memcpy(dir_name, component, end - component);
+		dir_name[end - component] = '\0';
+
+		struct file_entry *entry = dir_find(d, dir_name, &pos);
+		if (entry == NULL || !(entry->flags & FS_FILE_DIR) || (d = dir_get(entry)) == NULL)
+		{
+			return -1;
+		}
+		component = end + 1;
+	}
+
+	cached->dir = d;
+	cached->hash = hash;
+	memcpy(cached->path, path, dir_len);
+	cached->path[dir_len] = '\0';
+	*parent = d;
+	return 0;
+}
+
+/* finds the entry of @path, setting @parent and @pos for dir_find() */
+struct file_entry *path_find(const char *path, struct dir **parent, uint32_t *pos)
+{
+	const char *name;
+
+	if (path_parent(path, parent, &name) == -1)
+	{
+		return NULL;
+	}
+	return dir_find(*parent, name, pos);
+}
+
+/* adds an entry for @path to its directory, or returns NULL if it exists or
+   there is no room for it */
+struct file_entry *path_create(const char *path, struct dir **parent)
+{
+	const char *name;
+	uint32_t pos;
+
+	if (path_parent(path, parent, &name) == -1 || dir_find(*parent, name, &pos) != NULL)
+	{
+		return NULL;
+	}
+	if (*parent != NULL)
+	{
+		return dir_add(*parent, name);
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (root.entries[i].file_name[0] == '\0')
+		{
+			memset(&root.entries[i], 0, sizeof(struct file_entry));
+			strncpy(root.entries[i].file_name, name, FS_FILENAME_LEN);
+			root.entries[i].first_data_block = FAT_EOC;
+			return &root.entries[i];
+		}
+	}
+	return NULL;
+}
+
+/* returns the entry of snapshot @name, or NULL if there is none */
+struct snap_entry *snap_find(const char *name)
+{
+	for (int i = 0; i < SNAP_MAX; i++)
+	{
+		if (snaps[i].name[0] != '\0' && strncmp(snaps[i].name, name, FS_FILENAME_LEN) == 0)
+		{
+			return &snaps[i];
+		}
+	}
+	return NULL;
+}
+
+/* reads the FAT and root directory copied by snapshot @snap */
+int snap_read(struct snap_entry *snap, uint16_t *fat_copy, struct rootdir *root_copy)
+{
+	if (snap->count != sb.num_FAT_blocks + meta_blocks(sizeof(root)) ||
+		snap->block + snap->count > sb.num_data_blocks)
+	{
+		return -1;
+	}
+
+	char *copy = block_alloc(snap->count * block_size);
+	if (copy == NULL || block_read_range(sb.data_block + snap->block, snap->count, copy) == -1)
+	{
+		free(copy);
+		return -1;
+	}
+	stats.meta_reads += snap->count;
+	for (int i = 0; i < snap->count; i++)
+	{
+		if (csum_verify(snap->block + i, copy + i * block_size) == -1)
+		{
+			free(copy);
+			return -1;
+		}
+	}
+
+	memcpy(fat_copy, copy, sb.num_FAT_blocks * block_size);
+	memcpy(root_copy, copy + sb.num_FAT_blocks * block_size, sizeof(root));
+	free(copy);
+	return 0;
+}
+
+int fs_format(const char *diskname, const struct fs_format_opts *opts)
+{
+	AIO_SCOPE();
+	if (mounted || opts == NULL)
+	{
+		return -1;
+	}
+
+	size_t size = opts->block_size ? opts->block_size : BLOCK_SIZE;
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX || (size & (size - 1)))
+	{
+		return -1;
+	}
+	block_size = size;
+	block_shift = __builtin_ctz(size);
+	block_mask = size - 1;
+
+	/* the superblock, then the FAT, the root directory and the data blocks;
+	   the data blocks fitting in @size are those left by the metadata */
+	uint32_t meta = meta_blocks(sizeof(sb)) + meta_blocks(sizeof(root));
+	uint64_t data = opts->data_blocks;
+	if (data == 0)
+	{
+		uint64_t total = opts->size >> block_shift;
+		data = total > meta ? total - meta : 0;
+		while (data && meta + meta_blocks(data * sizeof(uint16_t)) + data > total)
+		{
+			data--;
+		}
+	}
+	uint32_t fat_blocks = meta_blocks(data * sizeof(uint16_t));
+	if (data == 0 || meta + fat_blocks + data > UINT16_MAX)
+	{
+		return -1;
+	}
+
+	struct superblock new_sb;
+	memset(&new_sb, 0, sizeof(new_sb));
+	memcpy(new_sb.signature, "ECS150FS", 8);
+	new_sb.num_data_blocks = data;
+	new_sb.num_FAT_blocks = fat_blocks;
+	new_sb.root_dir = meta_blocks(sizeof(sb)) + fat_blocks;
+	new_sb.data_block = new_sb.root_dir + meta_blocks(sizeof(root));
+	new_sb.total_blocks = new_sb.data_block + data;
+	new_sb.block_shift = size == BLOCK_SIZE ? 0 : block_shift;
+
+	int flags = (opts->flags & FS_FORMAT_PREALLOC) ? BLOCK_DISK_PREALLOC : 0;
+	if (block_disk_create(diskname, size, new_sb.total_blocks, flags) == -1)
+	{
+		return -1;
+	}
+
+	/* the rest of the image is a hole, read as zeros: free FAT entries and
+	   empty root directory entries */
+	struct rootdir empty;
+	uint16_t *fat_entries = block_alloc(fat_blocks * size);
+	memset(&empty, 0, sizeof(empty));
+	int ret = fat_entries == NULL ? -1 : 0;
+	if (ret == 0)
+	{
+		fat_entries[0] = FAT_EOC;
+		ret = meta_io(0, &new_sb, sizeof(new_sb), true);
+	}
+	for (uint32_t i = 0; ret == 0 && i < fat_blocks; i++)
+	{
+		ret = block_write(meta_blocks(sizeof(sb)) + i, (char *)fat_entries + i * size);
+	}
+	if (ret == 0)
+	{
+		ret = meta_io(new_sb.root_dir, &empty, sizeof(empty), true);
+	}
+	free(fat_entries);
+	block_disk_close();
+	if (ret == -1 || !(opts->flags & (FS_FORMAT_CSUM | FS_FORMAT_INLINE | FS_FORMAT_DEDUP | FS_FORMAT_EXTENT)))
+	{
+		return ret;
+	}
+
+	/* reserve the areas of the features asked for, the checksum area first
+	   as it must take the last data blocks */
+	if (fs_mount(diskname) == -1)
+	{
+		return -1;
+	}
+	if (((opts->flags & FS_FORMAT_CSUM) && fs_csum_enable() == -1) ||
+		((opts->flags & FS_FORMAT_INLINE) && fs_inline_enable() == -1) ||
+		((opts->flags & FS_FORMAT_DEDUP) && fs_dedup_enable() == -1) ||
+		((opts->flags & FS_FORMAT_EXTENT) && fs_extent_enable() == -1))
+	{
+		ret = -1;
+	}
+	if (fs_umount() == -1)
+	{
+		return -1;
+	}
+	return ret;
+}
+
+void fs_direct_enable(int enable)
+{
+	direct_io = enable;
+}
+
+int fs_mount(const char *diskname)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_MOUNT);
+	TRACE_SCOPE(FS_TRACE_MOUNT, -1, 0);
+
+	/* a snapshot is mounted as <diskname>@<snapshot> */
+	const char *snapshot = strrchr(diskname, '@');
+	char *image = NULL;
+	if (snapshot != NULL && strpbrk(snapshot, "/,") == NULL)
+	{
+		image = strndup(diskname, snapshot - diskname);
+		if (image == NULL)
+		{
+			return -1;
+		}
+		diskname = image;
+		snapshot++;
+	}
+	else
+	{
+		snapshot = NULL;
+	}
+
+	/* open the virtual disk, using the block API */
+	int opened = block_disk_open(diskname);
+	free(image);
+	if (opened == -1)
+	{
+		return -1;
+	}
+
+	/* load the meta-information, which is in the first BLOCK_SIZE bytes
+	   whatever the block size */
+	if (block_read(0, &sb) == -1)
+	{
+		return -1;
+	}
+
+	/* validate signature of the superblock is ECS150FS */
+	if (strncmp(sb.signature, "ECS150FS", 8) != 0)
+	{
+		return -1;
+	}
+
+	/* switch to the block size of the file system */
+	block_shift = sb.block_shift ? sb.block_shift : 12;
+	if (block_shift > 16 || block_disk_set_size((size_t)1 << block_shift) == -1)
+	{
+		block_disk_close();
+		return -1;
+	}
+	block_size = 1u << block_shift;
+	block_mask = block_size - 1;
+
+	/* bypass the host page cache if asked to, where the host allows it */
+	if (direct_io)
+	{
+		block_disk_set_direct(1);
+	}
+
+	/* initialize FAT */
+	if (block_disk_count() != sb.total_blocks || sb.root_dir <= sb.num_FAT_blocks ||
+		sb.data_block != sb.root_dir + meta_blocks(sizeof(root)))
+	{
+		block_disk_close();
+		return -1;
+	}
+	
+	fat.num_entries = sb.num_data_blocks;
+	fat.entries = block_alloc(sb.num_FAT_blocks * block_size);
+
+	/* load FAT blocks */
+	uint16_t *block = block_alloc(block_size); // block index of first FAT block
+
+	for (int i = 1; i <= sb.num_FAT_blocks; i++)
+	{
+		// index 0 of fat is EOC
+		if (block_read(fat_block(i), block) == -1)
+		{
+			return -1;
+		}
+		// copy block into fat entries array
+		memcpy(fat.entries + ((i-1) * block_size / sizeof(uint16_t)), block, block_size);
+	}
+	free(block);
+	fat.entries[0] = FAT_EOC;
+
+	/* load root directory */
+	if (meta_io(sb.root_dir, &root, sizeof(root), false) == -1)
+	{
+		return -1;
+	}
+	stats.meta_reads += 1 + sb.num_FAT_blocks + 1;
+
+	/* load checksums */
+	if (sb.features & FS_FEAT_CSUM)
+	{
+		if (sb.csum_count == 0 || sb.csum_block + sb.csum_count > sb.num_data_blocks)
+		{
+			block_disk_close();
+			return -1;
+		}
+		csums = block_alloc(sb.csum_count * block_size);
+		if (csums == NULL ||
+			block_read_range(sb.data_block + sb.csum_block, sb.csum_count, csums) == -1)
+		{
+			free_features();
+			block_disk_close();
+			return -1;
+		}
+		stats.meta_reads += sb.csum_count;
+	}
+
+	/* load the inline area, and find which slots are in use */
+	if (sb.features & FS_FEAT_INLINE)
+	{
+		uint32_t slots = sb.inline_count * block_size / INLINE_SLOT;
+		if (sb.inline_count == 0 || sb.inline_block + sb.inline_count > sb.num_data_blocks)
+		{
+			free_features();
+			block_disk_close();
+			return -1;
+		}
+		inline_area = block_alloc(sb.inline_count * block_size);
+		inline_used = calloc((slots + 63) / 64, sizeof(uint64_t));
+		inline_dirty = calloc(sb.inline_count, sizeof(bool));
+		if (inline_area == NULL || inline_used == NULL || inline_dirty == NULL ||
+			block_read_range(sb.data_block + sb.inline_block, sb.inline_count, inline_area) == -1)
+		{
+			free_features();
+			block_disk_close();
+			return -1;
+		}
+		stats.meta_reads += sb.inline_count;
+		for (int i = 0; i < sb.inline_count; i++)
+		{
+			csum_verify(sb.inline_block + i, inline_area + i * block_size);
+		}
+
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		{
+			struct file_entry *file = &root.entries[i];
+			uint32_t count = inline_slots(file->file_size);
+			if (file->file_name[0] != '\0' && (file->flags & FS_FILE_INLINE) && count &&
+				file->first_data_block + count <= slots)
+			{
+				inline_mark(file->first_data_block, count, true);
+			}
+		}
+	}
+
+	/* load the reference table, and hash the data blocks in use */
+	if (sb.features & FS_FEAT_DEDUP)
+	{
+		if (sb.dedup_count == 0 || sb.dedup_block + sb.dedup_count > sb.num_data_blocks ||
+			dedup_alloc() == -1 ||
+			block_read_range(sb.data_block + sb.dedup_block, sb.dedup_count, dedup_refs) == -1)
+		{
+			free_features();
+			block_disk_close();
+			return -1;
+		}
+		stats.meta_reads += sb.dedup_count;
+		for (int i = 0; i < sb.dedup_count; i++)
+		{
+			csum_verify(sb.dedup_block + i, (char *)dedup_refs + i * block_size);
+		}
+
+		for (int i = 1; i < sb.num_data_blocks; i++)
+		{
+			if (dedup_refs[i].refs != 0)
+			{
+				dedup_insert(i);
+			}
+		}
+	}
+
+	/* load the snapshot table */
+	if (sb.features & FS_FEAT_SNAP)
+	{
+		if (sb.snap_count * block_size < block_size + sb.num_data_blocks ||
+			sb.snap_block + sb.snap_count > sb.num_data_blocks ||
+			(snaps = block_alloc(sb.snap_count * block_size)) == NULL ||
+			block_read_range(sb.data_block + sb.snap_block, sb.snap_count, snaps) == -1)
+		{
+			free_features();
+			block_disk_close();
+			return -1;
+		}
+		snap_refs = (uint8_t *)snaps + block_size;
+		stats.meta_reads += sb.snap_count;
+		for (int i = 0; i < sb.snap_count; i++)
+		{
+			csum_verify(sb.snap_block + i, (char *)snaps + i * block_size);
+		}
+	}
+
+	/* switch to the FAT and root directory of the snapshot */
+	if (snapshot != NULL)
+	{
+		struct snap_entry *snap;
+		if (snaps == NULL || (snap = snap_find(snapshot)) == NULL ||
+			snap_read(snap, fat.entries, &root) == -1)
+		{
+			free(fat.entries);
+			free_features();
+			block_disk_close();
+			return -1;
+		}
+		read_only = 1;
+	}
+
+	discard_count = 0;
+	discard_off = false;
+	mounted = 1;
+	return 0;
+}
+
+int fs_umount(void)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_UMOUNT);
+	TRACE_SCOPE(FS_TRACE_UMOUNT, -1, 0);
+
+	if (!mounted) {
+		return -1;
+	}
+
+	/* the reclaimer is stopped before anything is torn down, as other calls
+	   may run while it is waited for */
+	reclaim_stop();
+
+	/* descriptors left open are closed, and compressed, deduplicated and
+	   sparse files and extents written back */
+	for (uint32_t i = 0; open_buckets != NULL && i <= open_mask; i++)
+	{
+		while (open_buckets[i] != NULL)
+		{
+			struct open_file *of = open_buckets[i];
+			of->refs = 0;
+			if (of->zf != NULL)
+			{
+				zfile_release(of->file);
+			}
+			else if (of->xf != NULL)
+			{
+				ifile_release(of->file);
+			}
+			else if (of->ext != NULL)
+			{
+				extent_release(of);
+			}
+			else
+			{
+				of_put(of);
+			}
+		}
+	}
+	free(open_buckets);
+	free(fd_table);
+	open_buckets = NULL;
+	fd_table = NULL;
+	fd_count = 0;
+	fd_free = -1;
+
+	/* the FAT is written with the chains of deleted files freed */
+	reclaim_blocks(UINT32_MAX);
+	free(reclaim_chains);
+	reclaim_chains = NULL;
+	reclaim_size = 0;
+
+	/* a snapshot cannot have been modified */
+	if (read_only)
+	{
+		free(fat.entries);
+		free_features();
+		if (block_disk_close() == -1)
+		{
+			return -1;
+		}
+		read_only = 0;
+		mounted = 0;
+		return 0;
+	}
+
+	if (dir_release_all() == -1)
+	{
+		return -1;
+	}
+
+	if (block_write_range(fat_block(1), sb.num_FAT_blocks, fat.entries) == -1)
+	{
+		return -1;
+	}
+
+	if (meta_io(sb.root_dir, &root, sizeof(root), true) == -1)
+	{
+		return -1;
+	}
+	stats.meta_writes += sb.num_FAT_blocks + 1;
+
+	if (sb.features & FS_FEAT_INLINE)
+	{
+		for (int i = 0; i < sb.inline_count; i++)
+		{
+			if (inline_dirty[i])
+			{
+				if (write_data_block(sb.inline_block + i, inline_area + i * block_size) == -1)
+				{
+					return -1;
+				}
+				stats.meta_writes++;
+			}
+		}
+	}
+
+	if (sb.features & FS_FEAT_DEDUP)
+	{
+		for (int i = 0; i < sb.dedup_count; i++)
+		{
+			if (dedup_dirty[i])
+			{
+				if (write_data_block(sb.dedup_block + i, (char *)dedup_refs + i * block_size) == -1)
+				{
+					return -1;
+				}
+				stats.meta_writes++;
+			}
+		}
+	}
+
+	if ((sb.features & FS_FEAT_SNAP) && snap_dirty)
+	{
+		if (write_data_range(sb.snap_block, sb.snap_count, snaps) == -1)
+		{
+			return -1;
+		}
+		stats.meta_writes += sb.snap_count;
+		snap_dirty = false;
+	}
+
+	if (sb.features & FS_FEAT_CSUM)
+	{
+		if (block_write_range(sb.data_block + sb.csum_block, sb.csum_count, csums) == -1)
+		{
+			return -1;
+		}
+		stats.meta_writes += sb.csum_count;
+	}
+	free_features();
+
+	if (sb_dirty)
+	{
+		if (meta_io(0, &sb, sizeof(sb), true) == -1)
+		{
+			return -1;
+		}
+		stats.meta_writes++;
+		sb_dirty = 0;
+	}
+
+	/* freed blocks go once nothing written refers to them */
+	discard_flush();
+	free(fat.entries);
+
+	if (block_disk_close() == -1)
+	{
+		return -1;
+	}
+	mounted = 0;
+
+	return 0;
+}
+
+int fs_info(void)
+{
+	AIO_SCOPE();
+	if (!mounted)
+	{
+		return -1;
+	}
+
+	uint16_t fat_free = fat_count_free(fat.entries, 1, sb.num_data_blocks);
+	uint16_t rdir_free = 0;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (root.entries[i].file_name[0] == '\0')
+		{
+			rdir_free++;
+		}
+	}
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n", sb.total_blocks);
+	printf("fat_blk_count=%u\n", sb.num_FAT_blocks);
+	printf("rdir_blk=%u\n", sb.root_dir);
+	printf("data_blk=%u\n", sb.data_block);
+	printf("data_blk_count=%u\n", sb.num_data_blocks);
+	printf("fat_free_ratio=%u/%u\n", fat_free, sb.num_data_blocks);
+	printf("rdir_free_ratio=%u/%u\n", rdir_free, FS_FILE_MAX_COUNT);
+	if (block_size != BLOCK_SIZE)
+	{
+		printf("blk_size=%u\n", block_size);
+	}
+	if (block_disk_direct())
+	{
+		printf("direct_io=1\n");
+	}
+	if (sb.features & FS_FEAT_CSUM)
+	{
+		printf("csum_blk=%u\n", sb.data_block + sb.csum_block);
+		printf("csum_blk_count=%u\n", sb.csum_count);
+	}
+	if (sb.features & FS_FEAT_INLINE)
+	{
+		printf("inline_blk=%u\n", sb.data_block + sb.inline_block);
+		printf("inline_blk_count=%u\n", sb.inline_count);
+	}
+	if (sb.features & FS_FEAT_DEDUP)
+	{
+		printf("dedup_blk=%u\n", sb.data_block + sb.dedup_block);
+		printf("dedup_blk_count=%u\n", sb.dedup_count);
+	}
+	if (sb.features & FS_FEAT_SNAP)
+	{
+		printf("snap_blk=%u\n", sb.data_block + sb.snap_block);
+		printf("snap_blk_count=%u\n", sb.snap_count);
+	}
+	if (read_only)
+	{
+		printf("read_only=1\n");
+	}
+
+	if (stats_show)
+	{
+		struct fs_stats cur;
+
+		fs_stats(&cur);
+		printf("FS Stats:\n");
+		printf("block_reads=%" PRIu64 "\n", cur.block_reads);
+		printf("block_writes=%" PRIu64 "\n", cur.block_writes);
+		printf("block_errors=%" PRIu64 "\n", cur.block_errors);
+		printf("block_bounced=%" PRIu64 "\n", cur.block_bounced);
+		printf("block_failovers=%" PRIu64 "\n", cur.block_failovers);
+		printf("block_discarded=%" PRIu64 "\n", cur.block_discarded);
+		printf("meta_reads=%" PRIu64 "\n", cur.meta_reads);
+		printf("meta_writes=%" PRIu64 "\n", cur.meta_writes);
+		printf("fat_hops=%" PRIu64 "\n", cur.fat_hops);
+		printf("alloc_calls=%" PRIu64 "\n", cur.alloc_calls);
+		printf("alloc_scan_steps=%" PRIu64 "\n", cur.alloc_scan_steps);
+		printf("rmw_reads=%" PRIu64 "\n", cur.rmw_reads);
+		printf("bounce_bytes=%" PRIu64 "\n", cur.bounce_bytes);
+		printf("bytes_read=%" PRIu64 "\n", cur.bytes_read);
+		printf("bytes_written=%" PRIu64 "\n", cur.bytes_written);
+		printf("csum_verified=%" PRIu64 "\n", cur.csum_verified);
+		printf("csum_errors=%" PRIu64 "\n", cur.csum_errors);
+		printf("compress_in=%" PRIu64 "\n", cur.compress_in);
+		printf("compress_out=%" PRIu64 "\n", cur.compress_out);
+		printf("inline_reads=%" PRIu64 "\n", cur.inline_reads);
+		printf("dedup_hits=%" PRIu64 "\n", cur.dedup_hits);
+		printf("dedup_cow=%" PRIu64 "\n", cur.dedup_cow);
+		printf("snap_cow=%" PRIu64 "\n", cur.snap_cow);
+		printf("extent_reads=%" PRIu64 "\n", cur.extent_reads);
+		printf("dir_lookups=%" PRIu64 "\n", cur.dir_lookups);
+		printf("dir_probes=%" PRIu64 "\n", cur.dir_probes);
+		printf("path_hits=%" PRIu64 "\n", cur.path_hits);
+		printf("path_misses=%" PRIu64 "\n", cur.path_misses);
+		printf("reclaimed=%" PRIu64 "\n", cur.reclaimed);
+	}
+
+	return 0;
+}
+
+int fs_create(const char *filename)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_CREATE);
+	TRACE_SCOPE(FS_TRACE_CREATE, -1, 0);
+
+	struct dir *parent;
+	struct file_entry *file;
+
+	if (!mounted || read_only || (file = path_create(filename, &parent)) == NULL)
+	{
+		return -1;
+	}
+
+	/* the inline area only has room for files of the root directory */
+	if ((sb.features & FS_FEAT_INLINE) && parent == NULL)
+	{
+		file->flags = FS_FILE_INLINE;
+	}
+	else if (sb.features & FS_FEAT_DEDUP)
+	{
+		file->flags = FS_FILE_DEDUP;
+	}
+	else if (sb.features & FS_FEAT_EXTENT)
+	{
+		file->flags = FS_FILE_EXTENT;
+	}
+	return 0;
+}
+
+int fs_delete(const char *filename)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_DELETE);
+	TRACE_SCOPE(FS_TRACE_DELETE, -1, 0);
+
+	struct dir *parent;
+	struct file_entry *file;
+	uint32_t pos;
+
+	if (!mounted || read_only || (file = path_find(filename, &parent, &pos)) == NULL)
+	{
+		return -1;
+	}
+
+	struct open_file *of = of_get(file, false);
+	if (of != NULL && of->refs != 0)
+	{
+		return -1; // file is open
+	}
+
+	/* only empty directories can be deleted */
+	if (file->flags & FS_FILE_DIR)
+	{
+		struct dir *d = dir_get(file);
+		if (d == NULL || d->header.count != 0)
+		{
+			return -1;
+		}
+		dir_free(d);
+	}
+
+	/* release the shared blocks, which needs the index */
+	if ((file->flags & FS_FILE_DEDUP) && ifile_drop(file) == -1)
+	{
+		return -1;
+	}
+	if (file->flags & FS_FILE_EXTENT)
+	{
+		extent_drop(file);
+	}
+
+	uint16_t cur_block = file->first_data_block;
+	if (file->flags & FS_FILE_INLINE)
+	{
+		if (file->file_size)
+		{
+			inline_mark(cur_block, inline_slots(file->file_size), false);
+		}
+		cur_block = FAT_EOC;
+	}
+
+	/* the chain of a large file is left to the background reclaimer */
+	bool defer = cur_block != FAT_EOC && file->file_size > RECLAIM_BATCH * block_size;
+	if (!defer)
+	{
+		chain_free(cur_block);
+	}
+	memset(file, 0, sizeof(struct file_entry));
+	if (parent != NULL)
+	{
+		dir_remove(parent, pos);
+	}
+	if (defer)
+	{
+		reclaim_defer(cur_block);
+	}
+	return 0;
+}
+
+/* prints entry @file of a directory listing */
+void ls_entry(struct file_entry *file)
+{
+	if (file->flags & FS_FILE_DIR)
+	{
+		printf("dir: %s, ", file->file_name);
+	}
+	else
+	{
+		printf("file: %s, ", file->file_name);
+	}
+	printf("size: %d, ", file->file_size);
+	printf("data_blk: %d\n", file->first_data_block);
+}
+
+int fs_ls(void)
+{
+	AIO_SCOPE();
+	if (!mounted)
+	{
+		return -1;
+	}
+	printf("FS Ls:\n");
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (root.entries[i].file_name[0] != '\0')
+		{
+			/* Format info */
+			ls_entry(&root.entries[i]);
+		}
+	}
+
+	return 0;
+}
+
+int fs_lsdir(const char *path)
+{
+	AIO_SCOPE();
+	struct dir *parent, *d;
+	struct file_entry *dir;
+	uint32_t pos;
+
+	if (path != NULL && (strcmp(path, "") == 0 || strcmp(path, "/") == 0))
+	{
+		return fs_ls();
+	}
+	if (!mounted || (dir = path_find(path, &parent, &pos)) == NULL ||
+		!(dir->flags & FS_FILE_DIR) || (d = dir_get(dir)) == NULL)
+	{
+		return -1;
+	}
+
+	printf("FS Ls:\n");
+	for (uint32_t slot = 0; slot < d->header.entry_blocks * DIR_ENTRIES_PER_BLOCK(block_size); slot++)
+	{
+		struct file_entry *file = dir_entry_at(d, slot);
+		if (file == NULL)
+		{
+			return -1;
+		}
+		if (file->file_name[0] != '\0')
+		{
+			ls_entry(file);
+		}
+	}
+
+	return 0;
+}
+
+int fs_readdir(int *pos, char *filename)
+{
+	AIO_SCOPE();
+	if (!mounted || pos == NULL || filename == NULL || *pos < 0)
+	{
+		return -1;
+	}
+
+	/* resume after the entry returned last time */
+	for (int i = *pos; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (root.entries[i].file_name[0] != '\0')
+		{
+			memcpy(filename, root.entries[i].file_name, FS_FILENAME_LEN);
+			*pos = i + 1;
+			return 0;
+		}
+	}
+
+	*pos = FS_FILE_MAX_COUNT;
+	return -1;
+}
+
+int fs_open(const char *filename)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_OPEN);
+	TRACE_SCOPE(FS_TRACE_OPEN, -1, 0);
+
+	struct dir *parent;
+	struct file_entry *file;
+	uint32_t pos;
+
+	if (!mounted || (file = path_find(filename, &parent, &pos)) == NULL ||
+		(file->flags & FS_FILE_DIR))
+	{
+		return -1;
+	}
+
+	/* the state of the file is shared with its other descriptors */
+	struct open_file *of = of_get(file, true);
+	if (of == NULL)
+	{
+		return -1;
+	}
+	if ((file->flags & FS_FILE_COMPRESSED) && of->zf == NULL && zfile_load(file) == NULL)
+	{
+		of_put(of);
+		return -1;
+	}
+	if ((file->flags & (FS_FILE_DEDUP | FS_FILE_SPARSE)) && of->xf == NULL && ifile_load(file) == NULL)
+	{
+		of_put(of);
+		return -1;
+	}
+	if ((file->flags & FS_FILE_EXTENT) && of->ext == NULL && extent_load(file) == NULL)
+	{
+		of_put(of);
+		return -1;
+	}
+
+	int fd = fd_alloc();
+	if (fd == -1)
+	{
+		of_put(of);
+		return -1;
+	}
+	of->refs++;
+	fd_table[fd].of = of;
+	fd_table[fd].offset = 0;
+	return fd;
+}
+
+int fs_close(int fd)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_CLOSE);
+	TRACE_SCOPE(FS_TRACE_CLOSE, fd, 0);
+
+	if (!mounted || !fd_valid(fd))
+	{
+		return -1;
+	}
+
+	struct open_file *of = fd_table[fd].of;
+	fd_release(fd);
+	if (--of->refs != 0)
+	{
+		return 0;
+	}
+
+	/* give back reserved blocks once the last descriptor is closed */
+	if (of->reserved)
+	{
+		trim_chain(of->file);
+		of->reserved = false;
+	}
+
+	/* write back a compressed, deduplicated or sparse file, or the extents
+	   of a file, once the last descriptor is closed, which also frees its
+	   state */
+	if (of->zf != NULL)
+	{
+		return zfile_release(of->file);
+	}
+	if (of->xf != NULL)
+	{
+		return ifile_release(of->file);
+	}
+	if (of->ext != NULL)
+	{
+		return extent_release(of);
+	}
+	of_put(of);
+	return 0;
+}
+
+int fs_stat(int fd)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_STAT);
+
+	if (!mounted || !fd_valid(fd))
+	{
+		return -1;
+	}
+	return fd_table[fd].of->file->file_size;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_LSEEK);
+	TRACE_SCOPE(FS_TRACE_LSEEK, fd, offset);
+
+	// Not mounted or invalid fd
+	if (!mounted || !fd_valid(fd))
+	{
+		return -1;
+	}
+
+	// Offset past the largest file size; writing past the end of file
+	// leaves a hole
+	if (offset > UINT32_MAX)
+	{
+		return -1;
+	}
+
+	fd_table[fd].offset = offset;
+
+	return 0;
+}
+
+int fs_reserve(int fd, size_t size)
+{
+	AIO_SCOPE();
+	if (!mounted || read_only || !fd_valid(fd))
+	{
+		return -1;
+	}
+
+	struct file_entry *file = fd_table[fd].of->file;
+	if (file->flags & (FS_FILE_COMPRESSED | FS_FILE_DEDUP | FS_FILE_SPARSE))
+	{
+		return -1; // size on disk depends on the data
+	}
+	if (file->flags & FS_FILE_INLINE)
+	{
+		if (size <= INLINE_MAX)
+		{
+			return 0;
+		}
+		if (inline_spill(fd) == -1)
+		{
+			return -1;
+		}
+	}
+
+	struct open_file *of = fd_table[fd].of;
+	uint32_t need = (size + block_mask) >> block_shift;
+	uint32_t have = 0;
+	uint16_t last = FAT_EOC;
+
+	if (of->ext != NULL)
+	{
+		have = of->ext_count ? of->ext[of->ext_count - 1].end : 0;
+		last = extent_last(of);
+	}
+	else
+	{
+		for (uint16_t b = file->first_data_block; b != FAT_EOC; b = fat.entries[b])
+		{
+			last = b;
+			have++;
+			stats.fat_hops++;
+		}
+	}
+
+	/* take the first free blocks in a single pass over the FAT, which is
+	   what allocating them one at a time with first fit would give, unless
+	   the last extent of the file can grow */
+	int next = 1;
+	while (have < need)
+	{
+		uint16_t block = extent_next(of, last);
+		if (block == FAT_EOC)
+		{
+			uint16_t found = fat_find_free(fat.entries, next, sb.num_data_blocks);
+			stats.alloc_scan_steps += found - next;
+			next = found;
+			if (next >= sb.num_data_blocks && reclaim_blocks(UINT32_MAX))
+			{
+				next = 1; // blocks were waiting for the reclaimer
+				continue;
+			}
+			if (next >= sb.num_data_blocks)
+			{
+				return -1; // disk is full
+			}
+			block = next;
+		}
+
+		stats.alloc_calls++;
+		fat.entries[block] = FAT_EOC;
+		TRACE(FS_TRACE_ALLOC, block, block);
+		if (last == FAT_EOC)
+		{
+			file->first_data_block = block;
+		}
+		else
+		{
+			fat.entries[last] = block;
+			TRACE(FS_TRACE_FAT_SET, last, block);
+		}
+		if (of->ext != NULL && extent_append(of, block) == -1)
+		{
+			extent_drop(file);
+		}
+		last = block;
+		have++;
+		of->reserved = true;
+	}
+
+	return 0;
+}
+
+/* moves data block @block of @file, used by snapshots, to a free block before
+   it is modified, and returns the new block or FAT_EOC if the disk is full;
+   @prev is the block before it in the chain, or FAT_EOC if not known */
+uint16_t snap_cow(struct file_entry *file, uint16_t prev, uint16_t block)
+{
+	uint16_t copy = alloc_block();
+	if (copy == FAT_EOC)
+	{
+		return FAT_EOC;
+	}
+
+	if (prev == FAT_EOC && file->first_data_block != block)
+	{
+		prev = file->first_data_block;
+		while (fat.entries[prev] != block)
+		{
+			prev = fat.entries[prev];
+			stats.fat_hops++;
+		}
+	}
+	if (prev == FAT_EOC)
+	{
+		file->first_data_block = copy;
+	}
+	else
+	{
+		fat.entries[prev] = copy;
+		TRACE(FS_TRACE_FAT_SET, prev, copy);
+	}
+	fat.entries[copy] = fat.entries[block];
+	TRACE(FS_TRACE_FAT_SET, copy, fat.entries[copy]);
+	free_block(block);
+
+	stats.snap_cow++;
+	return copy;
+}
+
+/* writes zeros from the end of the file of @fd up to its offset */
+int zero_fill(int fd)
+{
+	BLOCK_BUFFER(zeros);
+	uint32_t offset = fd_table[fd].offset;
+	int ret = 0;
+
+	memset(zeros, 0, block_size);
+	fd_table[fd].offset = fd_table[fd].of->file->file_size;
+	while (ret == 0 && fd_table[fd].offset < offset)
+	{
+		uint32_t len = offset - fd_table[fd].offset;
+		if (len > block_size)
+		{
+			len = block_size;
+		}
+		if (write_blocks(fd, zeros, len) != (int)len)
+		{
+			ret = -1; // disk is full
+		}
+	}
+	fd_table[fd].offset = offset;
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_WRITE);
+	TRACE_SCOPE(FS_TRACE_WRITE, fd, count);
+
+	/* Check if file system is mounted */
+	if (!mounted || read_only || !fd_valid(fd))
+	{
+		return -1;
+	}
+
+	struct file_entry *file = fd_table[fd].of->file;
+
+	if (count > UINT32_MAX - fd_table[fd].offset)
+	{
+		count = UINT32_MAX - fd_table[fd].offset;
+	}
+
+	/* nothing to write: the file keeps its size even past its end */
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	if (file->flags & FS_FILE_COMPRESSED)
+	{
+		return zfile_write(fd, buf, count);
+	}
+
+	if (file->flags & FS_FILE_INLINE)
+	{
+		if (fd_table[fd].offset + count <= INLINE_MAX && inline_write(fd, buf, count) != -1)
+		{
+			return count;
+		}
+		if (inline_spill(fd) == -1)
+		{
+			return 0; // disk is full: the file stays inline
+		}
+	}
+
+	/* a hole cannot be part of a chain: index the blocks instead, or fill it
+	   with zeros if snapshots may share the chain */
+	if (!(file->flags & (FS_FILE_DEDUP | FS_FILE_SPARSE)) && fd_table[fd].offset > file->file_size)
+	{
+		if ((sb.features & FS_FEAT_SNAP) && zero_fill(fd) == -1)
+		{
+			return 0; // disk is full: the gap is only partly filled
+		}
+		if (!(sb.features & FS_FEAT_SNAP) && ifile_convert(file) == NULL)
+		{
+			return 0; // disk is full: nothing of @buf is written
+		}
+	}
+
+	if (file->flags & (FS_FILE_DEDUP | FS_FILE_SPARSE))
+	{
+		return ifile_write(fd, buf, count);
+	}
+
+	return write_blocks(fd, buf, count);
+}
+
+/* writes @count bytes of @buf at the offset of @fd, in the data blocks of the file */
+int write_blocks(int fd, const void *buf, size_t count)
+{
+	bool is_first_entry = false;
+	struct file_entry *file = fd_table[fd].of->file;
+	uint32_t old_size = file->file_size;
+
+	struct open_file *of = fd_table[fd].of;
+	uint16_t block = block_index(fd);
 
 	uint16_t cur_index = block;
+	if (block == FAT_EOC)
+	{
+		/* appending right after the last block of the chain, which the map
+		   or the extents now end with */
+		cur_index = of->ext != NULL ? extent_last(of) :
+			chain_last(of->mapped ? of->map[of->mapped - 1] : file->first_data_block);
+	}
 	/* write @count bytes of data from @buf into the file @fd */
-	char bounce_buffer[BLOCK_SIZE];
+	BLOCK_BUFFER(bounce_buffer);
+
+	uint32_t bytes_written = 0;	// bytes written so far
+
+	while (bytes_written < count)
+	{
+		if (block == FAT_EOC)
+		{
+			if (file->first_data_block == FAT_EOC) {
+				is_first_entry = true;
+			} else {
+				is_first_entry = false;
+			}
+			block = create_new_block(cur_index, is_first_entry, fd);
+			if (block == FAT_EOC)
+			{
+				break; // disk is full
+			}
+		}
+
+		/* calculate offset for write (current offset % block size gives offset in block)*/
+		uint32_t block_offset = fd_table[fd].offset & block_mask;
+
+		/* get remaining bytes to be written total */
+		uint32_t bytes_left = count - bytes_written;
+		/* get remaining bytes to be written in current block */
+		uint32_t block_bytes_left = block_size - block_offset;
+
+		if (bytes_left > block_bytes_left)
+		{
+			bytes_left = block_bytes_left;
+		}
+
+		/* Read block, unless it is fully overwritten or holds no file data yet */
+		if (bytes_left < block_size)
+		{
+			if (fd_table[fd].offset - block_offset >= old_size)
+			{
+				memset(bounce_buffer, 0, block_size);
+			}
+			else if (read_data_block(block, &bounce_buffer) == -1)
+			{
+				return -1;
+			}
+			else
+			{
+				stats.rmw_reads++;
+			}
+		}
+
+		/* a block that snapshots use is left to them */
+		if (snap_refs != NULL && snap_refs[block])
+		{
+			block = snap_cow(file, bytes_written ? cur_index : FAT_EOC, block);
+			if (block == FAT_EOC)
+			{
+				break; // disk is full
+			}
+
+			if ((fd_table[fd].offset >> block_shift) < of->mapped)
+			{
+				of->map[fd_table[fd].offset >> block_shift] = block;
+			}
+		}
+
+		/* update file offset */
+		fd_table[fd].offset += bytes_left;
+
+		if (bytes_left == block_size)
+		{
+			/* whole block: write it straight from @buf */
+			write_data_block(block, buf + bytes_written);
+		}
+		else
+		{
+			/* copy input data from buf to bounce buffer, bytes left in current block */
+			memcpy(bounce_buffer + block_offset, buf + bytes_written, bytes_left);
+			stats.bounce_bytes += bytes_left;
+
+			/* Write block */
+			write_data_block(block, bounce_buffer);
+		}
+		bytes_written += bytes_left;
+
+		/* go to next block */
+		cur_index = block;
+	
+		block = fat.entries[block];
+		stats.fat_hops++;
+
+	}
+	/* a seek past the end only moves the end once data lands there */
+	if (bytes_written > 0 && fd_table[fd].offset > file->file_size)
+	{
+		file->file_size = fd_table[fd].offset;
+	}
+
+	stats.bytes_written += bytes_written;
+	return bytes_written;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_READ);
+	TRACE_SCOPE(FS_TRACE_READ, fd, count);
+
+	if (!mounted || !fd_valid(fd))
+	{
+		return -1;
+	}
+
+	/* never read past the end of the file */
+	uint32_t file_size = fd_table[fd].of->file->file_size;
+	if (fd_table[fd].offset >= file_size)
+	{
+		return 0;
+	}
+	if (count > file_size - fd_table[fd].offset)
+	{
+		count = file_size - fd_table[fd].offset;
+	}
+
+	if (fd_table[fd].of->file->flags & FS_FILE_COMPRESSED)
+	{
+		return zfile_read(fd, buf, count);
+	}
+
+	if (fd_table[fd].of->file->flags & (FS_FILE_DEDUP | FS_FILE_SPARSE))
+	{
+		return ifile_read(fd, buf, count);
+	}
+
+	if (fd_table[fd].of->file->flags & FS_FILE_INLINE)
+	{
+		/* served from memory */
+		memcpy(buf, inline_area + fd_table[fd].of->file->first_data_block * INLINE_SLOT +
+			fd_table[fd].offset, count);
+		fd_table[fd].offset += count;
+		stats.inline_reads++;
+		stats.bytes_read += count;
+		return count;
+	}
+
+	if (fd_table[fd].of->ext != NULL)
+	{
+		return extent_read(fd, buf, count);
+	}
+
+	uint16_t block = block_index(fd);
+
+
+	/* read @count bytes of data from the file referenced by @fd into @buf*/
+	BLOCK_BUFFER(bounce_buffer);
+
+
+	uint32_t bytes_read = 0; // bytes read so far
+	uint16_t bounce_buffer_offset = fd_table[fd].offset & block_mask;
+
+	while (bytes_read < count)
+	{
+		/* copy only right amount of bytes from bounce buffer into buf */
+		uint32_t num_to_copy = count - bytes_read;
+		if (num_to_copy > (uint32_t) (block_size - bounce_buffer_offset))
+		{
+			num_to_copy = (uint32_t) (block_size - bounce_buffer_offset);
+		}
+
+		if (num_to_copy == block_size)
+		{
+			/* whole block wanted: read it straight into @buf */
+			if (read_data_block(block, buf + bytes_read) == -1)
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			if (read_data_block(block, &bounce_buffer) == -1)
+			{
+				return -1;
+			}
+			memcpy(buf + bytes_read, bounce_buffer + bounce_buffer_offset, num_to_copy); // copies copy num of bytes
+			stats.bounce_bytes += num_to_copy;
+		}
+		
+		bytes_read += num_to_copy;
+		fd_table[fd].offset += num_to_copy;
+		
+		/* move to next block if still haven't read "count" bytes */
+		if (bytes_read < count)
+		{
+			block = fat.entries[block];
+			stats.fat_hops++;
+			
+			if (block == FAT_EOC)
+			{
+				break; // less than @count bytes until the end of the file
+			}
+		}
+		bounce_buffer_offset = 0;
+	}
+
+	stats.bytes_read += bytes_read;
+	return bytes_read;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	AIO_SCOPE();
+	if (!mounted || !fd_valid(fd) || offset > UINT32_MAX)
+	{
+		return -1;
+	}
+
+	uint32_t saved = fd_table[fd].offset;
+	fd_table[fd].offset = offset;
+	int ret = fs_read(fd, buf, count);
+	fd_table[fd].offset = saved;
+	return ret;
+}
+
+/* allocates the first run of @count free data blocks for an area used by a
+   feature, or returns 0 if there is none; the blocks stay allocated in the
+   FAT so that they are never handed out to files */
+static uint16_t reserve_area(uint16_t count)
+{
+	uint16_t first = fat_find_run(fat.entries, 1, sb.num_data_blocks, count);
+	if (first == sb.num_data_blocks && reclaim_blocks(UINT32_MAX))
+	{
+		first = fat_find_run(fat.entries, 1, sb.num_data_blocks, count);
+	}
+	if (count == 0 || first == sb.num_data_blocks)
+	{
+		return 0;
+	}
+
+	for (int i = first; i < first + count; i++)
+	{
+		fat.entries[i] = FAT_EOC;
+	}
+	return first;
+}
+
+/* verifies or computes the checksum of every allocated data block, reading
+   runs of allocated blocks in batches of up to SCRUB_BATCH blocks */
+static int scan_data_blocks(bool verify)
+{
+	char *buf = block_alloc(SCRUB_BATCH * block_size);
+	int corrupted = 0;
+
+	if (buf == NULL)
+	{
+		return -1;
+	}
+
+	int start = 1;
+	while (start < sb.num_data_blocks)
+	{
+		if (fat.entries[start] == 0 || is_csum_block(start))
+		{
+			start++;
+			continue;
+		}
+
+		int count = 1;
+		while (count < SCRUB_BATCH && start + count < sb.num_data_blocks &&
+			fat.entries[start + count] != 0 && !is_csum_block(start + count))
+		{
+			count++;
+		}
 
-	uint32_t bytes_written = 0;	// bytes written so far
+		if (block_read_range(sb.data_block + start, count, buf) == -1)
+		{
+			free(buf);
+			return -1;
+		}
+		for (int i = 0; i < count; i++)
+		{
+			if (!verify)
+			{
+				csums[start + i] = crc32c(0, buf + i * block_size, block_size);
+			}
+			else if (csum_verify(start + i, buf + i * block_size) == -1)
+			{
+				corrupted++;
+			}
+		}
+		start += count;
+	}
 
-	while (bytes_written < count)
+	free(buf);
+	return corrupted;
+}
+
+int fs_compress(const char *filename)
+{
+	AIO_SCOPE();
+	struct dir *parent;
+	struct file_entry *file;
+	uint32_t pos;
+
+	if (!mounted || (sb.features & FS_FEAT_SNAP) || (file = path_find(filename, &parent, &pos)) == NULL)
 	{
-		if (block == FAT_EOC)
+		return -1;
+	}
+
+	/* the data is not converted: only empty files can switch, and chunks
+	   are limited to what the codec takes */
+	if (file->file_size != 0 || file->first_data_block != FAT_EOC || block_size > LZ_MAX_INPUT)
+	{
+		return -1;
+	}
+	struct open_file *of = of_get(file, false);
+	if (of != NULL && of->refs != 0)
+	{
+		return -1;
+	}
+
+	if (file->flags & FS_FILE_EXTENT)
+	{
+		extent_drop(file);
+	}
+	file->flags &= ~(FS_FILE_INLINE | FS_FILE_DEDUP);
+	file->flags |= FS_FILE_COMPRESSED;
+	if (!(sb.features & FS_FEAT_COMPRESS))
+	{
+		sb.features |= FS_FEAT_COMPRESS;
+		sb_dirty = 1;
+	}
+	return 0;
+}
+
+int fs_mkdir(const char *path)
+{
+	AIO_SCOPE();
+	LAT_SCOPE(FS_OP_MKDIR);
+	struct dir *parent;
+	struct file_entry *dir;
+	uint32_t pos;
+
+	if (!mounted || (sb.features & FS_FEAT_SNAP) || (dir = path_create(path, &parent)) == NULL)
+	{
+		return -1;
+	}
+
+	if (dir_create(dir) == -1)
+	{
+		/* take the entry back */
+		if (parent != NULL && dir_find(parent, dir->file_name, &pos) != NULL)
 		{
-			if (root.entries[fd].first_data_block == FAT_EOC) {
-				is_first_entry = true;
-			} else {
-				is_first_entry = false;
-			}
-			block = create_new_block(cur_index, is_first_entry, fd);
+			dir_remove(parent, pos);
 		}
-		
-		/* Read block */
-		if (block_read(sb.data_block + block, &bounce_buffer) == -1)
+		else
 		{
-			return -1;
+			memset(dir, 0, sizeof(struct file_entry));
 		}
+		return -1;
+	}
 
+	if (!(sb.features & FS_FEAT_DIRS))
+	{
+		sb.features |= FS_FEAT_DIRS;
+		sb_dirty = 1;
+	}
+	return 0;
+}
 
-		/* calculate offset for write (current offset % block size gives offset in block)*/
-		uint32_t block_offset = fd_table[fd].offset % BLOCK_SIZE;
+int fs_csum_enable(void)
+{
+	AIO_SCOPE();
+	if (!mounted || read_only || (sb.features & FS_FEAT_CSUM))
+	{
+		return -1;
+	}
 
-		/* get remaining bytes to be written total */
-		uint32_t bytes_left = count - bytes_written;
-		/* get remaining bytes to be written in current block */
-		uint32_t block_bytes_left = BLOCK_SIZE - block_offset;
+	/* the checksum area takes the last data blocks, which must be free */
+	uint16_t count = (sb.num_data_blocks * sizeof(uint32_t) + block_size - 1) / block_size;
+	uint16_t first = sb.num_data_blocks - count;
+	reclaim_blocks(UINT32_MAX);
+	if (fat_find_used(fat.entries, first, sb.num_data_blocks) != sb.num_data_blocks)
+	{
+		return -1;
+	}
 
-		if (bytes_left > block_bytes_left)
+	csums = block_alloc(count * block_size);
+	if (csums == NULL)
+	{
+		return -1;
+	}
+
+	/* checksum what is already stored before anything is committed, the
+	   area being free and thus skipped */
+	if (scan_data_blocks(false) == -1)
+	{
+		free(csums);
+		csums = NULL;
+		return -1;
+	}
+
+	/* keep the area allocated so that it is never handed out to files */
+	for (int i = first; i < sb.num_data_blocks; i++)
+	{
+		fat.entries[i] = FAT_EOC;
+	}
+	sb.csum_block = first;
+	sb.csum_count = count;
+	sb.features |= FS_FEAT_CSUM;
+	sb_dirty = 1;
+
+	return 0;
+}
+
+int fs_inline_enable(void)
+{
+	AIO_SCOPE();
+	if (!mounted || (sb.features & (FS_FEAT_INLINE | FS_FEAT_SNAP)))
+	{
+		return -1;
+	}
+
+	/* room for the largest inline file of every root directory entry */
+	uint16_t count = FS_FILE_MAX_COUNT * INLINE_MAX / block_size;
+	uint32_t slots = count * block_size / INLINE_SLOT;
+	inline_area = block_alloc(count * block_size);
+	inline_used = calloc((slots + 63) / 64, sizeof(uint64_t));
+	inline_dirty = malloc(count * sizeof(bool));
+	uint16_t first = 0;
+	if (inline_area == NULL || inline_used == NULL || inline_dirty == NULL ||
+		(first = reserve_area(count)) == 0)
+	{
+		free(inline_area);
+		free(inline_used);
+		free(inline_dirty);
+		inline_area = NULL;
+		inline_used = NULL;
+		inline_dirty = NULL;
+		return -1;
+	}
+	memset(inline_dirty, true, count * sizeof(bool));
+
+	sb.inline_block = first;
+	sb.inline_count = count;
+	sb.features |= FS_FEAT_INLINE;
+	sb_dirty = 1;
+
+	/* move the small files already stored into the area */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		struct file_entry *file = &root.entries[i];
+		if (file->file_name[0] == '\0' || (file->flags & FS_FILE_COMPRESSED) ||
+			file->file_size > INLINE_MAX)
 		{
-			bytes_left = block_bytes_left;
+			continue;
 		}
-		
 
+		BLOCK_BUFFER(data);
+		uint32_t size = file->file_size;
+		int slot = -1;
+		if (size)
+		{
+			/* the area has room for INLINE_MAX bytes for every entry */
+			slot = inline_alloc(inline_slots(size));
+			if (read_data_block(file->first_data_block, data) == -1)
+			{
+				return -1;
+			}
+			inline_copy(slot * INLINE_SLOT, data, size);
+		}
+		file->file_size = 0;
+		trim_chain(file);
+		if (file->flags & FS_FILE_EXTENT)
+		{
+			extent_drop(file);
+		}
+		file->file_size = size;
+		file->first_data_block = size ? slot : FAT_EOC;
+		file->flags |= FS_FILE_INLINE;
+	}
+
+	return 0;
+}
 
-		/* copy input data from buf to bounce buffer, bytes left in current block */
-		memcpy(bounce_buffer + block_offset, buf + bytes_written, bytes_left);
+int fs_dedup_enable(void)
+{
+	AIO_SCOPE();
+	if (!mounted || (sb.features & (FS_FEAT_DEDUP | FS_FEAT_SNAP)))
+	{
+		return -1;
+	}
 
-		/* update file offset */
-		fd_table[fd].offset += bytes_left;
-		bytes_written += bytes_left;
+	/* one reference per data block */
+	sb.dedup_count = (sb.num_data_blocks * sizeof(struct dedup_ref) + block_size - 1) / block_size;
+	if (dedup_alloc() == -1 || (sb.dedup_block = reserve_area(sb.dedup_count)) == 0)
+	{
+		free(dedup_refs);
+		free(dedup_dirty);
+		free(dedup_buckets);
+		free(dedup_next);
+		dedup_refs = NULL;
+		dedup_dirty = NULL;
+		dedup_buckets = NULL;
+		dedup_next = NULL;
+		sb.dedup_count = 0;
+		return -1;
+	}
+	memset(dedup_dirty, true, sb.dedup_count * sizeof(bool));
 
-		/* Write block */
-		block_write(sb.data_block + block, bounce_buffer);
+	sb.features |= FS_FEAT_DEDUP;
+	sb_dirty = 1;
 
-		/* go to next block */
-		cur_index = block;
-	
-		block = fat.entries[block];
+	/* empty files become deduplicated, as new ones will be */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		struct file_entry *file = &root.entries[i];
+		if (file->file_name[0] != '\0' && file->flags == 0 && file->file_size == 0 &&
+			file->first_data_block == FAT_EOC)
+		{
+			file->flags = FS_FILE_DEDUP;
+		}
+	}
+
+	return 0;
+}
+
+int fs_extent_enable(void)
+{
+	AIO_SCOPE();
+	if (!mounted || read_only || (sb.features & (FS_FEAT_EXTENT | FS_FEAT_SNAP)))
+	{
+		return -1;
+	}
 
+	sb.features |= FS_FEAT_EXTENT;
+	sb_dirty = 1;
+
+	/* empty files get extents, as new ones will */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		struct file_entry *file = &root.entries[i];
+		if (file->file_name[0] != '\0' && file->flags == 0 && file->file_size == 0 &&
+			file->first_data_block == FAT_EOC && of_get(file, false) == NULL)
+		{
+			file->flags = FS_FILE_EXTENT;
+			file->extent_count = 0;
+		}
 	}
-	if (fd_table[fd].offset > root.entries[fd].file_size)
+
+	return 0;
+}
+
+/* reserves the snapshot table */
+static int snap_enable(void)
+{
+	uint16_t count = 1 + meta_blocks(sb.num_data_blocks);
+
+	snaps = block_alloc(count * block_size);
+	if (snaps == NULL || (sb.snap_block = reserve_area(count)) == 0)
 	{
-		root.entries[fd].file_size = fd_table[fd].offset;
+		free(snaps);
+		snaps = NULL;
+		return -1;
 	}
+	snap_refs = (uint8_t *)snaps + block_size;
+	snap_dirty = true;
 
-	return bytes_written;
+	sb.snap_count = count;
+	sb.features |= FS_FEAT_SNAP;
+	sb_dirty = 1;
+	return 0;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_snapshot(const char *name)
 {
-	if (!mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].open == 0)
+	AIO_SCOPE();
+	if (!mounted || read_only || name == NULL || name[0] == '\0' || strlen(name) >= FS_FILENAME_LEN)
 	{
 		return -1;
 	}
 
-	uint16_t block = block_index(fd);
+	/* only the chains of plain files can be shared */
+	if (sb.features & ~(FS_FEAT_CSUM | FS_FEAT_SNAP))
+	{
+		return -1;
+	}
+	reclaim_blocks(UINT32_MAX); // a snapshot has no deleted file to free
 
+	if (!(sb.features & FS_FEAT_SNAP) && snap_enable() == -1)
+	{
+		return -1;
+	}
 
-	/* read @count bytes of data from the file referenced by @fd into @buf*/
-	char bounce_buffer[BLOCK_SIZE];
+	struct snap_entry *snap = NULL;
+	for (int i = 0; i < SNAP_MAX && snap == NULL; i++)
+	{
+		if (snaps[i].name[0] == '\0')
+		{
+			snap = &snaps[i];
+		}
+	}
+	if (snap == NULL || snap_find(name) != NULL)
+	{
+		return -1;
+	}
 
+	/* copy the FAT and root directory, once the copy itself is allocated */
+	uint16_t count = sb.num_FAT_blocks + meta_blocks(sizeof(root));
+	char *copy = block_alloc(count * block_size);
+	uint16_t first = copy == NULL ? 0 : reserve_area(count);
+	if (first == 0)
+	{
+		free(copy);
+		return -1;
+	}
+	memcpy(copy, fat.entries, sb.num_FAT_blocks * block_size);
+	memcpy(copy + sb.num_FAT_blocks * block_size, &root, sizeof(root));
+	if (write_data_range(first, count, copy) == -1)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			fat.entries[first + i] = 0;
+		}
+		free(copy);
+		return -1;
+	}
+	free(copy);
+	stats.meta_writes += count;
 
-	uint32_t bytes_read = 0; // bytes read so far
-	uint16_t bounce_buffer_offset = fd_table[fd].offset % BLOCK_SIZE;
+	/* the data blocks of every file are now shared with the snapshot */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (root.entries[i].file_name[0] == '\0')
+		{
+			continue;
+		}
+		for (uint16_t b = root.entries[i].first_data_block; b != FAT_EOC; b = fat.entries[b])
+		{
+			snap_refs[b]++;
+			stats.fat_hops++;
+		}
+	}
 
-	while (bytes_read < count)
+	memset(snap, 0, sizeof(*snap));
+	memcpy(snap->name, name, strlen(name));
+	snap->created = time(NULL);
+	snap->block = first;
+	snap->count = count;
+	snap_dirty = true;
+	return 0;
+}
+
+/* releases the data blocks of the snapshot whose FAT and root directory are
+   @fat_copy and @root_copy, freeing those that neither another snapshot nor
+   a file uses */
+static void snap_release(const uint16_t *fat_copy, const struct rootdir *root_copy)
+{
+	bool *live = calloc(sb.num_data_blocks, sizeof(bool));
+
+	/* without the blocks of the files, keep every block allocated */
+	for (int i = 0; live != NULL && i < FS_FILE_MAX_COUNT; i++)
 	{
-		if (block_read(sb.data_block + block, &bounce_buffer) == -1)
+		if (root.entries[i].file_name[0] == '\0')
 		{
-			return -1;
+			continue;
 		}
-		/* copy only right amount of bytes from bounce buffer into buf */
-		uint32_t num_to_copy = count - bytes_read;
-		if (num_to_copy > (uint32_t) (BLOCK_SIZE - bounce_buffer_offset))
+		for (uint16_t b = root.entries[i].first_data_block; b != FAT_EOC; b = fat.entries[b])
 		{
-			num_to_copy = (uint32_t) (BLOCK_SIZE - bounce_buffer_offset);
+			live[b] = true;
+			stats.fat_hops++;
 		}
+	}
 
-		memcpy(buf + bytes_read, bounce_buffer + bounce_buffer_offset, num_to_copy); // copies copy num of bytes
-		
-		bytes_read += num_to_copy;
-		fd_table[fd].offset += num_to_copy;
-		
-		/* move to next block if still haven't read "count" bytes */
-		if (bytes_read < count)
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if (root_copy->entries[i].file_name[0] == '\0')
 		{
-			block = fat.entries[block];
-			
-			if (block == FAT_EOC)
+			continue;
+		}
+		for (uint16_t b = root_copy->entries[i].first_data_block; b != FAT_EOC; b = fat_copy[b])
+		{
+			if (snap_refs[b] != 0 && --snap_refs[b] == 0 && live != NULL && !live[b])
 			{
-				break; // less than @count bytes until the end of the file
+				fat.entries[b] = 0;
+				TRACE(FS_TRACE_FAT_SET, b, 0);
+				discard_queue(b);
 			}
+			stats.fat_hops++;
 		}
-		bounce_buffer_offset = 0;
 	}
+	free(live);
+}
 
-	return bytes_read;
+int fs_snapshot_delete(const char *name)
+{
+	AIO_SCOPE();
+	struct snap_entry *snap;
+
+	if (!mounted || read_only || !(sb.features & FS_FEAT_SNAP) || name == NULL ||
+		(snap = snap_find(name)) == NULL)
+	{
+		return -1;
+	}
+
+	uint16_t *fat_copy = block_alloc(sb.num_FAT_blocks * block_size);
+	struct rootdir *root_copy = malloc(sizeof(root));
+	int ret = -1;
+
+	if (fat_copy != NULL && root_copy != NULL && snap_read(snap, fat_copy, root_copy) == 0)
+	{
+		snap_release(fat_copy, root_copy);
+		for (int i = 0; i < snap->count; i++)
+		{
+			fat.entries[snap->block + i] = 0;
+			discard_queue(snap->block + i);
+		}
+		memset(snap, 0, sizeof(*snap));
+		snap_dirty = true;
+		ret = 0;
+	}
+
+	free(fat_copy);
+	free(root_copy);
+	return ret;
+}
+
+int fs_snapshot_ls(void)
+{
+	AIO_SCOPE();
+	if (!mounted)
+	{
+		return -1;
+	}
+
+	printf("FS Snapshots:\n");
+	for (int i = 0; snaps != NULL && i < SNAP_MAX; i++)
+	{
+		if (snaps[i].name[0] != '\0')
+		{
+			printf("snapshot: %s, created: %" PRIu64 ", data_blk: %u\n", snaps[i].name,
+				   snaps[i].created, snaps[i].block);
+		}
+	}
+
+	return 0;
+}
+
+int fs_scrub(void)
+{
+	AIO_SCOPE();
+	if (!mounted || !(sb.features & FS_FEAT_CSUM))
+	{
+		return -1;
+	}
+
+	return scan_data_blocks(true);
+}
+
+int fs_stats(struct fs_stats *st)
+{
+	struct block_stats bstats;
+
+	if (st == NULL)
+	{
+		return -1;
+	}
+
+	block_stats_get(&bstats);
+	*st = stats;
+	st->block_reads = bstats.reads;
+	st->block_writes = bstats.writes;
+	st->block_errors = bstats.errors;
+	st->block_bounced = bstats.bounced;
+	st->block_failovers = bstats.failovers;
+	st->block_discarded = bstats.discarded;
+
+	return 0;
+}
+
+void fs_stats_reset(void)
+{
+	memset(&stats, 0, sizeof(stats));
+	block_stats_reset();
+}
+
+void fs_stats_show(int enable)
+{
+	stats_show = enable;
 }
@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint64_t definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,19 +10,85 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Maximum path length (including the NULL character) */
+#define FS_PATH_MAX 256
+
+/** Initial size of the file descriptor table, which grows as files are opened */
 #define FS_OPEN_MAX_COUNT 32
 
+/** fs_format() flags */
+#define FS_FORMAT_PREALLOC 0x01 /* allocate the whole image on the host */
+#define FS_FORMAT_CSUM 0x02 /* reserve a checksum area, see fs_csum_enable() */
+#define FS_FORMAT_INLINE 0x04 /* reserve an inline area, see fs_inline_enable() */
+#define FS_FORMAT_DEDUP 0x08 /* reserve a reference table, see fs_dedup_enable() */
+#define FS_FORMAT_EXTENT 0x10 /* record blocks as extents, see fs_extent_enable() */
+
+/**
+ * struct fs_format_opts - Geometry and layout of a new file system
+ * @block_size: Block size in bytes, a power of two from 1 KiB to 64 KiB, or 0
+ * for 4 KiB
+ * @data_blocks: Number of data blocks, or 0 for as many as fit in @size
+ * @size: Size of the virtual disk file in bytes, used if @data_blocks is 0
+ * @flags: FS_FORMAT_* flags
+ */
+struct fs_format_opts {
+	size_t block_size;
+	size_t data_blocks;
+	uint64_t size;
+	unsigned int flags;
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @opts: Geometry and layout of the file system
+ *
+ * Create virtual disk file @diskname, replacing any existing file, and make an
+ * empty file system on it: a superblock, a FAT and a root directory followed
+ * by the data blocks, as fs_make.x does for 4 KiB blocks. The file is sparse
+ * unless @opts asks for %FS_FORMAT_PREALLOC, and only the metadata blocks are
+ * written, so that formatting takes the same time whatever the size. Areas
+ * asked for by the other flags are reserved as their enabling function does
+ * on a mounted file system.
+ *
+ * Return: -1 if a file system is currently mounted, if @opts is NULL or
+ * invalid, if the file system would have more than 65535 blocks, if the
+ * virtual disk file cannot be created, or if an area cannot be reserved. 0
+ * otherwise.
+ */
+int fs_format(const char *diskname, const struct fs_format_opts *opts);
+
+/**
+ * fs_direct_enable - Control direct I/O
+ * @enable: Non-zero to have later fs_mount() calls open the virtual disk with
+ * direct I/O, zero for buffered I/O (default)
+ *
+ * With direct I/O, blocks bypass the host page cache, so that they are not
+ * cached twice and large scans do not evict the rest of the host's cache, at
+ * the cost of going to the device for every block that libfs does not keep in
+ * memory. The buffers used by libfs are aligned for it, and those passed to
+ * fs_read() and fs_write() are used as they are when aligned on 4 KiB. Where
+ * the host file system does not support direct I/O, or not for the block
+ * size of the file system, the virtual disk is used with buffered I/O.
+ */
+void fs_direct_enable(int enable);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). The block size, a power of
+ * two from 1 KiB to 64 KiB, is the one recorded in the superblock (4 KiB for
+ * file systems made by the reference tools).
  *
- * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
+ * @diskname may end with @<snapshot> to mount a snapshot taken by
+ * fs_snapshot() instead, read-only: the files are then as they were when the
+ * snapshot was taken, and any call that would modify the file system fails.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid
+ * file system can be located, or if there is no such snapshot. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
@@ -29,10 +96,12 @@ int fs_mount(const char *diskname);
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. File descriptors still open are closed first, as by fs_close(),
+ * so that the files they hold are written back; they are invalid afterwards,
+ * even once a file system is mounted again.
  *
- * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
+ * Return: -1 if no FS is currently mounted, or if the file system cannot be
+ * written back or the virtual disk cannot be closed. 0 otherwise.
  */
 int fs_umount(void);
 
@@ -54,6 +123,12 @@ int fs_info(void);
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
  * character).
  *
+ * @filename may also be a path such as "dir/sub/file" (with an optional
+ * leading '/'), to create the file in a directory made by fs_mkdir(). Every
+ * component of a path is shorter than %FS_FILENAME_LEN characters, and the
+ * whole path shorter than %FS_PATH_MAX. This applies to all the functions
+ * taking a file name.
+ *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
  * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
@@ -65,7 +140,20 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system. A directory can be deleted once it is empty.
+ *
+ * The entry is removed at once, but the data blocks of a file of more than
+ * 256 blocks are handed to a background thread, started on first use and
+ * stopped by fs_umount(). It frees them 256 at a time so that other calls get
+ * to run in between; they become allocatable as it goes. Running out of free blocks, taking a
+ * snapshot or unmounting waits for the blocks still to be freed.
+ *
+ * Freed data blocks that no snapshot uses are also given back to the host,
+ * as holes punched in the image (see block_discard()). This is done at
+ * fs_umount(), once the metadata written to the image no longer refers to
+ * them, with one request per run of free blocks, so that small deletes cost
+ * no request each. Where the host cannot punch holes, the image keeps its
+ * space.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * Return: -1 if @filename is invalid, if there is no file named @filename to
@@ -82,6 +170,48 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_lsdir - List files of a directory
+ * @path: Path of the directory, "" or "/" for the root directory
+ *
+ * List information about the files located in directory @path, as fs_ls().
+ *
+ * Return: -1 if no FS is currently mounted, or if @path is not a directory.
+ * 0 otherwise.
+ */
+int fs_lsdir(const char *path);
+
+/**
+ * fs_mkdir - Create a directory
+ * @path: Path of the directory
+ *
+ * Create an empty directory @path. Unlike the root directory, a directory can
+ * hold any number of files: its entries are found through an on-disk hash
+ * index, which doubles as the directory grows, so that looking up a name
+ * reads one index block and one block of entries whatever the size of the
+ * directory. Directories reached through a path are kept in memory, and the
+ * directory of every path looked up is cached, until fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, if @path is invalid, if there is
+ * already a file named @path, or if there is no space left for it. 0
+ * otherwise.
+ */
+int fs_mkdir(const char *path);
+
+/**
+ * fs_readdir - Iterate over the files of the root directory
+ * @pos: Iteration cursor, to be set to 0 before the first call
+ * @filename: Buffer of %FS_FILENAME_LEN bytes to be filled with a file name
+ *
+ * Copy the name of the next file of the root directory into @filename and
+ * advance @pos past it. Files created or deleted during the iteration may or
+ * may not be returned.
+ *
+ * Return: -1 if no FS is currently mounted, or if @pos or @filename is
+ * invalid, or if there are no more files. 0 otherwise.
+ */
+int fs_readdir(int *pos, char *filename);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -91,13 +221,15 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors, which share the in-memory state of the file: the blocks of its
+ * chain found so far, so that seeking does not follow the FAT again, and what
+ * compressed, deduplicated and sparse files keep in memory. There is no limit
+ * on the number of open files: the descriptor table grows as needed, and the
+ * descriptor returned is taken from the list of free ones in constant time.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
+ * there is no file named @filename to open, or if memory runs out. Otherwise,
+ * return the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -133,12 +265,33 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * @offset may be past the end of the file: a later write there leaves a hole,
+ * which reads as zeros and takes no data blocks.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than the largest file size (%UINT32_MAX). 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_reserve - Preallocate data blocks for a file
+ * @fd: File descriptor
+ * @size: Number of bytes the file is expected to grow to
+ *
+ * Make sure the file referenced by file descriptor @fd has enough data blocks
+ * to hold @size bytes, allocating the missing ones in a single pass over the
+ * FAT. The file size is not changed: following calls to fs_write() fill the
+ * reserved blocks instead of allocating blocks one at a time. Reserved blocks
+ * that are still past the end of the file when the last file descriptor of
+ * the file is closed are freed.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the disk runs out of
+ * space (as many blocks as possible are then reserved). 0 otherwise.
+ */
+int fs_reserve(int fd, size_t size);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -182,4 +335,595 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: Offset in the file of the first byte to read
+ *
+ * Read as fs_lseek() of @fd to @offset followed by fs_read() would, but
+ * leave the file offset of @fd unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, if file descriptor @fd is invalid,
+ * or if @offset is past the largest file size. Otherwise return the number of
+ * bytes actually read, as fs_read().
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * struct fs_completion - Completed asynchronous request
+ * @user_data: Value given when the request was submitted
+ * @result: Return value of the fs_read() or fs_write() performed for the
+ * request, or -1 if the file offset could not be set
+ */
+struct fs_completion {
+	uint64_t user_data;
+	int result;
+};
+
+/**
+ * fs_async_start - Start the asynchronous engine
+ * @depth: Maximum number of requests in flight, from their submission to the
+ * reaping of their completion
+ *
+ * Start a worker thread that performs the requests submitted with
+ * fs_read_async() and fs_write_async() in submission order. libfs performs
+ * one call at a time: while the engine runs, calls made by other threads wait
+ * for the request being performed, if any, and the other way around. The
+ * engine must be started while no other thread is calling into libfs.
+ *
+ * Return: -1 if the engine is already running, if @depth is 0, or if the
+ * worker cannot be started. Otherwise, return an eventfd file descriptor that
+ * becomes readable (for poll() or epoll) when there are completions to reap
+ * with fs_async_reap().
+ */
+int fs_async_start(unsigned int depth);
+
+/**
+ * fs_async_stop - Stop the asynchronous engine
+ *
+ * Wait for the submitted requests to be performed, then stop the worker and
+ * close the eventfd. Completions that were not reaped are lost.
+ *
+ * Return: -1 if the engine is not running. 0 otherwise.
+ */
+int fs_async_stop(void);
+
+/**
+ * fs_read_async - Submit a read
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data, left untouched by the caller until
+ * the completion of the request is reaped
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ * @user_data: Value given back in the completion of the request
+ *
+ * Queue a request for fs_lseek() of @fd to @offset followed by fs_read() of
+ * @count bytes into @buf, and return without waiting for it. The file offset
+ * of @fd is left where the read leaves it.
+ *
+ * Return: -1 if the engine is not running, if @buf is NULL, or if the depth
+ * given to fs_async_start() is reached. 0 otherwise.
+ */
+int fs_read_async(int fd, void *buf, size_t count, size_t offset,
+		  uint64_t user_data);
+
+/**
+ * fs_write_async - Submit a write
+ * @fd: File descriptor
+ * @buf: Data buffer holding the data to be written, left untouched by the
+ * caller until the completion of the request is reaped
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ * @user_data: Value given back in the completion of the request
+ *
+ * Queue a request for fs_lseek() of @fd to @offset followed by fs_write() of
+ * @count bytes from @buf, and return without waiting for it.
+ *
+ * Return: -1 if the engine is not running, if @buf is NULL, or if the depth
+ * given to fs_async_start() is reached. 0 otherwise.
+ */
+int fs_write_async(int fd, void *buf, size_t count, size_t offset,
+		   uint64_t user_data);
+
+/**
+ * fs_async_reap - Collect completed requests
+ * @comps: Array to be filled with completions
+ * @max: Size of @comps
+ *
+ * Take up to @max completions, oldest first, without blocking, and clear the
+ * eventfd unless completions remain.
+ *
+ * Return: -1 if the engine is not running or @comps is NULL. Otherwise,
+ * return the number of completions stored in @comps (0 if none).
+ */
+int fs_async_reap(struct fs_completion *comps, int max);
+
+/**
+ * fs_compress - Make a file compressed
+ * @filename: File name
+ *
+ * Switch the empty file @filename to compressed storage. The contents of a
+ * compressed file are cut into chunks of %BLOCK_SIZE bytes, each compressed
+ * on its own with a fast LZ codec and packed with the others into the data
+ * blocks of the file, behind an index giving the location of every chunk.
+ * fs_read() and fs_write() work as for any file: they only decompress the
+ * chunks covering the requested bytes, and the last chunk used is kept
+ * uncompressed in memory until the last file descriptor of the file is
+ * closed. A chunk that no longer fits where it was stored after being
+ * overwritten is stored again in the block being filled, and a block is freed
+ * once none of the chunks it holds is still in use. Chunks of zeros take no
+ * space.
+ *
+ * Return: -1 if no FS is currently mounted, if @filename is invalid, if there
+ * is no file named @filename, if it is not empty, if it is currently open, or
+ * if blocks are 64 KiB (larger than what the codec takes). 0 otherwise.
+ */
+int fs_compress(const char *filename);
+
+/**
+ * fs_csum_enable - Enable data block checksums
+ *
+ * Reserve a checksum area holding a CRC32C of every data block at the end of
+ * the data blocks of the mounted file system, and checksum the data blocks
+ * already in use. From then on, every data block written by fs_write() has its
+ * checksum updated, and every data block read by fs_read() or fs_write() is
+ * verified against it; a mismatch makes the call fail. The checksum area is
+ * saved with the rest of the metadata by fs_umount(), and stays enabled for
+ * later mounts.
+ *
+ * Return: -1 if no FS is currently mounted, if checksums are already enabled,
+ * or if the data blocks needed for the checksum area (the last
+ * 1 / (%BLOCK_SIZE / 4) of the data blocks) are not free. 0 otherwise.
+ */
+int fs_csum_enable(void);
+
+/**
+ * fs_inline_enable - Enable inline storage of small files
+ *
+ * Reserve an inline area in the data blocks of the mounted file system, large
+ * enough to hold 512 bytes for every root directory entry, and move the files
+ * of up to 512 bytes that are not compressed into it. From then on, files are
+ * created inline: their contents are packed in 64-byte slots of the area,
+ * which is loaded at mount time, so that reading them costs no block I/O, and
+ * written back at unmount. A file moves to data blocks of its own once it
+ * grows past 512 bytes, or when the area is full.
+ *
+ * Return: -1 if no FS is currently mounted, if inline storage is already
+ * enabled, or if there is no run of free data blocks long enough for the area.
+ * 0 otherwise.
+ */
+int fs_inline_enable(void);
+
+/**
+ * fs_dedup_enable - Enable block deduplication
+ *
+ * Reserve a reference table in the data blocks of the mounted file system.
+ * From then on, new files are deduplicated: a block of such a file whose
+ * contents are identical to a data block already in use, found through an
+ * in-memory table of content hashes, becomes a reference to that data block
+ * instead of being written. A shared block modified by one of its users is
+ * copied first, and blocks of zeros take no space. Files that already have
+ * contents are left as they are.
+ *
+ * Return: -1 if no FS is currently mounted, if deduplication is already
+ * enabled, or if there is no run of free data blocks long enough for the
+ * reference table. 0 otherwise.
+ */
+int fs_dedup_enable(void);
+
+/**
+ * fs_extent_enable - Record file blocks as extents
+ *
+ * From then on, new files of the mounted file system record their data blocks
+ * as extents, runs of consecutive data blocks, on top of their FAT chain: up
+ * to 2 extents in the file entry, and up to 255 in a data block of their own.
+ * A file takes the data block right after its last one whenever it is free,
+ * finding a block of a file is a binary search of its extents instead of a
+ * walk of its chain, and fs_read() reads the whole blocks of an extent in a
+ * single request. A file that ends up with more than 255 extents keeps its
+ * chain only. Empty files of the root directory switch to extents; the
+ * others are left as they are, and images remain readable by tools that only
+ * know about FAT chains.
+ *
+ * Return: -1 if no FS is currently mounted or it is read-only, if extents are
+ * already enabled, or if the file system has snapshots. 0 otherwise.
+ */
+int fs_extent_enable(void);
+
+/**
+ * fs_scrub - Verify all data blocks against their checksums
+ *
+ * Read every allocated data block, in large sequential batches, and verify it
+ * against its checksum. Each corrupted block is reported on standard error.
+ *
+ * Return: -1 if no FS is currently mounted, if checksums are not enabled, or
+ * if a block cannot be read. Otherwise, return the number of corrupted blocks.
+ */
+int fs_scrub(void);
+
+/**
+ * fs_snapshot - Take a snapshot of the file system
+ * @name: Snapshot name
+ *
+ * Freeze the current state of the mounted file system as snapshot @name, to
+ * be mounted read-only with fs_mount(). Only the FAT and root directory are
+ * copied: data blocks are shared with the snapshot, and fs_write() moves a
+ * shared block to a new block before modifying it, while fs_delete() keeps
+ * the blocks of a deleted file that snapshots still use. Taking a snapshot
+ * thus costs the writing of the FAT and root directory, whatever the amount
+ * of data, and up to 8 snapshots can be kept. Once the file system has
+ * snapshots, writing past the end of a file fills the gap with zeros.
+ *
+ * Return: -1 if no FS is currently mounted or it is read-only, if @name is
+ * invalid or already taken, if there are 8 snapshots already, if the file
+ * system has compressed, inline, deduplicated or sparse files, directories
+ * or extents, or if there are not enough free data blocks for the copy. 0
+ * otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Snapshot name
+ *
+ * Delete snapshot @name, freeing its copy of the metadata and the data
+ * blocks that only it used.
+ *
+ * Return: -1 if no FS is currently mounted or it is read-only, or if there is
+ * no snapshot named @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_snapshot_ls - List snapshots
+ *
+ * List the snapshots of the mounted file system, with the time they were
+ * taken.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_snapshot_ls(void);
+
+/**
+ * struct fs_stats - I/O and metadata counters
+ * @block_reads: Number of blocks read from the virtual disk
+ * @block_writes: Number of blocks written to the virtual disk
+ * @block_errors: Number of failed block reads or writes
+ * @block_bounced: Number of block reads or writes copied through an aligned
+ * buffer because direct I/O could not use the caller's buffer
+ * @block_failovers: Number of images of a mirrored disk taken out of use
+ * after an error (see block_disk_open())
+ * @block_discarded: Number of freed data blocks whose host space was given
+ * back (see block_discard())
+ * @meta_reads: Number of superblock, FAT and root directory blocks read
+ * @meta_writes: Number of FAT and root directory blocks written
+ * @fat_hops: Number of FAT links followed to locate or walk data blocks
+ * @alloc_calls: Number of data blocks allocated
+ * @alloc_scan_steps: Number of FAT entries examined by the block allocator
+ * @rmw_reads: Number of data blocks read back by fs_write() before updating
+ * @bounce_bytes: Number of bytes copied through bounce buffers
+ * @bytes_read: Number of bytes returned by fs_read()
+ * @bytes_written: Number of bytes accepted by fs_write()
+ * @csum_verified: Number of data blocks verified against their checksum
+ * @csum_errors: Number of data blocks that did not match their checksum
+ * @compress_in: Bytes of compressed files' chunks given to the compressor
+ * @compress_out: Bytes of compressed files' chunks stored after compression
+ * @inline_reads: Number of fs_read() calls served from the inline area
+ * @dedup_hits: Number of blocks written as a reference to identical contents
+ * @dedup_cow: Number of shared blocks copied because one file modified them
+ * @snap_cow: Number of data blocks moved because a snapshot used them
+ * @extent_reads: Number of runs of whole blocks of an extent read in a single
+ * request
+ * @dir_lookups: Number of names looked up in the index of a directory
+ * @dir_probes: Number of index entries compared with the names looked up
+ * @path_hits: Number of paths whose directory was found in the path cache
+ * @path_misses: Number of paths walked from the root directory
+ * @reclaimed: Number of data blocks of deleted files freed in the background
+ */
+struct fs_stats {
+	uint64_t block_reads;
+	uint64_t block_writes;
+	uint64_t block_errors;
+	uint64_t block_bounced;
+	uint64_t block_failovers;
+	uint64_t block_discarded;
+	uint64_t meta_reads;
+	uint64_t meta_writes;
+	uint64_t fat_hops;
+	uint64_t alloc_calls;
+	uint64_t alloc_scan_steps;
+	uint64_t rmw_reads;
+	uint64_t bounce_bytes;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t csum_verified;
+	uint64_t csum_errors;
+	uint64_t compress_in;
+	uint64_t compress_out;
+	uint64_t inline_reads;
+	uint64_t dedup_hits;
+	uint64_t dedup_cow;
+	uint64_t snap_cow;
+	uint64_t extent_reads;
+	uint64_t dir_lookups;
+	uint64_t dir_probes;
+	uint64_t path_hits;
+	uint64_t path_misses;
+	uint64_t reclaimed;
+};
+
+/**
+ * fs_stats - Get I/O and metadata counters
+ * @stats: Structure to be filled with the current counters
+ *
+ * Counters accumulate across mounts until fs_stats_reset() is called, so the
+ * cost of fs_mount() and fs_umount() themselves can be measured.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_stats_reset - Clear I/O and metadata counters
+ */
+void fs_stats_reset(void);
+
+/**
+ * fs_stats_show - Control whether fs_info() prints the counters
+ * @enable: Non-zero to have fs_info() print the counters after the file
+ * system information, zero to disable (default)
+ */
+void fs_stats_show(int enable);
+
+/**
+ * enum fs_op - Operations tracked by the latency histograms
+ */
+enum fs_op {
+	FS_OP_MOUNT,
+	FS_OP_UMOUNT,
+	FS_OP_OPEN,
+	FS_OP_READ,
+	FS_OP_WRITE,
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_MKDIR,
+	FS_OP_BLOCK_READ,
+	FS_OP_BLOCK_WRITE,
+	FS_OP_COUNT,
+};
+
+/** Number of buckets in a latency histogram */
+#define FS_LATENCY_BUCKETS 256
+
+/**
+ * struct fs_latency - Latency histogram of one operation
+ * @count: Number of samples
+ * @sum_ns: Sum of all samples, in nanoseconds
+ * @max_ns: Largest sample, in nanoseconds
+ * @buckets: Log-linear buckets: samples below 4ns have their own bucket, then
+ * each power of two is split into 4 equal sub-buckets
+ */
+struct fs_latency {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[FS_LATENCY_BUCKETS];
+};
+
+/**
+ * fs_latency_enable - Control latency histogram collection
+ * @enable: Non-zero to start timing operations with the monotonic clock, zero
+ * to stop (default)
+ */
+void fs_latency_enable(int enable);
+
+/**
+ * fs_latency_reset - Clear all latency histograms
+ */
+void fs_latency_reset(void);
+
+/**
+ * fs_latency_get - Get the latency histogram of an operation
+ * @op: Operation
+ * @lat: Structure to be filled with the histogram of @op
+ *
+ * Return: -1 if @op is invalid or @lat is NULL. 0 otherwise.
+ */
+int fs_latency_get(enum fs_op op, struct fs_latency *lat);
+
+/**
+ * fs_latency_percentile - Compute a percentile from a latency histogram
+ * @lat: Histogram
+ * @pct: Percentile, between 0 and 100 (e.g. 99.9)
+ *
+ * Return: Upper bound of the bucket holding the @pct-th percentile sample
+ * (capped to the largest sample), in nanoseconds. 0 if @lat is empty.
+ */
+uint64_t fs_latency_percentile(const struct fs_latency *lat, double pct);
+
+/**
+ * fs_latency_dump - Display latency histograms
+ *
+ * Display count, average, p50, p99, p999 and maximum latency of every
+ * operation that has at least one sample.
+ *
+ * Return: 0.
+ */
+int fs_latency_dump(void);
+
+/**
+ * enum fs_trace_event - Events recorded by the tracepoints
+ *
+ * Tracepoints are only compiled in when libfs is built with ``make TRACE=1``.
+ * Arguments of each event are:
+ * - fs_* calls: file descriptor (or -1) and byte count or offset, if any
+ * - block_read/block_write: block index
+ * - alloc: allocated data block and number of FAT entries scanned
+ * - fat_set: FAT entry index and its new value
+ */
+enum fs_trace_event {
+	FS_TRACE_MOUNT,
+	FS_TRACE_UMOUNT,
+	FS_TRACE_CREATE,
+	FS_TRACE_DELETE,
+	FS_TRACE_OPEN,
+	FS_TRACE_CLOSE,
+	FS_TRACE_LSEEK,
+	FS_TRACE_READ,
+	FS_TRACE_WRITE,
+	FS_TRACE_BLOCK_READ,
+	FS_TRACE_BLOCK_WRITE,
+	FS_TRACE_ALLOC,
+	FS_TRACE_FAT_SET,
+	FS_TRACE_EVENT_COUNT,
+};
+
+/** Magic number at the start of a trace dump ("FSTRACE1") */
+#define FS_TRACE_MAGIC 0x3145434152545346ull
+
+/**
+ * struct fs_trace_header - Header of a trace dump file
+ * @magic: %FS_TRACE_MAGIC
+ * @count: Number of records following the header
+ */
+struct fs_trace_header {
+	uint64_t magic;
+	uint64_t count;
+};
+
+/**
+ * struct fs_trace_record - Trace record, as stored in a trace dump file
+ * @ts_ns: CLOCK_MONOTONIC timestamp in nanoseconds
+ * @arg0: First event argument
+ * @arg1: Second event argument
+ * @tid: Identifier of the thread that emitted the record
+ * @event: Event (see enum fs_trace_event)
+ * @phase: 'B' (begin) or 'E' (end) of a duration event, 'i' for an instant
+ * @pad: Unused
+ */
+struct fs_trace_record {
+	uint64_t ts_ns;
+	uint64_t arg0;
+	uint64_t arg1;
+	uint32_t tid;
+	uint16_t event;
+	uint8_t phase;
+	uint8_t pad;
+};
+
+/**
+ * fs_trace_event_name - Get the name of a trace event
+ * @event: Event
+ *
+ * Return: Name of @event, or "unknown".
+ */
+const char *fs_trace_event_name(unsigned int event);
+
+/**
+ * fs_trace_dump - Save the trace buffers to a file
+ * @filename: Name of the file on the host computer
+ *
+ * Write a &struct fs_trace_header followed by the most recent records of
+ * every thread's trace ring into @filename. Records are only consistent if
+ * no other thread is calling into libfs during the dump.
+ *
+ * Return: -1 if libfs was built without tracing, or if @filename cannot be
+ * written. 0 otherwise.
+ */
+int fs_trace_dump(const char *filename);
+
+/**
+ * struct fs_fsck_report - Result of a file system check
+ * @files: Number of files, in all directories
+ * @bad_superblock: Non-zero if the superblock is invalid (nothing else is
+ * checked in that case)
+ * @bad_entries: Number of directory entries with an invalid name, and of
+ * directories whose header or index does not match their entries
+ * @bad_chains: Number of chains holding an invalid block index or running
+ * into a free block, and of files whose extents do not match their chain
+ * @size_mismatches: Number of files whose chain length does not match their
+ * size
+ * @cycles: Number of chains that loop back on themselves
+ * @cross_links: Number of chains that run into another file's blocks
+ * @leaked_blocks: Number of allocated data blocks that belong to no file
+ * @bad_fat_entries: Number of FAT entries holding an invalid value
+ * @bad_refs: Number of shared data blocks whose reference count is wrong, and
+ * of references to blocks that are not shared data blocks
+ * @free_blocks: Number of free data blocks
+ */
+struct fs_fsck_report {
+	unsigned int files;
+	unsigned int bad_superblock;
+	unsigned int bad_entries;
+	unsigned int bad_chains;
+	unsigned int size_mismatches;
+	unsigned int cycles;
+	unsigned int cross_links;
+	unsigned int leaked_blocks;
+	unsigned int bad_fat_entries;
+	unsigned int bad_refs;
+	unsigned int free_blocks;
+};
+
+/**
+ * fs_fsck - Check a file system for consistency
+ * @diskname: Name of the virtual disk file
+ * @nthreads: Number of checker threads, or 0 for one per online CPU
+ * @report: Structure to be filled with the result of the check
+ *
+ * Check the superblock geometry, the root directory entries, and the FAT chain
+ * of every file against its size, and find cycles, cross-linked blocks and
+ * allocated blocks that belong to no file, as well as the reference counts of
+ * shared data blocks when deduplication is enabled. Subdirectories are
+ * checked with their files, each root directory entry being one work item for
+ * the @nthreads threads. The disk is only read, and each problem found is printed.
+ *
+ * Return: -1 if a file system is currently mounted, if @report is NULL, if
+ * the virtual disk file @diskname cannot be opened or read, or if memory runs
+ * out, so that some files were not checked. Otherwise, return the number of
+ * problems found (0 if the file system is consistent).
+ */
+int fs_fsck(const char *diskname, int nthreads, struct fs_fsck_report *report);
+
+/** Magic number at the start of a workload recording ("FSREC002") */
+#define FS_RECORD_MAGIC 0x3230304345525346ull
+
+/** Magic number of the recordings made before paths, which are not replayed */
+#define FS_RECORD_MAGIC_V1 0x3130304345525346ull
+
+/**
+ * struct fs_record - Recorded file system call
+ * @ts_ns: Start time of the call, in nanoseconds since recording started
+ * @dur_ns: Duration of the call in nanoseconds
+ * @offset: File offset before the call (read and write), or requested
+ * offset (lseek)
+ * @size: Requested byte count (read and write)
+ * @ret: Value returned by the call
+ * @fd: File descriptor argument, or -1
+ * @op: Call (see enum fs_op)
+ * @name_len: Length of the path stored right after the record (create,
+ * delete, open and mkdir), without the NULL character, below %FS_PATH_MAX
+ * @pad: Zero
+ *
+ * A recording is a 64-bit %FS_RECORD_MAGIC followed by one record per call.
+ * Programs linked with the recording layer (see apps/Makefile) write one when
+ * the ``FS_RECORD`` environment variable names the output file.
+ */
+struct fs_record {
+	uint64_t ts_ns;
+	uint32_t dur_ns;
+	uint32_t offset;
+	uint32_t size;
+	int32_t ret;
+	int16_t fd;
+	uint16_t name_len;
+	uint8_t op;
+	uint8_t pad[3];
+};
+
 #endif /* _FS_H */
@@ -0,0 +1,176 @@
+#ifndef _FS_INTERNAL_H
+#define _FS_INTERNAL_H
+
+#include <stdint.h>
+
+/*
+ * On-disk layout of an ECS150FS file system, shared by the libfs modules.
+ * Not part of the public API.
+ */
+
+#define FAT_EOC 0xFFFF
+
+/*
+ * Optional features, recorded in the superblock. Images created by fs_make.x
+ * have none, and the blocks used by a feature are kept allocated in the FAT
+ * so that tools unaware of it still see a valid file system.
+ */
+#define FS_FEAT_CSUM	0x0001	// CRC32C of every data block
+#define FS_FEAT_COMPRESS	0x0002	// some files are compressed
+#define FS_FEAT_INLINE	0x0004	// small files live in the inline area
+#define FS_FEAT_DEDUP	0x0008	// data blocks may be shared between files
+#define FS_FEAT_SPARSE	0x0010	// some files have holes
+#define FS_FEAT_DIRS	0x0020	// there are subdirectories
+#define FS_FEAT_SNAP	0x0040	// snapshots share data blocks with the files
+#define FS_FEAT_EXTENT	0x0080	// some files record their blocks as extents
+
+/* file_entry flags */
+#define FS_FILE_COMPRESSED	0x01
+#define FS_FILE_INLINE	0x02
+#define FS_FILE_DEDUP	0x04
+#define FS_FILE_SPARSE	0x08
+#define FS_FILE_DIR	0x10
+#define FS_FILE_EXTENT	0x20
+
+/*
+ * The inline area packs files of up to INLINE_MAX bytes: each one takes a run
+ * of INLINE_SLOT-byte slots, and its first_data_block is the first slot.
+ */
+#define INLINE_SLOT	64
+#define INLINE_MAX	512
+
+struct superblock
+{
+	char signature[8];		  // must be equal to “ECS150FS”
+	uint16_t total_blocks;	  // total amount of blocks of virtual disk
+	uint16_t root_dir;		  // root directory block index
+	uint16_t data_block;	  // data block start index
+	uint16_t num_data_blocks; // amount of data blocks
+	uint8_t num_FAT_blocks;	  // number of blocks for FAT
+	/* extensions, zero unless a feature is enabled */
+	uint8_t block_shift;	  // log2 of the block size, 0 for 4096
+	uint16_t features;		  // FS_FEAT_* flags
+	uint16_t csum_block;	  // first data block of the checksum area
+	uint16_t csum_count;	  // number of blocks of the checksum area
+	uint16_t inline_block;	  // first data block of the inline area
+	uint16_t inline_count;	  // number of blocks of the inline area
+	uint16_t dedup_block;	  // first data block of the reference table
+	uint16_t dedup_count;	  // number of blocks of the reference table
+	uint16_t snap_block;	  // first data block of the snapshot table
+	uint16_t snap_count;	  // number of blocks of the snapshot table
+	uint8_t padding[4060];		  // unused/padding
+};
+
+struct FAT
+{
+	uint16_t *entries;
+	uint16_t num_entries; // equal to the number of data blocks in disk
+};
+
+/*
+ * The chain of a file with extents is also recorded as runs of consecutive
+ * data blocks, so that a block is found without following the FAT. Up to
+ * EXTENT_INLINE extents are kept in the file entry; a file with more has them
+ * in a data block of its own, given by extents[0].start, which is allocated
+ * in the FAT as the end of no chain.
+ */
+#define EXTENT_INLINE	2
+#define EXTENT_MAX	255
+
+struct extent
+{
+	uint16_t start;			  // first data block of the run
+	uint16_t count;			  // blocks of the run
+};
+
+struct file_entry
+{
+	char file_name[16];
+	uint32_t file_size;
+	uint16_t first_data_block;
+	uint8_t flags;			  // FS_FILE_* flags
+	uint8_t extent_count;	  // extents of an FS_FILE_EXTENT file
+	struct extent extents[EXTENT_INLINE];
+};
+
+/*
+ * A compressed file is cut into chunks of one block, each compressed on its
+ * own and packed with the others into the data blocks of the file. Its chain
+ * starts with an index: an array of zchunk giving, for every chunk, where its
+ * compressed bytes are. Entry 0 is a header whose @block and @offset give the
+ * block being filled with chunks and how many of its bytes are used.
+ */
+struct zchunk
+{
+	uint16_t block;			  // data block, 0 if the chunk holds only zeros
+	uint16_t offset;		  // offset of the compressed bytes in @block
+	uint16_t length;		  // compressed length, block size if stored as is
+	uint16_t reserved;
+};
+
+struct rootdir
+{
+	struct file_entry entries[128];
+};
+
+/*
+ * The chain of a deduplicated file only holds its index: the data block of
+ * every block of the file, or 0 if the block holds only zeros. Data blocks
+ * are shared between all the files with the same contents, and the reference
+ * table counts the users of each one, along with the hash of its contents.
+ */
+struct dedup_ref
+{
+	uint32_t hash;			  // CRC32C of the block
+	uint16_t refs;			  // index entries pointing to the block
+	uint16_t reserved;
+};
+
+/*
+ * A directory other than the root directory is a file whose chain holds a
+ * header, then the blocks of a hash index, then the blocks of its entries.
+ * The index is an open-addressing table of dir_hash, at most half full,
+ * found at the name hash modulo its size and probed linearly; an entry never
+ * moves once created, and a free entry holds the next free one (plus one) in
+ * its file_size.
+ */
+#define DIR_MAGIC	0x52494446	// "FDIR"
+#define DIR_HASHES_PER_BLOCK(size)	((size) / sizeof(struct dir_hash))
+#define DIR_ENTRIES_PER_BLOCK(size)	((size) / sizeof(struct file_entry))
+
+struct dir_header
+{
+	uint32_t magic;			  // DIR_MAGIC
+	uint32_t count;			  // entries in use
+	uint32_t index_blocks;	  // blocks of the index, after the header
+	uint32_t entry_blocks;	  // blocks of entries, after the index
+	uint32_t free_slot;		  // first free entry plus one, 0 if none
+	uint8_t padding[1004];	  // up to the smallest block size
+};
+
+struct dir_hash
+{
+	uint32_t hash;			  // FNV-1a of the name
+	uint32_t slot;			  // entry plus one, 0 if unused
+};
+
+/*
+ * A snapshot is a copy of the FAT and root directory, taken in a run of data
+ * blocks: the FAT blocks, then the root directory. Its files share their data
+ * blocks with the file system until these are written, and the snapshot table
+ * counts the snapshots using each data block. The table is a block holding a
+ * snap_entry per snapshot, followed by one byte per data block. A block that
+ * only snapshots use is kept allocated in the FAT, as the end of no chain.
+ */
+#define SNAP_MAX	8
+
+struct snap_entry
+{
+	char name[16];			  // empty if the entry is free
+	uint64_t created;		  // seconds since the epoch
+	uint16_t block;			  // first data block of the copy
+	uint16_t count;			  // blocks of the copy
+	uint8_t padding[4];
+};
+
+#endif /* _FS_INTERNAL_H */
@@ -0,0 +1,797 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fatscan.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+#define fsck_error(fmt, ...) \
+	printf("fsck: "fmt"\n", ##__VA_ARGS__)
+
+/* Index entries held by one block of a deduplicated or sparse file */
+#define INDEX_PER_BLOCK(ctx) ((ctx)->bsize / sizeof(uint16_t))
+
+/* Blocks taken by @len bytes */
+#define BLOCKS(ctx, len) (((len) + (ctx)->bsize - 1) / (ctx)->bsize)
+
+#define report_inc(ctx, field) \
+	__atomic_fetch_add(&(ctx)->rep->field, 1, __ATOMIC_RELAXED)
+
+/* Upper bound on checker threads (one file per work item) */
+#define FSCK_MAX_THREADS FS_FILE_MAX_COUNT
+
+/* State shared by the checker threads */
+struct fsck_ctx {
+	struct superblock sb;
+	/* Block size of the file system */
+	uint32_t bsize;
+	struct rootdir root;
+	/* Whole FAT as stored on disk */
+	uint16_t *fat;
+	/* One bit per data block, set once a file's chain reaches it */
+	uint64_t *used;
+	/* Reference table of shared data blocks, if any, and the references
+	   found to each of them */
+	struct dedup_ref *refs;
+	uint32_t *counts;
+	/* Snapshot table, if any, followed by the number of snapshots using
+	   each data block */
+	struct snap_entry *snaps;
+	/* Next root directory entry to be checked */
+	int next_entry;
+	/* Set when files could not be checked, for lack of memory or after a
+	   read error */
+	int failed;
+	struct fs_fsck_report *rep;
+};
+
+/* Mark @block as used and return whether it already was */
+static int test_and_set_used(struct fsck_ctx *ctx, uint16_t block)
+{
+	uint64_t bit = 1ull << (block % 64);
+
+	return !!(__atomic_fetch_or(&ctx->used[block / 64], bit,
+				    __ATOMIC_RELAXED) & bit);
+}
+
+static int is_used(struct fsck_ctx *ctx, uint16_t block)
+{
+	return !!(ctx->used[block / 64] & (1ull << (block % 64)));
+}
+
+/* Count the references of deduplicated file @entry, whose index is in @mine */
+static void count_refs(struct fsck_ctx *ctx, struct file_entry *entry,
+		       uint16_t *mine, uint32_t len)
+{
+	uint16_t index[INDEX_PER_BLOCK(ctx)];
+	uint32_t left = BLOCKS(ctx, entry->file_size);
+
+	for (uint32_t i = 0; i < len && left; i++) {
+		uint32_t n = left < INDEX_PER_BLOCK(ctx) ? left :
+			INDEX_PER_BLOCK(ctx);
+
+		if (block_read(ctx->sb.data_block + mine[i], index) == -1) {
+			__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		for (uint32_t j = 0; j < n; j++) {
+			uint16_t b = index[j];
+
+			if (b == 0)
+				continue;
+			if (b >= ctx->sb.num_data_blocks || !ctx->refs[b].refs) {
+				fsck_error("file '%s': reference to unshared "
+					   "block %u", entry->file_name, b);
+				report_inc(ctx, bad_refs);
+				continue;
+			}
+			__atomic_fetch_add(&ctx->counts[b], 1, __ATOMIC_RELAXED);
+		}
+		left -= n;
+	}
+}
+
+static void check_dir(struct fsck_ctx *ctx, const char *name,
+		      const uint16_t *chain, uint32_t len);
+
+/*
+ * Compare the extents of @entry with its chain @mine, claiming the block
+ * holding them if they are not in the entry.
+ */
+static void check_extents(struct fsck_ctx *ctx, struct file_entry *entry,
+			  const char *name, const uint16_t *mine, uint32_t len)
+{
+	struct extent list[ctx->bsize / sizeof(struct extent)];
+	const struct extent *ext = entry->extents;
+	uint32_t n = 0;
+
+	if (!(ctx->sb.features & FS_FEAT_EXTENT)) {
+		fsck_error("file '%s': extents without the feature", name);
+		report_inc(ctx, bad_chains);
+		return;
+	}
+
+	if (entry->extent_count > EXTENT_INLINE) {
+		uint16_t block = entry->extents[0].start;
+
+		if (block == 0 || block >= ctx->sb.num_data_blocks ||
+		    ctx->fat[block] != FAT_EOC) {
+			fsck_error("file '%s': invalid extent block %u", name,
+				   block);
+			report_inc(ctx, bad_chains);
+			return;
+		}
+		if (test_and_set_used(ctx, block)) {
+			fsck_error("file '%s': extent block %u is cross-linked "
+				   "with another file", name, block);
+			report_inc(ctx, cross_links);
+			return;
+		}
+		if (block_read(ctx->sb.data_block + block, list) == -1) {
+			__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		ext = list;
+	}
+
+	for (uint32_t i = 0; i < entry->extent_count; i++) {
+		for (uint32_t j = 0; j < ext[i].count; j++, n++) {
+			if (n >= len || mine[n] != ext[i].start + j) {
+				fsck_error("file '%s': extent %u does not match "
+					   "block %u of the chain", name, i, n);
+				report_inc(ctx, bad_chains);
+				return;
+			}
+		}
+	}
+	if (n != len) {
+		fsck_error("file '%s': %u blocks in extents for %u in chain",
+			   name, n, len);
+		report_inc(ctx, bad_chains);
+	}
+}
+
+/*
+ * Walk the chain of @entry, claiming each block in the shared bitmap.
+ * Reaching a block that is already claimed means the chain loops back on
+ * itself (the block appears in @mine) or is cross-linked with another file.
+ */
+static void check_file(struct fsck_ctx *ctx, struct file_entry *entry,
+		       uint16_t *mine)
+{
+	uint32_t expected = BLOCKS(ctx, entry->file_size);
+	uint32_t len = 0;
+	uint16_t block = entry->first_data_block;
+	char name[FS_FILENAME_LEN + 1];
+
+	memcpy(name, entry->file_name, FS_FILENAME_LEN);
+	name[FS_FILENAME_LEN] = '\0';
+
+	/* inline files have slots of the inline area instead of a chain */
+	if (entry->flags & FS_FILE_INLINE) {
+		uint32_t slots = (entry->file_size + INLINE_SLOT - 1) /
+			INLINE_SLOT;
+
+		if (!(ctx->sb.features & FS_FEAT_INLINE) ||
+		    entry->file_size > INLINE_MAX ||
+		    (slots && entry->first_data_block + slots >
+		     ctx->sb.inline_count * ctx->bsize / INLINE_SLOT)) {
+			fsck_error("file '%s': invalid inline slots %u-%u",
+				   name, entry->first_data_block,
+				   entry->first_data_block + slots);
+			report_inc(ctx, bad_chains);
+		}
+		return;
+	}
+
+	while (block != FAT_EOC) {
+		if (block == 0 || block >= ctx->sb.num_data_blocks) {
+			fsck_error("file '%s': invalid block index %u after %u "
+				   "blocks", name, block, len);
+			report_inc(ctx, bad_chains);
+			return;
+		}
+
+		if (test_and_set_used(ctx, block)) {
+			uint32_t i;
+
+			for (i = 0; i < len && mine[i] != block; i++)
+				;
+			if (i < len) {
+				fsck_error("file '%s': chain loops back to "
+					   "block %u", name, block);
+				report_inc(ctx, cycles);
+			} else {
+				fsck_error("file '%s': block %u is cross-linked "
+					   "with another file", name, block);
+				report_inc(ctx, cross_links);
+			}
+			return;
+		}
+		mine[len++] = block;
+
+		if (ctx->fat[block] == 0) {
+			fsck_error("file '%s': chain runs into free block %u",
+				   name, block);
+			report_inc(ctx, bad_chains);
+			return;
+		}
+		block = ctx->fat[block];
+	}
+
+	if ((entry->flags & FS_FILE_DEDUP) && ctx->counts)
+		count_refs(ctx, entry, mine, len);
+
+	/* compressed files take as many blocks as their data needs, the chain
+	   of deduplicated files only holds their index, and sparse files have
+	   their index followed by the blocks that are not holes */
+	if (entry->flags & FS_FILE_COMPRESSED)
+		return;
+	if (entry->flags & FS_FILE_SPARSE) {
+		uint32_t index = (expected + INDEX_PER_BLOCK(ctx) - 1) /
+			INDEX_PER_BLOCK(ctx);
+
+		if (!index)
+			index = 1;
+		if (len >= index && len <= index + expected)
+			return;
+		expected = index;
+	} else if (entry->flags & FS_FILE_DEDUP) {
+		expected = (expected + INDEX_PER_BLOCK(ctx) - 1) /
+			INDEX_PER_BLOCK(ctx);
+	}
+
+	if (len != expected) {
+		fsck_error("file '%s': %u blocks in chain for %u bytes "
+			   "(expected %u)", name, len, entry->file_size,
+			   expected);
+		report_inc(ctx, size_mismatches);
+		return;
+	}
+
+	if (entry->flags & FS_FILE_EXTENT)
+		check_extents(ctx, entry, name, mine, len);
+	if (entry->flags & FS_FILE_DIR)
+		check_dir(ctx, name, mine, len);
+}
+
+/*
+ * Check the header and index of directory @name, whose chain is @chain, and
+ * every file in it.
+ */
+static void check_dir(struct fsck_ctx *ctx, const char *name,
+		      const uint16_t *chain, uint32_t len)
+{
+	struct dir_header header;
+	struct dir_hash hashes[DIR_HASHES_PER_BLOCK(ctx->bsize)];
+	struct file_entry entries[DIR_ENTRIES_PER_BLOCK(ctx->bsize)];
+	uint32_t indexed = 0, count = 0;
+	uint16_t *blocks, *mine;
+
+	/* The header is at the start of its block */
+	if (block_read(ctx->sb.data_block + chain[0], entries) == -1) {
+		__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	memcpy(&header, entries, sizeof(header));
+	if (header.magic != DIR_MAGIC || header.index_blocks == 0 ||
+	    (header.index_blocks & (header.index_blocks - 1)) ||
+	    1 + header.index_blocks + header.entry_blocks != len) {
+		fsck_error("directory '%s': invalid header", name);
+		report_inc(ctx, bad_entries);
+		return;
+	}
+
+	for (uint32_t i = 0; i < header.index_blocks; i++) {
+		if (block_read(ctx->sb.data_block + chain[1 + i], hashes) == -1) {
+			__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		for (uint32_t j = 0; j < DIR_HASHES_PER_BLOCK(ctx->bsize); j++)
+			if (hashes[j].slot)
+				indexed++;
+	}
+
+	/* The chain of the directory is overwritten by the files it holds */
+	blocks = malloc(header.entry_blocks * sizeof(uint16_t) + 1);
+	mine = malloc(ctx->sb.num_data_blocks * sizeof(uint16_t));
+	if (!blocks || !mine) {
+		__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+	memcpy(blocks, chain + 1 + header.index_blocks,
+	       header.entry_blocks * sizeof(uint16_t));
+
+	for (uint32_t i = 0; i < header.entry_blocks; i++) {
+		if (block_read(ctx->sb.data_block + blocks[i], entries) == -1) {
+			__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+			goto out;
+		}
+		for (uint32_t j = 0; j < DIR_ENTRIES_PER_BLOCK(ctx->bsize); j++) {
+			if (entries[j].file_name[0] == '\0')
+				continue;
+			count++;
+			report_inc(ctx, files);
+			if (!memchr(entries[j].file_name, '\0',
+				    FS_FILENAME_LEN)) {
+				fsck_error("directory '%s': file name of entry "
+					   "%u is not terminated", name,
+					   i * (uint32_t)DIR_ENTRIES_PER_BLOCK(ctx->bsize) +
+					   j);
+				report_inc(ctx, bad_entries);
+				continue;
+			}
+			check_file(ctx, &entries[j], mine);
+		}
+	}
+
+	if (count != header.count || indexed != count) {
+		fsck_error("directory '%s': %u entries, %u in its header and "
+			   "%u in its index", name, count, header.count,
+			   indexed);
+		report_inc(ctx, bad_entries);
+	}
+out:
+	free(blocks);
+	free(mine);
+}
+
+static void *check_thread(void *arg)
+{
+	struct fsck_ctx *ctx = arg;
+	uint16_t *mine;
+	int idx;
+
+	/* Blocks of the file being checked, for telling loops from links */
+	mine = malloc(ctx->sb.num_data_blocks * sizeof(uint16_t));
+	if (!mine)
+		return (void *)-1;
+
+	while ((idx = __atomic_fetch_add(&ctx->next_entry, 1,
+					 __ATOMIC_RELAXED)) < FS_FILE_MAX_COUNT) {
+		if (ctx->root.entries[idx].file_name[0] == '\0')
+			continue;
+		check_file(ctx, &ctx->root.entries[idx], mine);
+	}
+
+	free(mine);
+	return NULL;
+}
+
+static int check_superblock(struct fsck_ctx *ctx)
+{
+	struct superblock *sb = &ctx->sb;
+	int fat_blocks, meta_blocks;
+
+	if (strncmp(sb->signature, "ECS150FS", 8) != 0) {
+		fsck_error("bad superblock signature");
+		return -1;
+	}
+
+	ctx->bsize = 1u << (sb->block_shift ? sb->block_shift : 12);
+	if (sb->block_shift > 16 || block_disk_set_size(ctx->bsize)) {
+		fsck_error("invalid block size shift %u", sb->block_shift);
+		return -1;
+	}
+
+	/* The superblock and root directory take several blocks if blocks
+	   are smaller than they are */
+	fat_blocks = BLOCKS(ctx, sb->num_data_blocks * sizeof(uint16_t));
+	meta_blocks = BLOCKS(ctx, sizeof(struct rootdir));
+	if (block_disk_count() != sb->total_blocks ||
+	    sb->num_FAT_blocks != fat_blocks ||
+	    sb->root_dir != meta_blocks + sb->num_FAT_blocks ||
+	    sb->data_block != sb->root_dir + meta_blocks ||
+	    sb->data_block + sb->num_data_blocks != sb->total_blocks) {
+		fsck_error("inconsistent superblock geometry (total=%u fat=%u "
+			   "rdir=%u data=%u data_count=%u, disk=%d)",
+			   sb->total_blocks, sb->num_FAT_blocks, sb->root_dir,
+			   sb->data_block, sb->num_data_blocks,
+			   block_disk_count());
+		return -1;
+	}
+
+	if ((sb->features & FS_FEAT_CSUM) &&
+	    (sb->csum_count == 0 ||
+	     sb->csum_block + sb->csum_count > sb->num_data_blocks)) {
+		fsck_error("checksum area out of bounds (block=%u count=%u)",
+			   sb->csum_block, sb->csum_count);
+		return -1;
+	}
+
+	if ((sb->features & FS_FEAT_INLINE) &&
+	    (sb->inline_count == 0 ||
+	     sb->inline_block + sb->inline_count > sb->num_data_blocks)) {
+		fsck_error("inline area out of bounds (block=%u count=%u)",
+			   sb->inline_block, sb->inline_count);
+		return -1;
+	}
+
+	if ((sb->features & FS_FEAT_DEDUP) &&
+	    (sb->dedup_count * ctx->bsize / sizeof(struct dedup_ref) <
+	     sb->num_data_blocks ||
+	     sb->dedup_block + sb->dedup_count > sb->num_data_blocks)) {
+		fsck_error("reference table out of bounds (block=%u count=%u)",
+			   sb->dedup_block, sb->dedup_count);
+		return -1;
+	}
+
+	if ((sb->features & FS_FEAT_SNAP) &&
+	    (sb->snap_count * ctx->bsize < ctx->bsize + sb->num_data_blocks ||
+	     sb->snap_block + sb->snap_count > sb->num_data_blocks)) {
+		fsck_error("snapshot table out of bounds (block=%u count=%u)",
+			   sb->snap_block, sb->snap_count);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Claim the blocks reserved by file system features before the files are
+ * walked, so that a file reaching into them is reported as cross-linked.
+ */
+static void check_area(struct fsck_ctx *ctx, const char *what,
+		       uint16_t first, uint16_t count)
+{
+	for (int i = 0; i < count; i++) {
+		uint16_t block = first + i;
+
+		test_and_set_used(ctx, block);
+		if (ctx->fat[block] != FAT_EOC) {
+			fsck_error("%s area block %u is not allocated", what,
+				   block);
+			ctx->rep->bad_fat_entries++;
+		}
+	}
+}
+
+/* Claim the snapshot table and the metadata copied by every snapshot */
+static int check_snap_areas(struct fsck_ctx *ctx)
+{
+	int copy_blocks = ctx->sb.num_FAT_blocks +
+		BLOCKS(ctx, sizeof(struct rootdir));
+
+	check_area(ctx, "snapshot", ctx->sb.snap_block, ctx->sb.snap_count);
+
+	ctx->snaps = malloc(ctx->sb.snap_count * ctx->bsize);
+	if (!ctx->snaps)
+		return -1;
+	if (block_read_range(ctx->sb.data_block + ctx->sb.snap_block,
+			     ctx->sb.snap_count, ctx->snaps) == -1)
+		return -1;
+
+	for (int i = 0; i < SNAP_MAX; i++) {
+		struct snap_entry *snap = &ctx->snaps[i];
+
+		if (snap->name[0] == '\0')
+			continue;
+		if (snap->count != copy_blocks ||
+		    snap->block + snap->count > ctx->sb.num_data_blocks) {
+			fsck_error("snapshot '%.16s' out of bounds (block=%u "
+				   "count=%u)", snap->name, snap->block,
+				   snap->count);
+			ctx->rep->bad_refs++;
+			snap->name[0] = '\0';
+			continue;
+		}
+		check_area(ctx, "snapshot copy", snap->block, snap->count);
+	}
+	return 0;
+}
+
+static int check_reserved(struct fsck_ctx *ctx)
+{
+	if (ctx->sb.features & FS_FEAT_CSUM)
+		check_area(ctx, "checksum", ctx->sb.csum_block,
+			   ctx->sb.csum_count);
+	if (ctx->sb.features & FS_FEAT_INLINE)
+		check_area(ctx, "inline", ctx->sb.inline_block,
+			   ctx->sb.inline_count);
+	if ((ctx->sb.features & FS_FEAT_SNAP) && check_snap_areas(ctx))
+		return -1;
+	if (!(ctx->sb.features & FS_FEAT_DEDUP))
+		return 0;
+
+	check_area(ctx, "reference", ctx->sb.dedup_block, ctx->sb.dedup_count);
+
+	/* shared data blocks belong to the table rather than to a chain */
+	ctx->refs = malloc(ctx->sb.dedup_count * ctx->bsize);
+	if (!ctx->refs)
+		return -1;
+	for (int i = 0; i < ctx->sb.dedup_count; i++)
+		if (block_read(ctx->sb.data_block + ctx->sb.dedup_block + i,
+			       (char *)ctx->refs + i * ctx->bsize) == -1)
+			return -1;
+
+	for (uint16_t b = 1; b < ctx->sb.num_data_blocks; b++) {
+		if (!ctx->refs[b].refs)
+			continue;
+		if (test_and_set_used(ctx, b) || ctx->fat[b] != FAT_EOC) {
+			fsck_error("shared block %u is not allocated on its own",
+				   b);
+			ctx->rep->bad_fat_entries++;
+		}
+	}
+
+	ctx->counts = calloc(ctx->sb.num_data_blocks, sizeof(uint32_t));
+	return ctx->counts ? 0 : -1;
+}
+
+/* Compare the references found to every shared block with the table */
+static void check_refs(struct fsck_ctx *ctx)
+{
+	if (!(ctx->sb.features & FS_FEAT_DEDUP))
+		return;
+
+	for (uint16_t b = 1; b < ctx->sb.num_data_blocks; b++) {
+		if (ctx->refs[b].refs && ctx->counts[b] != ctx->refs[b].refs) {
+			fsck_error("shared block %u has %u references instead "
+				   "of %u", b, ctx->counts[b],
+				   ctx->refs[b].refs);
+			ctx->rep->bad_refs++;
+		}
+	}
+}
+
+/*
+ * Walk the files of every snapshot through its copy of the FAT, compare the
+ * snapshots found to use each data block with the table, and claim the
+ * blocks that only snapshots use, which must be allocated.
+ */
+static int check_snapshots(struct fsck_ctx *ctx)
+{
+	uint8_t *table, *counts;
+	char *copy;
+	int copy_blocks = ctx->sb.num_FAT_blocks +
+		BLOCKS(ctx, sizeof(struct rootdir));
+
+	if (!(ctx->sb.features & FS_FEAT_SNAP))
+		return 0;
+
+	table = (uint8_t *)ctx->snaps + ctx->bsize;
+	counts = calloc(ctx->sb.num_data_blocks, 1);
+	copy = malloc(copy_blocks * ctx->bsize);
+	if (!counts || !copy) {
+		free(counts);
+		free(copy);
+		return -1;
+	}
+
+	for (int i = 0; i < SNAP_MAX; i++) {
+		struct snap_entry *snap = &ctx->snaps[i];
+		uint16_t *fat = (uint16_t *)copy;
+		struct rootdir *root;
+
+		if (snap->name[0] == '\0')
+			continue;
+		if (block_read_range(ctx->sb.data_block + snap->block,
+				     copy_blocks, copy) == -1) {
+			free(counts);
+			free(copy);
+			return -1;
+		}
+		root = (struct rootdir *)(copy + ctx->sb.num_FAT_blocks *
+					  ctx->bsize);
+
+		for (int j = 0; j < FS_FILE_MAX_COUNT; j++) {
+			uint16_t b = root->entries[j].first_data_block;
+			uint32_t hops = 0;
+
+			if (root->entries[j].file_name[0] == '\0')
+				continue;
+			for (; b != FAT_EOC && hops < ctx->sb.num_data_blocks;
+			     b = fat[b], hops++) {
+				if (b == 0 || b >= ctx->sb.num_data_blocks) {
+					fsck_error("snapshot '%.16s': file '%.16s' "
+						   "has invalid block %u",
+						   snap->name,
+						   root->entries[j].file_name, b);
+					ctx->rep->bad_chains++;
+					break;
+				}
+				counts[b]++;
+			}
+		}
+	}
+
+	for (uint16_t b = 1; b < ctx->sb.num_data_blocks; b++) {
+		if (counts[b] != table[b]) {
+			fsck_error("block %u is used by %u snapshots instead "
+				   "of %u", b, counts[b], table[b]);
+			ctx->rep->bad_refs++;
+		}
+		if (!table[b] || is_used(ctx, b))
+			continue;
+		test_and_set_used(ctx, b);
+		if (ctx->fat[b] != FAT_EOC) {
+			fsck_error("snapshot block %u is not allocated on its "
+				   "own", b);
+			ctx->rep->bad_fat_entries++;
+		}
+	}
+
+	free(counts);
+	free(copy);
+	return 0;
+}
+
+static void check_entries(struct fsck_ctx *ctx)
+{
+	struct file_entry *entries = ctx->root.entries;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (entries[i].file_name[0] == '\0')
+			continue;
+		ctx->rep->files++;
+
+		if (!memchr(entries[i].file_name, '\0', FS_FILENAME_LEN)) {
+			fsck_error("entry %d: file name is not terminated", i);
+			ctx->rep->bad_entries++;
+			continue;
+		}
+		for (int j = 0; j < i; j++) {
+			if (!strcmp(entries[i].file_name,
+				    entries[j].file_name)) {
+				fsck_error("entry %d: duplicate file name '%s'",
+					   i, entries[i].file_name);
+				ctx->rep->bad_entries++;
+				break;
+			}
+		}
+	}
+}
+
+/* Every allocated FAT entry must be reachable from exactly one file */
+static void check_fat(struct fsck_ctx *ctx)
+{
+	size_t fat_len = ctx->sb.num_FAT_blocks * ctx->bsize / sizeof(uint16_t);
+
+	if (ctx->fat[0] != FAT_EOC) {
+		fsck_error("FAT entry 0 is %u instead of EOC", ctx->fat[0]);
+		ctx->rep->bad_fat_entries++;
+	}
+
+	ctx->rep->free_blocks = fat_count_free(ctx->fat, 1,
+					       ctx->sb.num_data_blocks);
+
+	for (size_t b = 1;
+	     (b = fat_find_invalid(ctx->fat, b, ctx->sb.num_data_blocks,
+				   ctx->sb.num_data_blocks)) <
+	     ctx->sb.num_data_blocks; b++) {
+		fsck_error("FAT entry %zu has invalid value %u", b,
+			   ctx->fat[b]);
+		ctx->rep->bad_fat_entries++;
+	}
+
+	/* Skip the free runs, then check the allocated ones against the
+	   blocks claimed by files */
+	for (size_t b = 1;
+	     (b = fat_find_used(ctx->fat, b, ctx->sb.num_data_blocks)) <
+	     ctx->sb.num_data_blocks; b++) {
+		if (!is_used(ctx, b))
+			ctx->rep->leaked_blocks++;
+	}
+	if (ctx->rep->leaked_blocks)
+		fsck_error("%u allocated blocks belong to no file",
+			   ctx->rep->leaked_blocks);
+
+	for (size_t b = ctx->sb.num_data_blocks;
+	     (b = fat_find_used(ctx->fat, b, fat_len)) < fat_len; b++) {
+		fsck_error("FAT entry %zu beyond last data block is not free",
+			   b);
+		ctx->rep->bad_fat_entries++;
+	}
+}
+
+static int load_metadata(struct fsck_ctx *ctx)
+{
+	if (block_read(0, &ctx->sb) == -1)
+		return -1;
+
+	if (check_superblock(ctx)) {
+		ctx->rep->bad_superblock = 1;
+		return 0;
+	}
+
+	ctx->fat = malloc(ctx->sb.num_FAT_blocks * ctx->bsize);
+	ctx->used = calloc((ctx->sb.num_data_blocks + 63) / 64,
+			   sizeof(uint64_t));
+	if (!ctx->fat || !ctx->used)
+		return -1;
+
+	for (int i = 0; i < ctx->sb.num_FAT_blocks; i++)
+		if (block_read(ctx->sb.root_dir - ctx->sb.num_FAT_blocks + i,
+			       (char *)ctx->fat + i * ctx->bsize) == -1)
+			return -1;
+
+	if (ctx->bsize < sizeof(ctx->root)) {
+		if (block_read_range(ctx->sb.root_dir,
+				     sizeof(ctx->root) / ctx->bsize,
+				     &ctx->root) == -1)
+			return -1;
+	} else {
+		char block[ctx->bsize];
+
+		if (block_read(ctx->sb.root_dir, block) == -1)
+			return -1;
+		memcpy(&ctx->root, block, sizeof(ctx->root));
+	}
+
+	return 0;
+}
+
+int fs_fsck(const char *diskname, int nthreads, struct fs_fsck_report *report)
+{
+	pthread_t threads[FSCK_MAX_THREADS];
+	struct fsck_ctx ctx;
+	int ret = -1, started = 0, failed = 0;
+
+	if (report == NULL)
+		return -1;
+
+	memset(report, 0, sizeof(*report));
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.rep = report;
+
+	if (block_disk_open(diskname) == -1)
+		return -1;
+
+	if (load_metadata(&ctx))
+		goto out;
+	if (report->bad_superblock) {
+		ret = 1;
+		goto out;
+	}
+
+	if (check_reserved(&ctx))
+		goto out;
+	check_entries(&ctx);
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > (int)report->files)
+		nthreads = report->files;
+	if (nthreads > FSCK_MAX_THREADS)
+		nthreads = FSCK_MAX_THREADS;
+
+	/* Files are handed out one at a time, since chain lengths vary */
+	for (; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, check_thread, &ctx))
+			break;
+	if (started == 0 && check_thread(&ctx) != NULL)
+		goto out;
+	/* A thread that failed left files unchecked */
+	for (int i = 0; i < started; i++) {
+		void *result;
+
+		pthread_join(threads[i], &result);
+		if (result != NULL)
+			failed = 1;
+	}
+	if (failed || ctx.failed)
+		goto out;
+
+	if (check_snapshots(&ctx))
+		goto out;
+	check_fat(&ctx);
+	check_refs(&ctx);
+
+	ret = report->bad_entries + report->bad_chains +
+		report->size_mismatches + report->cycles + report->cross_links +
+		report->leaked_blocks + report->bad_fat_entries +
+		report->bad_refs;
+
+out:
+	free(ctx.fat);
+	free(ctx.used);
+	free(ctx.refs);
+	free(ctx.counts);
+	free(ctx.snaps);
+	block_disk_close();
+	return ret;
+}
@@ -0,0 +1,139 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fs.h"
+#include "latency.h"
+
+int lat_enabled = 0;
+
+/* One histogram per operation, updated with relaxed atomics */
+static struct fs_latency hists[FS_OP_COUNT];
+
+static const char *op_names[FS_OP_COUNT] = {
+	[FS_OP_MOUNT]		= "fs_mount",
+	[FS_OP_UMOUNT]		= "fs_umount",
+	[FS_OP_OPEN]		= "fs_open",
+	[FS_OP_READ]		= "fs_read",
+	[FS_OP_WRITE]		= "fs_write",
+	[FS_OP_CREATE]		= "fs_create",
+	[FS_OP_DELETE]		= "fs_delete",
+	[FS_OP_CLOSE]		= "fs_close",
+	[FS_OP_STAT]		= "fs_stat",
+	[FS_OP_LSEEK]		= "fs_lseek",
+	[FS_OP_MKDIR]		= "fs_mkdir",
+	[FS_OP_BLOCK_READ]	= "block_read",
+	[FS_OP_BLOCK_WRITE]	= "block_write",
+};
+
+/*
+ * Buckets are log-linear: values below 4 get their own bucket, then every
+ * power of two is split into 4 sub-buckets, which bounds the relative error
+ * of a reported percentile to 25%.
+ */
+static unsigned int bucket_of(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < 4)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+/* Largest value that falls in bucket @b */
+static uint64_t bucket_upper(unsigned int b)
+{
+	unsigned int msb, sub;
+
+	if (b < 4)
+		return b;
+
+	msb = b / 4 + 1;
+	sub = b % 4;
+	return ((uint64_t)(4 + sub + 1) << (msb - 2)) - 1;
+}
+
+void lat_record(enum fs_op op, uint64_t ns)
+{
+	struct fs_latency *h = &hists[op];
+	uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void fs_latency_enable(int enable)
+{
+	lat_enabled = enable;
+}
+
+void fs_latency_reset(void)
+{
+	memset(hists, 0, sizeof(hists));
+}
+
+int fs_latency_get(enum fs_op op, struct fs_latency *lat)
+{
+	if (op >= FS_OP_COUNT || lat == NULL)
+		return -1;
+
+	memcpy(lat, &hists[op], sizeof(*lat));
+	return 0;
+}
+
+uint64_t fs_latency_percentile(const struct fs_latency *lat, double pct)
+{
+	uint64_t rank, seen = 0;
+	unsigned int b;
+
+	if (!lat->count)
+		return 0;
+
+	/* Smallest sample rank that covers @pct of the samples */
+	rank = (uint64_t)(lat->count * pct / 100.0);
+	if (rank < lat->count * pct / 100.0)
+		rank++;
+	if (rank == 0)
+		rank = 1;
+
+	for (b = 0; b < FS_LATENCY_BUCKETS; b++) {
+		seen += lat->buckets[b];
+		if (seen >= rank)
+			break;
+	}
+
+	if (b == FS_LATENCY_BUCKETS || bucket_upper(b) > lat->max_ns)
+		return lat->max_ns;
+	return bucket_upper(b);
+}
+
+int fs_latency_dump(void)
+{
+	struct fs_latency lat;
+	int op;
+
+	printf("FS Latency (ns):\n");
+	printf("%-12s %10s %10s %10s %10s %10s %10s\n",
+	       "op", "count", "avg", "p50", "p99", "p999", "max");
+	for (op = 0; op < FS_OP_COUNT; op++) {
+		fs_latency_get(op, &lat);
+		if (!lat.count)
+			continue;
+		printf("%-12s %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+		       " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+		       op_names[op], lat.count, lat.sum_ns / lat.count,
+		       fs_latency_percentile(&lat, 50.0),
+		       fs_latency_percentile(&lat, 99.0),
+		       fs_latency_percentile(&lat, 99.9),
+		       lat.max_ns);
+	}
+
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_BITS	12
+#define MIN_MATCH	4
+/* The last match starts this far from the end at the latest, and ends at
+   least LAST_LITERALS bytes before it, as in LZ4 */
+#define MF_LIMIT	12
+#define LAST_LITERALS	5
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Append the extension bytes of a length that did not fit in 4 bits */
+static uint8_t *put_len(uint8_t *op, size_t n)
+{
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = n;
+	return op;
+}
+
+/* Emit @lit literals from @anchor, followed by a match unless @mlen is 0 */
+static uint8_t *put_seq(uint8_t *op, const uint8_t *oend,
+			const uint8_t *anchor, size_t lit, size_t off,
+			size_t mlen)
+{
+	size_t need = 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+	uint8_t *token = op++;
+
+	if (need > (size_t)(oend - token))
+		return NULL;
+
+	*token = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15)
+		op = put_len(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	if (!mlen)
+		return op;
+
+	*op++ = off & 0xff;
+	*op++ = off >> 8;
+	mlen -= MIN_MATCH;
+	*token |= mlen >= 15 ? 15 : mlen;
+	if (mlen >= 15)
+		op = put_len(op, mlen - 15);
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len;
+	const uint8_t *mflimit = len > MF_LIMIT ? end - MF_LIMIT : in;
+	uint8_t *op = dst, *oend = op + cap;
+	uint16_t table[1 << HASH_BITS];
+
+	if (len > LZ_MAX_INPUT)
+		return 0;
+
+	memset(table, 0, sizeof(table));
+	while (ip < mflimit) {
+		uint32_t seq = load32(ip);
+		uint32_t h = hash(seq);
+		const uint8_t *ref = in + table[h];
+		const uint8_t *mp, *rp;
+
+		table[h] = ip - in;
+		if (ref >= ip || load32(ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		mp = ip + MIN_MATCH;
+		rp = ref + MIN_MATCH;
+		while (mp < end - LAST_LITERALS && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+
+		op = put_seq(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+		if (!op)
+			return 0;
+		ip = anchor = mp;
+	}
+
+	op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+	if (!op)
+		return 0;
+	return op - (uint8_t *)dst;
+}
+
+/* Read the extension bytes of a length, or return -1 past @iend */
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *op = dst, *oend = op + cap;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		size_t lit = token >> 4, mlen = token & 15, off;
+		const uint8_t *ref;
+
+		if (lit == 15 && get_len(&ip, iend, &lit))
+			return -1;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - (uint8_t *)dst))
+			return -1;
+
+		if (mlen == 15 && get_len(&ip, iend, &mlen))
+			return -1;
+		mlen += MIN_MATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+
+		ref = op - off;
+		if (off >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			/* overlapping match repeats the last @off bytes */
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,38 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+
+/* Largest input accepted by lz_compress() (offsets are 16 bits) */
+#define LZ_MAX_INPUT 65535
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Length of @src in bytes, at most %LZ_MAX_INPUT
+ * @dst: Output buffer
+ * @cap: Size of @dst in bytes
+ *
+ * Greedy LZ77 compression with a single-entry hash table, producing the LZ4
+ * block format (sequences of literals and 4+ byte matches, 16-bit offsets).
+ *
+ * Return: Compressed length, or 0 if it would not fit in @cap bytes.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer produced by lz_compress()
+ * @src: Compressed data
+ * @len: Length of @src in bytes
+ * @dst: Output buffer
+ * @cap: Size of @dst in bytes
+ *
+ * Every offset and length is checked, so corrupted input cannot make it read
+ * or write out of bounds.
+ *
+ * Return: Decompressed length, or -1 if @src is malformed or does not fit in
+ * @cap bytes.
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */
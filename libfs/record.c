@@ -0,0 +1,229 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+#include "latency.h"
+
+/*
+ * Workload recording layer.
+ *
+ * Programs opt in at link time by wrapping the public calls (see the RECORD
+ * variable in apps/Makefile): ``-Wl,--wrap=fs_read`` sends their calls to
+ * __wrap_fs_read() below, which forwards to the real fs_read() and, when the
+ * FS_RECORD environment variable names an output file, logs a &struct
+ * fs_record for it. Programs that are not linked with the wrappers do not
+ * contain this layer at all.
+ */
+
+int __real_fs_mount(const char *diskname);
+int __real_fs_umount(void);
+int __real_fs_create(const char *filename);
+int __real_fs_delete(const char *filename);
+int __real_fs_open(const char *filename);
+int __real_fs_close(int fd);
+int __real_fs_stat(int fd);
+int __real_fs_lseek(int fd, size_t offset);
+int __real_fs_write(int fd, void *buf, size_t count);
+int __real_fs_read(int fd, void *buf, size_t count);
+int __real_fs_mkdir(const char *path);
+
+static pthread_once_t rec_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *rec_file;
+static uint64_t rec_start;
+
+/* File offset of each open descriptor, as seen through the recorded calls */
+static uint32_t *rec_offsets;
+static size_t rec_noffsets;
+
+static void rec_close(void)
+{
+	pthread_mutex_lock(&rec_lock);
+	if (rec_file)
+		fclose(rec_file);
+	rec_file = NULL;
+	pthread_mutex_unlock(&rec_lock);
+}
+
+static void rec_init(void)
+{
+	const char *path = getenv("FS_RECORD");
+	uint64_t magic = FS_RECORD_MAGIC;
+
+	if (!path || !*path)
+		return;
+
+	rec_file = fopen(path, "w");
+	if (!rec_file) {
+		perror("fopen");
+		return;
+	}
+	setvbuf(rec_file, NULL, _IOFBF, 1 << 20);
+	fwrite(&magic, sizeof(magic), 1, rec_file);
+
+	rec_start = lat_now();
+	atexit(rec_close);
+}
+
+static int rec_enabled(void)
+{
+	pthread_once(&rec_once, rec_init);
+	return rec_file != NULL;
+}
+
+static uint32_t *rec_offset(int fd)
+{
+	if (fd < 0)
+		return NULL;
+
+	if ((size_t)fd >= rec_noffsets) {
+		size_t n = rec_noffsets ? rec_noffsets : FS_OPEN_MAX_COUNT;
+		uint32_t *offsets;
+
+		while (n <= (size_t)fd)
+			n *= 2;
+		offsets = realloc(rec_offsets, n * sizeof(*offsets));
+		if (!offsets)
+			return NULL;
+		memset(offsets + rec_noffsets, 0,
+		       (n - rec_noffsets) * sizeof(*offsets));
+		rec_offsets = offsets;
+		rec_noffsets = n;
+	}
+
+	return &rec_offsets[fd];
+}
+
+static void rec_log(enum fs_op op, int fd, size_t arg, int ret, uint64_t start,
+		    const char *name)
+{
+	struct {
+		struct fs_record rec;
+		char name[FS_PATH_MAX];
+	} buf;
+	uint64_t end = lat_now();
+	uint32_t *offset;
+	size_t len;
+
+	memset(&buf.rec, 0, sizeof(buf.rec));
+	buf.rec.ts_ns = start - rec_start;
+	buf.rec.dur_ns = end - start;
+	buf.rec.ret = ret;
+	buf.rec.fd = fd;
+	buf.rec.op = op;
+
+	pthread_mutex_lock(&rec_lock);
+	if (!rec_file) {
+		pthread_mutex_unlock(&rec_lock);
+		return;
+	}
+
+	offset = rec_offset(op == FS_OP_OPEN ? ret : fd);
+	switch (op) {
+	case FS_OP_OPEN:
+		if (offset)
+			*offset = 0;
+		break;
+	case FS_OP_LSEEK:
+		buf.rec.offset = arg;
+		if (offset && ret == 0)
+			*offset = arg;
+		break;
+	case FS_OP_READ:
+	case FS_OP_WRITE:
+		buf.rec.size = arg;
+		if (offset) {
+			buf.rec.offset = *offset;
+			if (ret > 0)
+				*offset += ret;
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* Longer paths are invalid: the call failed and still fails with the
+	   name cut */
+	len = name ? strnlen(name, FS_PATH_MAX - 1) : 0;
+	buf.rec.name_len = len;
+	memcpy(buf.name, name, len);
+
+	/* One fwrite per call keeps records from different threads whole */
+	fwrite(&buf, sizeof(buf.rec) + len, 1, rec_file);
+	/* Each mount session is complete on disk once unmounted */
+	if (op == FS_OP_UMOUNT)
+		fflush(rec_file);
+	pthread_mutex_unlock(&rec_lock);
+}
+
+/* Forward a call to libfs, logging it if recording is enabled */
+#define REC_CALL(op, fd, arg, name, call)				\
+	do {								\
+		uint64_t __start;					\
+		int __ret;						\
+									\
+		if (!rec_enabled())					\
+			return call;					\
+		__start = lat_now();					\
+		__ret = call;						\
+		rec_log((op), (fd), (arg), __ret, __start, (name));	\
+		return __ret;						\
+	} while (0)
+
+int __wrap_fs_mount(const char *diskname)
+{
+	REC_CALL(FS_OP_MOUNT, -1, 0, NULL, __real_fs_mount(diskname));
+}
+
+int __wrap_fs_umount(void)
+{
+	REC_CALL(FS_OP_UMOUNT, -1, 0, NULL, __real_fs_umount());
+}
+
+int __wrap_fs_create(const char *filename)
+{
+	REC_CALL(FS_OP_CREATE, -1, 0, filename, __real_fs_create(filename));
+}
+
+int __wrap_fs_delete(const char *filename)
+{
+	REC_CALL(FS_OP_DELETE, -1, 0, filename, __real_fs_delete(filename));
+}
+
+int __wrap_fs_open(const char *filename)
+{
+	REC_CALL(FS_OP_OPEN, -1, 0, filename, __real_fs_open(filename));
+}
+
+int __wrap_fs_close(int fd)
+{
+	REC_CALL(FS_OP_CLOSE, fd, 0, NULL, __real_fs_close(fd));
+}
+
+int __wrap_fs_stat(int fd)
+{
+	REC_CALL(FS_OP_STAT, fd, 0, NULL, __real_fs_stat(fd));
+}
+
+int __wrap_fs_lseek(int fd, size_t offset)
+{
+	REC_CALL(FS_OP_LSEEK, fd, offset, NULL, __real_fs_lseek(fd, offset));
+}
+
+int __wrap_fs_write(int fd, void *buf, size_t count)
+{
+	REC_CALL(FS_OP_WRITE, fd, count, NULL,
+		 __real_fs_write(fd, buf, count));
+}
+
+int __wrap_fs_read(int fd, void *buf, size_t count)
+{
+	REC_CALL(FS_OP_READ, fd, count, NULL, __real_fs_read(fd, buf, count));
+}
+
+int __wrap_fs_mkdir(const char *path)
+{
+	REC_CALL(FS_OP_MKDIR, -1, 0, path, __real_fs_mkdir(path));
+}
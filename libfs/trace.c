@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "fs.h"
+#include "trace.h"
+
+static const char *event_names[FS_TRACE_EVENT_COUNT] = {
+	[FS_TRACE_MOUNT]	= "fs_mount",
+	[FS_TRACE_UMOUNT]	= "fs_umount",
+	[FS_TRACE_CREATE]	= "fs_create",
+	[FS_TRACE_DELETE]	= "fs_delete",
+	[FS_TRACE_OPEN]		= "fs_open",
+	[FS_TRACE_CLOSE]	= "fs_close",
+	[FS_TRACE_LSEEK]	= "fs_lseek",
+	[FS_TRACE_READ]		= "fs_read",
+	[FS_TRACE_WRITE]	= "fs_write",
+	[FS_TRACE_BLOCK_READ]	= "block_read",
+	[FS_TRACE_BLOCK_WRITE]	= "block_write",
+	[FS_TRACE_ALLOC]	= "alloc",
+	[FS_TRACE_FAT_SET]	= "fat_set",
+};
+
+const char *fs_trace_event_name(unsigned int event)
+{
+	if (event >= FS_TRACE_EVENT_COUNT || !event_names[event])
+		return "unknown";
+	return event_names[event];
+}
+
+#ifdef FS_TRACE
+
+/* Records per thread ring (must be a power of two) */
+#define TRACE_RING_SIZE (1 << 16)
+
+/*
+ * Each thread owns one ring and is its only writer, so appending a record is
+ * a plain store followed by a release store of the head. Rings are never
+ * freed; they are pushed on a global list with a CAS so the dumper can find
+ * them without any lock.
+ */
+struct trace_ring {
+	struct trace_ring *next;
+	uint64_t head;
+	uint32_t tid;
+	struct fs_trace_record recs[TRACE_RING_SIZE];
+};
+
+static struct trace_ring *rings;
+static __thread struct trace_ring *ring;
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Raw timestamps come from the TSC and are converted to ns when dumping */
+static inline uint64_t trace_clock(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+#define TRACE_CLOCK_TSC 1
+#else
+static inline uint64_t trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Clock reference taken when the library is loaded */
+static uint64_t ref_raw, ref_ns;
+
+__attribute__((constructor)) static void trace_init(void)
+{
+	ref_raw = trace_clock();
+	ref_ns = mono_ns();
+}
+
+static struct trace_ring *ring_create(void)
+{
+	struct trace_ring *r = calloc(1, sizeof(*r));
+
+	if (!r)
+		return NULL;
+
+	r->tid = syscall(SYS_gettid);
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return r;
+}
+
+void trace_emit(unsigned int event, char phase, uint64_t arg0, uint64_t arg1)
+{
+	struct fs_trace_record *rec;
+
+	if (__builtin_expect(!ring, 0)) {
+		ring = ring_create();
+		if (!ring)
+			return;
+	}
+
+	rec = &ring->recs[ring->head & (TRACE_RING_SIZE - 1)];
+	rec->ts_ns = trace_clock();
+	rec->arg0 = arg0;
+	rec->arg1 = arg1;
+	rec->tid = ring->tid;
+	rec->event = event;
+	rec->phase = phase;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Convert a raw timestamp into CLOCK_MONOTONIC nanoseconds */
+static uint64_t raw_to_ns(uint64_t raw, uint64_t now_raw, uint64_t now_ns)
+{
+#ifdef TRACE_CLOCK_TSC
+	double ns_per_tick;
+
+	if (now_raw == ref_raw)
+		return ref_ns;
+	ns_per_tick = (double)(now_ns - ref_ns) / (double)(now_raw - ref_raw);
+	return ref_ns + (int64_t)((double)((int64_t)(raw - ref_raw)) *
+				  ns_per_tick);
+#else
+	(void)now_raw;
+	(void)now_ns;
+	return raw;
+#endif
+}
+
+int fs_trace_dump(const char *filename)
+{
+	struct fs_trace_header hdr = { .magic = FS_TRACE_MAGIC };
+	struct trace_ring *r;
+	uint64_t now_raw, now_ns;
+	FILE *f;
+
+	if (!filename)
+		return -1;
+
+	f = fopen(filename, "w");
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+
+	now_raw = trace_clock();
+	now_ns = mono_ns();
+
+	/* The record count is filled in once all rings have been copied */
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	/* Oldest surviving record first, ring by ring */
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t i = head < TRACE_RING_SIZE ? 0 : head - TRACE_RING_SIZE;
+
+		for (; i < head; i++) {
+			struct fs_trace_record rec =
+				r->recs[i & (TRACE_RING_SIZE - 1)];
+
+			rec.ts_ns = raw_to_ns(rec.ts_ns, now_raw, now_ns);
+			fwrite(&rec, sizeof(rec), 1, f);
+			hdr.count++;
+		}
+	}
+
+	rewind(f);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	if (fclose(f)) {
+		perror("fclose");
+		return -1;
+	}
+
+	return 0;
+}
+
+#else /* !FS_TRACE */
+
+int fs_trace_dump(const char *filename)
+{
+	(void)filename;
+	fprintf(stderr, "%s: tracing not built in (make TRACE=1)\n", __func__);
+	return -1;
+}
+
+#endif /* FS_TRACE */
@@ -0,0 +1,45 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+#ifdef FS_TRACE
+
+/**
+ * trace_emit - Append a record to the calling thread's trace ring
+ * @event: Event identifier (see enum fs_trace_event)
+ * @phase: Chrome trace phase ('B', 'E' or 'i')
+ * @arg0: First event argument
+ * @arg1: Second event argument
+ */
+void trace_emit(unsigned int event, char phase, uint64_t arg0, uint64_t arg1);
+
+struct trace_scope {
+	unsigned int event;
+};
+
+static inline void trace_scope_end(struct trace_scope *scope)
+{
+	trace_emit(scope->event, 'E', 0, 0);
+}
+
+/* Instant event */
+#define TRACE(ev, a0, a1)	trace_emit((ev), 'i', (a0), (a1))
+
+/* Duration event covering the rest of the enclosing scope */
+#define TRACE_SCOPE(ev, a0, a1)						\
+	struct trace_scope __trace_scope				\
+		__attribute__((cleanup(trace_scope_end))) =		\
+		(trace_emit((ev), 'B', (a0), (a1)), (struct trace_scope){ (ev) })
+
+#else /* !FS_TRACE */
+
+/* Tracepoints compile away entirely when tracing is not built in */
+#define TRACE(ev, a0, a1)	do { } while (0)
+#define TRACE_SCOPE(ev, a0, a1)	do { } while (0)
+
+#endif /* FS_TRACE */
+
+#endif /* _TRACE_H */